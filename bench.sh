@@ -0,0 +1,67 @@
+#!/bin/sh
+# Runs loadgen against the reference backend behind a local relay, once per mode,
+# and prints the results as a JSON array. Used by `make bench`.
+#
+# Environment:
+#	BENCH_PORT relay port -- default 7118
+#	BENCH_CONNECTIONS concurrent connections -- default 64
+#	BENCH_SECONDS length of each run -- default 5
+#	BENCH_THREADS loadgen event loops -- default 1
+#	BENCH_RELAY_ARGS extra relay options, e.g. "-e uring" or "-t 4"
+#	BENCH_BACKEND_ARGS extra echoserver options, e.g. "-m 4" or "-w 0"
+#	BENCH_MUX_P50_LIMIT microseconds of p50 latency the multiplexed run may take before the bench fails -- default 5000
+
+PORT=${BENCH_PORT:-7118}
+CONNECTIONS=${BENCH_CONNECTIONS:-64}
+SECONDS_PER_RUN=${BENCH_SECONDS:-5}
+THREADS=${BENCH_THREADS:-1}
+MUX_P50_LIMIT=${BENCH_MUX_P50_LIMIT:-5000}
+OUT=$(mktemp -d)
+
+# a deep backlog so connection bursts measure the relay rather than SYN retransmits
+./relay -n 127.0.0.1 -p "$PORT" -b 1023 $BENCH_RELAY_ARGS > /dev/null &
+RELAY=$!
+trap 'kill $RELAY 2>/dev/null; rm -rf "$OUT"' EXIT
+sleep 1
+
+# label, backend options, loadgen options
+run() {
+	./echoserver -n 127.0.0.1 -p "$PORT" $BENCH_BACKEND_ARGS $2 > "$OUT/backend" &
+	BACKEND=$!
+	ADDRESS=""
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		ADDRESS=$(sed -n 's/^established relay address: //p' "$OUT/backend")
+		[ -n "$ADDRESS" ] && break
+		sleep 0.5
+	done
+	if [ -z "$ADDRESS" ]; then
+		echo "bench: backend for $1 did not register with the relay" >&2
+		kill $BACKEND 2>/dev/null
+		exit 1
+	fi
+	./loadgen -a "$ADDRESS" -l "$1" -c "$CONNECTIONS" -d "$SECONDS_PER_RUN" -t "$THREADS" $3 > "$OUT/result" || exit 1
+	cat "$OUT/result"
+	kill $BACKEND
+	wait $BACKEND 2>/dev/null
+}
+
+echo "["
+run echo "" "-o echo -i 64"
+echo ","
+run rr "-o rr -i 128 -s 4096" "-o rr -i 128 -s 4096"
+echo ","
+run sink "-o sink" "-o sink -i 65536"
+echo ","
+run source "-o source" "-o source"
+echo ","
+# a new connection per request, measures the request setup path
+run setup "" "-o echo -i 64 -q 1"
+echo ","
+# one connection over carriers, frames held back by Nagle show up as a p50 of tens of milliseconds
+run mux_latency "-m 2" "-o echo -i 64 -c 1"
+echo "]"
+P50=$(sed -n 's/.*"latency_us":{[^}]*"p50":\([0-9]*\).*/\1/p' "$OUT/result")
+if [ "${P50:-0}" -gt "$MUX_P50_LIMIT" ]; then
+	echo "bench: multiplexed p50 latency of ${P50}us is over ${MUX_P50_LIMIT}us" >&2
+	exit 1
+fi
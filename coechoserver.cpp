@@ -0,0 +1,152 @@
+#include "ezcoroutine.h"
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <iostream>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+//Echo server written as one coroutine per request, see ezcoroutine.h
+
+void usage() {
+	std::cout << "Echo's back any information recieved through relay, one coroutine per request." << std::endl;
+	std::cout << "Usage: ./coechoserver -n <relay hostname:string> -p <relay port:integer>" << std::endl;
+	std::cout << "Optional arguments:" << std::endl;
+	std::cout << "    -w <connections:integer> -- idle data connections kept open to the relay -- default value is 4" << std::endl;
+	std::cout << "    -m <carriers:integer> -- multiplex requests over this many connections to the relay -- default value is 0, off" << std::endl;
+	std::cout << "    -d <milliseconds:integer> -- waits this long before echoing what was received -- default value is 0" << std::endl;
+	std::cout << "    -v -- prints debug and error information." << std::endl;
+	std::cout << "    -h -- prints this usage information" << std::endl;
+}
+
+void print_exception(const std::exception& e, int level =  0) {
+    std::cerr << std::string(level, ' ') << "exception: " << e.what() << '\n';
+    try {
+        std::rethrow_if_nested(e);
+    } catch(const std::exception& e) {
+        print_exception(e, level+1);
+    } catch(...) {}
+}
+
+static int delay = 0;
+
+EZTask echo(EZCoStream &stream) {
+	char buffer[4096];
+	while(true) {
+		ssize_t len = co_await stream.read(buffer, sizeof(buffer));
+		if(len <= 0) {
+			co_return;
+		}
+		if(delay > 0) {
+			co_await stream.sleep(delay);
+		}
+		if(co_await stream.write(buffer, len) < 0) {
+			co_return;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	std::string hostname = "";
+	int port = -1;
+	int warm = -1;
+	int carriers = -1;
+	int verbose = false;
+	int c;
+	while ((c = getopt (argc, argv, "p:n:w:m:d:hv")) != -1) {
+    	switch (c) {
+			case 'p':
+				port = std::stoi(optarg);
+				break;
+			case 'n':
+				hostname = optarg;
+				break;
+			case 'w':
+				warm = std::stoi(optarg);
+				break;
+			case 'm':
+				carriers = std::stoi(optarg);
+				break;
+			case 'd':
+				delay = std::stoi(optarg);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			case 'h':
+				usage();
+				return 1;
+			case '?':
+				if (optopt == 'p' ||  optopt == 'n' || optopt == 'w' || optopt == 'm' || optopt == 'd') {
+					fprintf (stderr, "Option -%c requires an argument.\n", optopt);
+				}
+				else if (isprint (optopt)) {
+					fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+				}
+				else {
+					fprintf (stderr, "Unknown option character `\\x%x'.\n", optopt);
+				}
+				usage();
+				return 1;
+			default:
+				abort ();
+		}
+	}
+
+	EZRelayClient relayclient;
+
+	if(port == -1) {
+		std::cout << "Missing Argument: Relay port required" << std::endl;
+		usage();
+		return 1;
+	}
+	if(port < 1001 || port > 65535) {
+		std::cout << "Invalid port (1001-65535): " << port << std::endl;
+		usage();
+		return 1;
+	}
+	if(hostname == "") {
+		std::cout << "Missing Argument: Relay hostname required" << std::endl;
+		usage();
+		return 1;
+	}
+	if(warm != -1) {
+		if(warm < 0 || warm > EZRELAY_MAX_POOLED) {
+			std::cout << "Invalid pool size (0-" << EZRELAY_MAX_POOLED << "): " << warm << std::endl;
+			usage();
+			return 1;
+		}
+		relayclient.setPoolSize(warm);
+	}
+	if(carriers != -1) {
+		if(carriers < 0 || carriers > EZRELAY_MAX_POOLED) {
+			std::cout << "Invalid carrier count (0-" << EZRELAY_MAX_POOLED << "): " << carriers << std::endl;
+			usage();
+			return 1;
+		}
+		relayclient.setMultiplexed(carriers);
+	}
+	if(delay < 0) {
+		std::cout << "Invalid delay: " << delay << std::endl;
+		usage();
+		return 1;
+	}
+	if(verbose) {
+		relayclient.setVerboseOutput(true);
+	}
+	relayclient.setRelayHostname(hostname);
+	relayclient.setRelayPort(port);
+	EZCoRunner runner(relayclient);
+	try {
+		relayclient.requestRelay();
+		std::cout << "established relay address: " << relayclient.getRelayAddress() << std::endl;
+		while(runner.run(10000, echo)) {
+			continue;
+		}
+	} catch (const std::exception& e) {
+		print_exception(e);
+		return 1;
+	}
+
+}
@@ -9,8 +9,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <algorithm>
+#include <unordered_map>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 
 #include <fstream>
 
@@ -18,6 +20,14 @@ void usage() {
 	std::cout << "Echo's back any information recieved through relay." << std::endl;
 	std::cout << "Usage: ./echoserver -n <relay hostname:string> -p <relay port:integer>" << std::endl;
 	std::cout << "Optional arguments:" << std::endl;
+	std::cout << "    -w <connections:integer> -- idle data connections kept open to the relay -- default value is 4" << std::endl;
+	std::cout << "    -o <mode:string> -- 'echo' sends back what it receives, 'sink' discards it, 'source' only sends," << std::endl;
+	std::cout << "       'rr' answers every -i bytes received with -s bytes -- default value is 'echo'" << std::endl;
+	std::cout << "    -i <bytes:integer> -- request size in rr mode -- default value is 64" << std::endl;
+	std::cout << "    -s <bytes:integer> -- response size in rr mode, bytes sent per request in source mode with 0 for no end -- default value is 64 for rr, 0 for source" << std::endl;
+	std::cout << "    -m <carriers:integer> -- multiplex requests over this many connections to the relay -- default value is 0, off" << std::endl;
+	std::cout << "    -t <threads:integer> -- worker threads echo mode without -m runs requests on -- default value is 0, the I/O thread" << std::endl;
+	std::cout << "    -g <service:string> -- shares the public port of the named service with every echoserver naming it -- default is a port of its own" << std::endl;
 	std::cout << "    -v -- prints debug and error information." << std::endl;
 	std::cout << "    -h -- prints this usage information" << std::endl;
 }
@@ -34,8 +44,15 @@ void print_exception(const std::exception& e, int level =  0) {
 void echo(int sockid, int echopipe[2]) {
 	char buffer[4096];
 	ssize_t len;
+	int pending = 0;
+	//the socket is non-blocking, send what an earlier call could not before reading more
+	ioctl(echopipe[0], FIONREAD, &pending);
+	if(pending > 0) {
+		splice(echopipe[0], NULL, sockid, NULL, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		return;
+	}
 	try {
-		len = splice(sockid, NULL, echopipe[1], NULL, sizeof(buffer), SPLICE_F_MOVE);
+		len = splice(sockid, NULL, echopipe[1], NULL, sizeof(buffer), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 	} catch(...) {
 		std::throw_with_nested(
 			std::runtime_error("echoserver::echo: Error produced in receiving splice(" + std::to_string(sockid) + ", buffer, " + std::to_string(len) + ", 0).")
@@ -44,7 +61,7 @@ void echo(int sockid, int echopipe[2]) {
 	if(len > 0) {
 		ssize_t sent;
 		try {
-			sent = splice(echopipe[0], NULL, sockid, NULL, len, SPLICE_F_MOVE);
+			sent = splice(echopipe[0], NULL, sockid, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 		} catch(...) {
 			std::throw_with_nested(
 				std::runtime_error("echoserver::echo: Error produced in sending splice(" + std::to_string(sockid) + ", buffer, " + std::to_string(sent) + ", 0).")
@@ -53,13 +70,115 @@ void echo(int sockid, int echopipe[2]) {
 	}
 }
 
+//Echo for multiplexed mode, only takes what can be written back straight away
+void echoStream(EZStream &stream) {
+	char buffer[4096];
+	ssize_t len;
+	while(stream.writable() > 0) {
+		len = stream.read(buffer, std::min(sizeof(buffer), stream.writable()));
+		if(len <= 0) {
+			if(len == 0) {
+				stream.close();
+			}
+			break;
+		}
+		stream.write(buffer, len);
+	}
+}
+
+//Reference backend modes for loadgen, every mode but echo without -m runs on EZStreams
+enum backend_mode {
+	mode_echo = 1,
+	mode_sink,
+	mode_source,
+	mode_rr
+};
+
+struct backend_stream {
+	size_t received; //rr: bytes of the current request received
+	size_t owed; //rr: response bytes not yet written, source: bytes sent
+};
+
+static size_t request_size = 64;
+static size_t response_size = 0;
+static char filler[4096];
+//keyed by stream, a stream's entry goes once it is closed
+static std::unordered_map<EZStream *, backend_stream> backend_streams;
+
+//Drains a stream, returns false once the peer closed it
+static bool discardStream(EZStream &stream, backend_stream *state) {
+	char buffer[4096];
+	while(true) {
+		ssize_t len = stream.read(buffer, sizeof(buffer));
+		if(len == 0) {
+			return false;
+		}
+		if(len < 0) {
+			return true;
+		}
+		if(state != NULL) {
+			state->received += len;
+			state->owed += (state->received / request_size) * response_size;
+			state->received %= request_size;
+		}
+	}
+}
+
+static void finishStream(EZStream &stream) {
+	stream.close();
+	backend_streams.erase(&stream);
+}
+
+void sinkStream(EZStream &stream) {
+	if(!discardStream(stream, NULL)) {
+		finishStream(stream);
+	}
+}
+
+//Writes response_size bytes, or for as long as the peer stays when that is 0
+void sourceStream(EZStream &stream) {
+	backend_stream &state = backend_streams[&stream];
+	if(!discardStream(stream, NULL)) {
+		finishStream(stream);
+		return;
+	}
+	while(stream.writable() > 0 && (response_size == 0 || state.owed < response_size)) {
+		size_t len = std::min(sizeof(filler), stream.writable());
+		if(response_size > 0) {
+			len = std::min(len, response_size - state.owed);
+		}
+		state.owed += stream.write(filler, len);
+	}
+	if(response_size > 0 && state.owed == response_size) {
+		finishStream(stream);
+	}
+}
+
+void rrStream(EZStream &stream) {
+	backend_stream &state = backend_streams[&stream];
+	bool open = discardStream(stream, &state);
+	while(state.owed > 0 && stream.writable() > 0) {
+		state.owed -= stream.write(filler, std::min(std::min(sizeof(filler), stream.writable()), state.owed));
+	}
+	if(!open) {
+		finishStream(stream);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	std::size_t posp, pose;
 	std::string hostname = "";
 	int port = -1;
+	int warm = -1;
+	int carriers = -1;
+	int threads = -1;
+	std::string mode_name = "echo";
+	std::string service = "";
+	backend_mode mode = mode_echo;
+	int response = -1;
 	int verbose = false;
 	int c;
-	while ((c = getopt (argc, argv, "p:n:hv")) != -1) {
+	while ((c = getopt (argc, argv, "p:n:w:m:o:i:s:t:g:hv")) != -1) {
     	switch (c) {
 			case 'p':
 				port = std::stoi(optarg, &posp);
@@ -67,6 +186,27 @@ int main(int argc, char *argv[]) {
 			case 'n':
 				hostname = optarg;
 				break;
+			case 'w':
+				warm = std::stoi(optarg);
+				break;
+			case 'm':
+				carriers = std::stoi(optarg);
+				break;
+			case 't':
+				threads = std::stoi(optarg);
+				break;
+			case 'g':
+				service = optarg;
+				break;
+			case 'o':
+				mode_name = optarg;
+				break;
+			case 'i':
+				request_size = std::stoul(optarg);
+				break;
+			case 's':
+				response = std::stoi(optarg);
+				break;
 			case 'v':
 				verbose = true;
 				break;
@@ -74,7 +214,7 @@ int main(int argc, char *argv[]) {
 				usage();
 				return 1;
 			case '?':
-				if (optopt == 'p' ||  optopt == 'n') {
+				if (optopt == 'p' ||  optopt == 'n' || optopt == 'w' || optopt == 'm' || optopt == 'o' || optopt == 'i' || optopt == 's' || optopt == 't' || optopt == 'g') {
 					fprintf (stderr, "Option -%c requires an argument.\n", optopt);
 				}
 				else if (isprint (optopt)) {
@@ -107,16 +247,89 @@ int main(int argc, char *argv[]) {
 		usage();
 		return 1;
 	}
+	if(warm != -1) {
+		if(warm < 0 || warm > EZRELAY_MAX_POOLED) {
+			std::cout << "Invalid pool size (0-" << EZRELAY_MAX_POOLED << "): " << warm << std::endl;
+			usage();
+			return 1;
+		}
+		relayclient.setPoolSize(warm);
+	}
+	if(carriers != -1) {
+		if(carriers < 0 || carriers > EZRELAY_MAX_POOLED) {
+			std::cout << "Invalid carrier count (0-" << EZRELAY_MAX_POOLED << "): " << carriers << std::endl;
+			usage();
+			return 1;
+		}
+		relayclient.setMultiplexed(carriers);
+	}
+	if(threads != -1) {
+		if(threads < 0 || threads > 256) {
+			std::cout << "Invalid worker thread count (0-256): " << threads << std::endl;
+			usage();
+			return 1;
+		}
+		relayclient.setWorkerThreads(threads);
+	}
+	if(mode_name == "echo") {
+		mode = mode_echo;
+	} else if(mode_name == "sink") {
+		mode = mode_sink;
+	} else if(mode_name == "source") {
+		mode = mode_source;
+	} else if(mode_name == "rr") {
+		mode = mode_rr;
+		response_size = 64;
+	} else {
+		std::cout << "Invalid mode (echo, sink, source, rr): " << mode_name << std::endl;
+		usage();
+		return 1;
+	}
+	if(response != -1) {
+		if(response < 0 || (mode == mode_rr && response == 0)) {
+			std::cout << "Invalid response size: " << response << std::endl;
+			usage();
+			return 1;
+		}
+		response_size = response;
+	}
+	if(request_size < 1) {
+		std::cout << "Invalid request size: " << request_size << std::endl;
+		usage();
+		return 1;
+	}
+	memset(filler, 'x', sizeof(filler));
 	if(verbose) {
 		relayclient.setVerboseOutput(true);
 	}
 	relayclient.setRelayHostname(hostname);
 	relayclient.setRelayPort(port);
-	int relaysocket = relayclient.requestRelay();
-	std::string relayInfo; 
-	bool result = relayclient.readLine(relaysocket, relayInfo);
-	std::cout << "established relay address: " << relayInfo << std::endl;
+	if(service != "") {
+		if(service.size() > EZCTL_MAX_SERVICE) {
+			std::cout << "Invalid service name (1-" << EZCTL_MAX_SERVICE << " bytes): " << service << std::endl;
+			usage();
+			return 1;
+		}
+		relayclient.setService(service);
+	}
 	try {
+		relayclient.requestRelay();
+		std::cout << "established relay address: " << relayclient.getRelayAddress() << std::endl;
+		std::function<void(EZStream &)> handler;
+		if(mode == mode_sink) {
+			handler = sinkStream;
+		} else if(mode == mode_source) {
+			handler = sourceStream;
+		} else if(mode == mode_rr) {
+			handler = rrStream;
+		} else if(relayclient.getMultiplexed() > 0) {
+			handler = echoStream;
+		}
+		if(handler) {
+			while(relayclient.run(10000, handler)) {
+				continue;
+			}
+		}
 		while(relayclient.run(10000, echo)) {
 			continue;
 		}
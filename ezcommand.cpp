@@ -0,0 +1,73 @@
+#include "ezcommand.h"
+#include <stdexcept>
+#include <exception>
+
+EZCommandQueue::EZCommandQueue() {
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(wake_fd == -1) {
+		std::throw_with_nested(
+			std::runtime_error("EZCommandQueue::EZCommandQueue: Error produced in eventfd(), errno " + std::to_string(errno) + ".")
+		);
+	}
+	slots = new slot[EZCMD_SLOTS];
+	for(size_t i = 0; i < EZCMD_SLOTS; i++) {
+		slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	enqueue_pos.store(0);
+	dequeue_pos = 0;
+}
+
+EZCommandQueue::~EZCommandQueue() {
+	delete[] slots;
+	close(wake_fd);
+}
+
+bool EZCommandQueue::push(const EZRelayCommand &command) {
+	size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+	slot *s;
+	while(true) {
+		s = &slots[pos & (EZCMD_SLOTS - 1)];
+		size_t sequence = s->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		if(diff == 0) {
+			if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		} else if(diff < 0) {
+			return false;
+		} else {
+			pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+	s->command = command;
+	s->sequence.store(pos + 1, std::memory_order_release);
+	uint64_t one = 1;
+	//only fails with EAGAIN once the counter is full, which leaves it readable anyway
+	ssize_t woken = write(wake_fd, &one, sizeof(one));
+	(void)woken;
+	return true;
+}
+
+bool EZCommandQueue::pop(EZRelayCommand &command) {
+	slot &s = slots[dequeue_pos & (EZCMD_SLOTS - 1)];
+	if(s.sequence.load(std::memory_order_acquire) != dequeue_pos + 1) {
+		return false;
+	}
+	command = s.command;
+	//drop the promise here, not when a later push overwrites the slot
+	s.command.reply.reset();
+	s.sequence.store(dequeue_pos + EZCMD_SLOTS, std::memory_order_release);
+	dequeue_pos++;
+	return true;
+}
+
+int EZCommandQueue::wakeFd() {
+	return wake_fd;
+}
+
+void EZCommandQueue::clearWake() {
+	uint64_t count;
+	while(read(wake_fd, &count, sizeof(count)) == -1 && errno == EINTR) {
+		continue;
+	}
+}
@@ -0,0 +1,63 @@
+// ezcommand.h
+#include <atomic>
+#include <memory>
+#include <future>
+#include <string>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#ifndef _EZCOMMAND_H
+#define _EZCOMMAND_H
+
+#define EZCMD_SLOTS 256 //power of two, pushes fail once this many are waiting
+
+//What another thread asks of a running relay, see EZRelay::postDrain() and the others
+enum ez_relay_command {
+	ezcmd_wake = 1, //nothing, run() returns
+	ezcmd_stop_listening, //closes the listeners, run() does not listen again until listen() is called
+	ezcmd_evict_client, //closes the client on port and everything it owns
+	ezcmd_drain, //stops listening and refuses new requests, open ones are left to finish
+	ezcmd_collect_stats, //fulfils reply with renderStats()
+	ezcmd_hand_off //sends the relay's sockets over sockid and drains, fulfils reply once they are sent
+};
+
+struct EZRelayCommand {
+	uint8_t type;
+	int port; //evict: the client's public port
+	int sockid; //hand off: connected hand-off socket, see ezhandoff.h
+	std::shared_ptr<std::promise<std::string> > reply; //collect stats and hand off only
+};
+
+//Bounded multi-producer ring drained by the relay's loop, the same scheme as the logger's.
+//Producers claim a slot with a compare-and-swap and publish it through the slot's sequence number,
+//then wake the loop through an eventfd it polls. The loop never takes a lock for it.
+class EZCommandQueue {
+
+private:
+	struct slot {
+		std::atomic<size_t> sequence;
+		EZRelayCommand command;
+	};
+	slot *slots;
+	std::atomic<size_t> enqueue_pos;
+	size_t dequeue_pos; //loop thread only
+	int wake_fd;
+
+public:
+	//constructor, throws if the eventfd cannot be created
+	EZCommandQueue();
+	~EZCommandQueue();
+
+	//any thread, returns false if the ring is full
+	bool push(const EZRelayCommand &command);
+	//loop thread, takes the oldest command, false if there is none
+	bool pop(EZRelayCommand &command);
+
+	//readable while commands were pushed since the last clearWake()
+	int wakeFd();
+	//loop thread, call before popping so a push racing with it wakes the loop again
+	void clearWake();
+};
+
+#endif // EZCOMMAND.h
@@ -0,0 +1,102 @@
+// ezconnection.h
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include "ezcontrol.h"
+#include "ezstats.h"
+#include "eztrace.h"
+#include "ezlimit.h"
+#ifndef _EZCONNECTION_H
+#define _EZCONNECTION_H
+
+//What a socket is to the relay, kept in its EZConnection entry
+enum ez_conn_type {
+	conn_free = 0, //not a socket the relay owns
+	conn_comms, //listener new clients connect to
+	conn_client_control, //a client's connection to the relay, OPEN commands go out on it
+	conn_client_listener, //public listener of a client, external requests arrive here
+	conn_service_listener, //public listener shared by the clients serving one service, see EZRelay::pickMember
+	conn_request, //data socket, forwards to peer once paired
+	conn_rendezvous, //listener every client data connection connects to
+	conn_rendezvous_pending, //data connection that has not sent its hello yet, belongs to no client
+	conn_pool_idle, //authenticated pooled data connection waiting for a request
+	conn_mux_carrier, //client connection carrying multiplexed streams
+	conn_stream, //external request multiplexed over peer, a carrier
+	conn_stats_listener, //local listener the stats endpoint is served on
+	conn_stats, //stats reader, gets one snapshot and is closed
+	conn_commands //eventfd other threads wake the loop through, see ezcommand.h
+};
+
+enum ez_close_state {
+	close_none = 0,
+	close_queued,
+	close_done
+};
+
+//One entry per fd in EZRelay's connection table.
+//runHandler dispatches on type, so handling an event is a single indexed load
+//instead of a lookup in one map per socket role.
+struct EZConnection {
+	uint8_t type;
+	uint8_t close_state;
+	bool blocked; //peer is full, reading paused until it reports POLLOUT; carrier: polled for POLLOUT
+	bool paused; //stream: out of window or its carrier is full, not read until resumed
+	bool forward_queued; //request: listed in its client's forward_queue
+	//io_uring flow state
+	bool accepting; //listener with an accept armed
+	bool in_pending, out_pending, closing;
+	bool eof; //flow: source finished; stream: the client closed it
+	bool uring_in_armed, uring_out_armed; //one-shot polls in flight, see EZRelay::watchSocket
+	short interest; //events watchSocket was last asked for
+	int peer; //request: paired socket, -1 until paired; stream: its carrier
+	int client; //index in EZRelay's client table, -1 for none
+	int client_prev, client_next; //neighbours in its client's list of connections, -1 at either end
+	int pipe_fds[2]; //pipe carrying this socket's data to peer
+	uint32_t generation; //bumped when the entry is opened or reset, stale events and close requests are dropped
+	size_t in_pipe; //bytes spliced in but not yet delivered to peer; stream: bytes waiting in stream_pending
+	uint32_t splice_chunk; //request: bytes asked of each splice from this socket, adapted by EZRelay::adaptSplice
+	uint32_t pipe_capacity; //request: capacity of the leased pipe, 0 until it is first resized
+	bool pipe_limited; //request: the kernel refused to grow the pipe, the chunk stays within it
+	uint32_t send_window; //stream: bytes that may still be sent to the client
+	uint64_t open_token; //request: token of the OPEN the client has not answered yet, 0 for none
+	bool external; //request or stream accepted on a client's public port, counted in its client's stats
+	uint64_t accepted_at; //external: monotonic microseconds when it was accepted
+	uint64_t last_active; //request or stream: monotonic milliseconds data last moved from it, see EZRelay::expireTimers
+	bool traced; //external: sampled by the request tracer and not yet finished
+	uint64_t trace_at[EZTRACE_STAGES]; //traced: monotonic microseconds each setup stage was reached, 0 until then
+};
+
+//A client registered through the comms port, indexed by the client field of its connections
+struct EZClient {
+	bool in_use;
+	int port; //public port external requests connect to
+	int listener;
+	int service_listener; //listener of the service it serves, -1 for none; requests from it are handed to it like its own
+	int control_socket;
+	int first_connection; //head of the list of every socket it owns, linked through EZConnection::client_next
+	EZControlChannel control;
+	bool greeted; //HELLO received and answered
+	std::vector<std::string> pending_opens; //OPEN tokens queued this loop iteration, sent together by flushControl()
+	bool control_dirty; //listed in EZRelay::dirty_clients
+	std::vector<std::pair<int, uint32_t> > traced_opens; //traced requests and their generations with an OPEN in pending_opens
+	EZClientStats stats;
+	std::string token; //pooled data connections and carriers must present this
+	std::vector<int> idle_pool; //conn_pool_idle sockets, most recently added last
+	std::vector<int> mux_carriers; //conn_mux_carrier sockets, new streams are spread over them
+	size_t next_carrier;
+	int setup_timeout; //ms its OPENs may go unanswered, 0 for no limit
+	int idle_timeout; //ms its paired requests may move no data, 0 for no limit
+	//Rate limits, see EZRelay::scheduleForwarding(). Requests over them wait, none are dropped.
+	EZTokenBucket byte_bucket; //bytes its requests forward, both directions together
+	EZTokenBucket request_bucket; //requests accepted on its public port
+	std::deque<std::pair<int, uint32_t> > forward_queue; //requests and generations with data to forward, served in turn
+	bool forward_active; //listed in EZRelay::active_clients
+	bool forward_throttled; //out of byte tokens, its queue waits for the bucket to refill
+	bool accept_deferred; //out of request tokens, new requests wait in the listener's backlog
+	bool throttle_listed; //listed in EZRelay::throttled_clients
+	std::vector<int> deferred_accepts; //io_uring: sockets accepted over the request limit, opened as tokens come
+};
+
+#endif // EZCONNECTION.h
@@ -0,0 +1,174 @@
+#include "ezcontrol.h"
+
+static void appendU16(std::string &s, int value) {
+	s.push_back((char)(value >> 8));
+	s.push_back((char)value);
+}
+
+static int readU16(const unsigned char *p) {
+	return ((int)p[0] << 8) | p[1];
+}
+
+EZControlChannel::EZControlChannel() {
+	in_offset = 0;
+	out_offset = 0;
+}
+
+void EZControlChannel::queueMessage(uint8_t type, const std::string &body) {
+	appendU16(out, (int)body.size());
+	out.push_back((char)type);
+	out.append(body);
+}
+
+void EZControlChannel::queueHello(const std::string &service) {
+	std::string body;
+	body.push_back((char)EZCTL_MIN_VERSION);
+	body.push_back((char)EZCTL_VERSION);
+	body.append(service, 0, EZCTL_MAX_SERVICE);
+	queueMessage(EZCTL_HELLO, body);
+}
+
+void EZControlChannel::queueWelcome(const welcome &w) {
+	std::string body;
+	body.push_back((char)w.version);
+	appendU16(body, w.port);
+	appendU16(body, w.rendezvous_port);
+	body.append(w.token);
+	body.append(w.hostname);
+	queueMessage(EZCTL_WELCOME, body);
+}
+
+void EZControlChannel::queueReject() {
+	std::string body;
+	body.push_back((char)EZCTL_MIN_VERSION);
+	body.push_back((char)EZCTL_VERSION);
+	queueMessage(EZCTL_REJECT, body);
+}
+
+void EZControlChannel::queueOpens(const std::vector<std::string> &tokens) {
+	queueTokens(EZCTL_OPEN, tokens);
+}
+
+void EZControlChannel::queueOpenFailures(const std::vector<std::string> &tokens) {
+	queueTokens(EZCTL_OPEN_FAILED, tokens);
+}
+
+void EZControlChannel::queueTokens(uint8_t type, const std::vector<std::string> &tokens) {
+	const size_t per_message = EZCTL_MAX_BODY / EZRELAY_TOKEN_LENGTH;
+	for(size_t first = 0; first < tokens.size(); first += per_message) {
+		size_t last = std::min(tokens.size(), first + per_message);
+		std::string body;
+		body.reserve((last - first) * EZRELAY_TOKEN_LENGTH);
+		for(size_t i = first; i < last; i++) {
+			body.append(tokens[i], 0, EZRELAY_TOKEN_LENGTH);
+		}
+		queueMessage(type, body);
+	}
+}
+
+size_t EZControlChannel::pending() {
+	return out.size() - out_offset;
+}
+
+bool EZControlChannel::fill(int sockid) {
+	//drop what has been parsed, a message may have been split across reads
+	if(in_offset > 0) {
+		in.erase(0, in_offset);
+		in_offset = 0;
+	}
+	char buffer[4096];
+	while(true) {
+		ssize_t len = recv(sockid, buffer, sizeof(buffer), 0);
+		if(len > 0) {
+			in.append(buffer, len);
+		} else if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		} else if(len == -1 && errno == EINTR) {
+			continue;
+		} else {
+			return false;
+		}
+	}
+}
+
+bool EZControlChannel::nextMessage(message &m) {
+	if(in.size() - in_offset < EZCTL_HEADER_SIZE) {
+		return false;
+	}
+	const unsigned char *h = (const unsigned char *)in.data() + in_offset;
+	size_t length = readU16(h);
+	if(in.size() - in_offset < EZCTL_HEADER_SIZE + length) {
+		return false;
+	}
+	m.type = h[2];
+	m.body = h + EZCTL_HEADER_SIZE;
+	m.length = length;
+	in_offset += EZCTL_HEADER_SIZE + length;
+	return true;
+}
+
+bool EZControlChannel::flush(int sockid) {
+	while(out_offset < out.size()) {
+		ssize_t sent = send(sockid, out.data() + out_offset, out.size() - out_offset, MSG_NOSIGNAL);
+		if(sent > 0) {
+			out_offset += sent;
+		} else if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		} else if(sent == -1 && errno == EINTR) {
+			continue;
+		} else {
+			return false;
+		}
+	}
+	out.clear();
+	out_offset = 0;
+	return true;
+}
+
+void EZControlChannel::exportBuffers(std::string &input, std::string &output) {
+	input.assign(in, in_offset, std::string::npos);
+	output.assign(out, out_offset, std::string::npos);
+}
+
+void EZControlChannel::importBuffers(const std::string &input, const std::string &output) {
+	in = input;
+	out = output;
+	in_offset = out_offset = 0;
+}
+
+bool EZControlChannel::parseVersions(const message &m, uint8_t &lowest, uint8_t &highest) {
+	if(m.length < 2) {
+		return false;
+	}
+	lowest = m.body[0];
+	highest = m.body[1];
+	return lowest <= highest;
+}
+
+bool EZControlChannel::parseWelcome(const message &m, welcome &w) {
+	const size_t fixed = 5 + EZRELAY_TOKEN_LENGTH;
+	if(m.length < fixed) {
+		return false;
+	}
+	w.version = m.body[0];
+	w.port = readU16(m.body + 1);
+	w.rendezvous_port = readU16(m.body + 3);
+	w.token.assign((const char *)m.body + 5, EZRELAY_TOKEN_LENGTH);
+	w.hostname.assign((const char *)m.body + fixed, m.length - fixed);
+	return true;
+}
+
+std::string EZControlChannel::helloService(const message &m) {
+	if(m.length <= 2) {
+		return "";
+	}
+	return std::string((const char *)m.body + 2, std::min(m.length - 2, (size_t)EZCTL_MAX_SERVICE));
+}
+
+size_t EZControlChannel::openCount(const message &m) {
+	return m.length / EZRELAY_TOKEN_LENGTH;
+}
+
+std::string EZControlChannel::openToken(const message &m, size_t index) {
+	return std::string((const char *)m.body + index * EZRELAY_TOKEN_LENGTH, EZRELAY_TOKEN_LENGTH);
+}
@@ -0,0 +1,94 @@
+// ezcontrol.h
+#include <string>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "ezprotocol.h"
+#ifndef _EZCONTROL_H
+#define _EZCONTROL_H
+
+//Framing for the control socket between a client and the relay.
+//Each message is a 3 byte header, all fields big endian, followed by the body:
+//	uint16 body length, uint8 type
+#define EZCTL_HEADER_SIZE 3
+#define EZCTL_MAX_BODY 65535
+//control protocol versions this build speaks
+//version 2 replaced the per-request ports of OPEN with one-time tokens for the rendezvous port
+//version 3 lets the client report OPENs it could not connect back for
+//version 4 lets the client name a service in its HELLO, clients naming the same one share its public port
+#define EZCTL_MIN_VERSION 2
+#define EZCTL_VERSION 4
+#define EZCTL_MAX_SERVICE 255 //bytes in a service name
+
+enum ez_control_message {
+	EZCTL_HELLO = 1, //client to relay, first message: uint8 lowest version, uint8 highest version
+	//	then, from version 4, the name of the service the client serves taking the rest of the body, none if empty
+	EZCTL_WELCOME, //relay to client: uint8 version, uint16 public port, uint16 rendezvous port, token, hostname
+	//	the token is EZRELAY_TOKEN_LENGTH bytes, the hostname takes the rest of the body
+	EZCTL_REJECT, //relay to client, no common version: uint8 lowest version, uint8 highest version
+	EZCTL_OPEN, //relay to client: one EZRELAY_TOKEN_LENGTH token per request to connect back for
+	EZCTL_OPEN_FAILED //client to relay, version 3: tokens of OPENs whose connection failed, laid out as OPEN
+};
+
+//Buffers one control socket in both directions
+class EZControlChannel {
+
+private:
+	std::string in, out;
+	size_t in_offset, out_offset;
+
+	void queueTokens(uint8_t type, const std::vector<std::string> &tokens);
+
+public:
+	struct message {
+		uint8_t type;
+		const unsigned char *body; //valid until the next fill()
+		size_t length;
+	};
+	struct welcome {
+		uint8_t version;
+		int port, rendezvous_port;
+		std::string token, hostname;
+	};
+
+	//constructor
+	EZControlChannel();
+
+	void queueMessage(uint8_t type, const std::string &body);
+	//service is "" for a client with a public port of its own
+	void queueHello(const std::string &service);
+	void queueWelcome(const welcome &w);
+	void queueReject();
+	//packs as many tokens into each OPEN as fit
+	void queueOpens(const std::vector<std::string> &tokens);
+	//same for OPEN_FAILED
+	void queueOpenFailures(const std::vector<std::string> &tokens);
+	//bytes queued and not yet written to the socket
+	size_t pending();
+
+	//reads what the non-blocking socket has, returns false once it is closed or failed
+	bool fill(int sockid);
+	//takes the next complete message off the input, false if there is none
+	bool nextMessage(message &m);
+	//writes queued messages until the socket would block, returns false if it failed
+	bool flush(int sockid);
+
+	//input not yet taken as messages and output not yet written, to move the channel to another process
+	void exportBuffers(std::string &input, std::string &output);
+	void importBuffers(const std::string &input, const std::string &output);
+
+	//body parsers, return false if the body is malformed
+	static bool parseVersions(const message &m, uint8_t &lowest, uint8_t &highest);
+	static bool parseWelcome(const message &m, welcome &w);
+	//service a HELLO names, "" for none; relays before version 4 ignore it
+	static std::string helloService(const message &m);
+	//number of tokens in an OPEN or OPEN_FAILED and the token at index
+	static size_t openCount(const message &m);
+	static std::string openToken(const message &m, size_t index);
+};
+
+#endif // EZCONTROL.h
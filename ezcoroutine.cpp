@@ -0,0 +1,250 @@
+#include "ezcoroutine.h"
+
+EZCoStream::EZCoStream(EZCoRunner *r, EZStream *s) {
+	stream = s;
+	runner = r;
+	prev = next = NULL;
+	op = op_none;
+	in_buffer = NULL;
+	out_buffer = NULL;
+	length = done = 0;
+	fd = -1;
+	result = 0;
+	sleeping = false;
+}
+
+bool EZCoStream::progress() {
+	switch(op) {
+		case op_read:
+			result = stream->read(in_buffer, length);
+			return !(result == -1 && errno == EAGAIN);
+		case op_write:
+			while(done < length) {
+				ssize_t len = stream->write(out_buffer + done, length - done);
+				if(len == -1 && errno == EAGAIN) {
+					return false;
+				}
+				if(len == -1) {
+					//closed, what was taken is still sent but the write as a whole failed
+					result = -1;
+					return true;
+				}
+				done += len;
+			}
+			result = done;
+			return true;
+		case op_splice:
+			if(stream->readable() == 0 && !stream->isClosed()) {
+				return false;
+			}
+			result = stream->readTo(fd, length);
+			return true;
+		case op_sleep:
+			//only the runner takes it out of the sleepers
+			result = 0;
+			return !sleeping && std::chrono::steady_clock::now() >= wake_at;
+		default:
+			return true;
+	}
+}
+
+bool EZCoStream::operation::await_ready() {
+	return owner.progress();
+}
+
+//the handle is not kept, EZCoRunner resumes the stream's coroutine once the operation can make progress
+void EZCoStream::operation::await_suspend(std::coroutine_handle<>) {
+	if(owner.op == op_sleep) {
+		owner.runner->addSleeper(owner);
+	}
+}
+
+ssize_t EZCoStream::operation::await_resume() {
+	//the runner may have done other work since the write failed
+	if(owner.op == op_write && owner.result == -1) {
+		errno = EPIPE;
+	}
+	owner.op = op_none;
+	return owner.result;
+}
+
+EZCoStream::operation EZCoStream::read(char *buffer, size_t len) {
+	op = op_read;
+	in_buffer = buffer;
+	length = len;
+	return operation(*this);
+}
+
+EZCoStream::operation EZCoStream::write(const char *buffer, size_t len) {
+	op = op_write;
+	out_buffer = buffer;
+	length = len;
+	done = 0;
+	return operation(*this);
+}
+
+EZCoStream::operation EZCoStream::spliceTo(int to_fd, size_t len) {
+	op = op_splice;
+	fd = to_fd;
+	length = len;
+	return operation(*this);
+}
+
+EZCoStream::operation EZCoStream::sleep(int milliseconds) {
+	op = op_sleep;
+	wake_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+	return operation(*this);
+}
+
+void EZCoStream::close() {
+	stream->close();
+}
+
+bool EZCoStream::isClosed() {
+	return stream->isClosed();
+}
+
+uint32_t EZCoStream::getId() {
+	return stream->getId();
+}
+
+int EZCoStream::getSocket() {
+	return stream->getSocket();
+}
+
+EZCoRunner::EZCoRunner(EZRelayClient &relay_client) : client(relay_client) {
+	live = NULL;
+	client.setStreamEndCallback([this](EZStream &stream) {
+		end(stream);
+	});
+}
+
+EZCoRunner::~EZCoRunner() {
+	client.setStreamEndCallback(std::function<void(EZStream &)>());
+	while(live != NULL) {
+		EZCoStream *co = live;
+		co->stream->setContext(NULL);
+		co->stream = NULL;
+		release(co);
+	}
+	for(size_t i = 0; i < sleepers.size(); i++) {
+		delete sleepers[i].co;
+	}
+}
+
+bool EZCoRunner::laterWake(const sleeper &a, const sleeper &b) {
+	return a.wake_at > b.wake_at;
+}
+
+void EZCoRunner::addSleeper(EZCoStream &co) {
+	co.sleeping = true;
+	sleepers.push_back(sleeper{co.wake_at, &co});
+	std::push_heap(sleepers.begin(), sleepers.end(), laterWake);
+}
+
+//Has the client call back the requests whose sleep is over.
+//Returns timeout shortened to the next wake up.
+int EZCoRunner::wakeSleepers(int timeout) {
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	while(!sleepers.empty() && sleepers.front().wake_at <= now) {
+		EZCoStream *co = sleepers.front().co;
+		std::pop_heap(sleepers.begin(), sleepers.end(), laterWake);
+		sleepers.pop_back();
+		co->sleeping = false;
+		if(co->stream == NULL) {
+			//its stream ended while it slept
+			delete co;
+			continue;
+		}
+		client.wakeStream(*co->stream);
+	}
+	if(sleepers.empty()) {
+		return timeout;
+	}
+	//rounded up so the sleep is over once the poll returns
+	int wait = (int)std::chrono::duration_cast<std::chrono::milliseconds>(sleepers.front().wake_at - now + std::chrono::microseconds(999)).count();
+	return (timeout < 0 ? wait : std::min(timeout, wait));
+}
+
+void EZCoRunner::dispatch(EZStream &stream, std::function<EZTask(EZCoStream &)> &handler) {
+	EZCoStream *co = (EZCoStream *)stream.getContext();
+	if(co == NULL) {
+		//a new request, the frame is the only allocation its handler needs
+		co = new EZCoStream(this, &stream);
+		co->next = live;
+		if(live != NULL) {
+			live->prev = co;
+		}
+		live = co;
+		stream.setContext(co);
+		co->handle = handler(*co).handle;
+		resume(*co);
+	} else if(co->handle && co->progress()) {
+		resume(*co);
+	}
+	//a handler busy with something else is not called again just because data is waiting
+	stream.holdInput(co->handle && co->op != EZCoStream::op_read && co->op != EZCoStream::op_splice);
+}
+
+void EZCoRunner::resume(EZCoStream &co) {
+	co.handle.resume();
+	if(!co.handle.done()) {
+		return;
+	}
+	if(co.handle.promise().exception && !failure) {
+		failure = co.handle.promise().exception;
+	}
+	co.handle.destroy();
+	co.handle = nullptr;
+	co.stream->close();
+}
+
+//The client erases the stream after this, its handler goes with it
+void EZCoRunner::end(EZStream &stream) {
+	EZCoStream *co = (EZCoStream *)stream.getContext();
+	if(co == NULL) {
+		return;
+	}
+	stream.setContext(NULL);
+	co->stream = NULL;
+	release(co);
+}
+
+//Destroys a suspended handler and frees its request, unless the sleepers still point to it
+void EZCoRunner::release(EZCoStream *co) {
+	if(co->handle) {
+		co->handle.destroy();
+		co->handle = nullptr;
+	}
+	if(co->prev != NULL) {
+		co->prev->next = co->next;
+	} else {
+		live = co->next;
+	}
+	if(co->next != NULL) {
+		co->next->prev = co->prev;
+	}
+	co->prev = co->next = NULL;
+	if(!co->sleeping) {
+		delete co;
+	}
+}
+
+bool EZCoRunner::run(int timeout, std::function<EZTask(EZCoStream &)> handler) {
+	timeout = wakeSleepers(timeout);
+	bool connected = client.run(timeout, [&](EZStream &stream) {
+		dispatch(stream, handler);
+	});
+	if(failure) {
+		std::exception_ptr e = failure;
+		failure = std::exception_ptr();
+		try {
+			std::rethrow_exception(e);
+		} catch(...) {
+			std::throw_with_nested(
+				std::runtime_error("EZCoRunner::run: Request handler threw.")
+			);
+		}
+	}
+	return connected;
+}
@@ -0,0 +1,143 @@
+// ezcoroutine.h
+#include <coroutine>
+#include <exception>
+#include <stdexcept>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include "ezrelayclient.h"
+#ifndef _EZCOROUTINE_H
+#define _EZCOROUTINE_H
+
+#if __cplusplus < 202002L
+#error "ezcoroutine.h needs C++20, build with -std=c++20"
+#endif
+
+//Coroutine request handlers on top of the EZStream overload of EZRelayClient::run().
+//Every request runs its own coroutine on the thread calling EZCoRunner::run(), suspended
+//while an operation waits for its stream. Operations keep their state in the EZCoStream,
+//so awaiting one allocates nothing.
+
+//Return type of a request handler: EZTask handler(EZCoStream &stream)
+class EZTask {
+
+public:
+	struct promise_type {
+		std::exception_ptr exception;
+
+		EZTask get_return_object() {
+			return EZTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+		}
+		//the runner starts the handler once the request is set up
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		//and destroys it once it finished
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { exception = std::current_exception(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+class EZCoRunner;
+
+//One request as seen by its handler coroutine.
+//One operation may be awaited at a time.
+class EZCoStream {
+	friend class EZCoRunner;
+
+private:
+	enum op_type {
+		op_none = 0,
+		op_read,
+		op_write,
+		op_splice,
+		op_sleep
+	};
+
+	EZStream *stream; //NULL once the stream ended
+	EZCoRunner *runner;
+	std::coroutine_handle<EZTask::promise_type> handle; //empty once the handler returned
+	EZCoStream *prev, *next; //the runner's live requests
+
+	//the awaited operation
+	op_type op;
+	char *in_buffer;
+	const char *out_buffer;
+	size_t length, done;
+	int fd;
+	ssize_t result;
+	std::chrono::steady_clock::time_point wake_at;
+	bool sleeping; //in the runner's sleepers, which then frees it if the stream ends first
+
+	EZCoStream(EZCoRunner *r, EZStream *s);
+	//advances the operation, returns true once it completed and result is set
+	bool progress();
+
+public:
+	class operation {
+
+	private:
+		EZCoStream &owner;
+
+	public:
+		operation(EZCoStream &o) : owner(o) {}
+		bool await_ready();
+		void await_suspend(std::coroutine_handle<> waiting);
+		ssize_t await_resume();
+	};
+
+	//bytes read, 0 once the peer closed and everything was read
+	operation read(char *buffer, size_t length);
+	//writes all of buffer, returns length, or -1 with EPIPE if the stream closed before all of it was taken
+	operation write(const char *buffer, size_t length);
+	//writes up to length bytes of the request straight to fd without copying them out first
+	//returns bytes moved, 0 once the peer closed, or -1 with fd's errno, fd must not block
+	operation spliceTo(int fd, size_t length);
+	//resumes after milliseconds, other requests run meanwhile
+	operation sleep(int milliseconds);
+
+	//ends the request once what was written has been sent, returning from the handler does the same
+	void close();
+	bool isClosed();
+	//see EZStream
+	uint32_t getId();
+	int getSocket();
+};
+
+//Runs a handler coroutine for every request the client receives
+class EZCoRunner {
+	friend class EZCoStream;
+
+private:
+	EZRelayClient &client;
+	struct sleeper {
+		std::chrono::steady_clock::time_point wake_at;
+		EZCoStream *co;
+	};
+	std::vector<sleeper> sleepers; //heap, earliest first
+	EZCoStream *live; //requests whose stream has not ended
+	std::exception_ptr failure; //first handler exception of this run(), rethrown once the client is done
+
+	static bool laterWake(const sleeper &a, const sleeper &b);
+	void addSleeper(EZCoStream &co);
+	int wakeSleepers(int timeout);
+	void dispatch(EZStream &stream, std::function<EZTask(EZCoStream &)> &handler);
+	void resume(EZCoStream &co);
+	void end(EZStream &stream);
+	void release(EZCoStream *co);
+
+public:
+	//takes over the client's stream end callback, must be created before requestRelay()
+	EZCoRunner(EZRelayClient &relay_client);
+	//destroys the handlers still suspended
+	~EZCoRunner();
+
+	//calls the client's run() with a stream callback that starts handler for each new request
+	//and resumes suspended handlers whose operation can complete
+	//a handler that throws ends its request, the exception is rethrown once the client's run() returned
+	bool run(int timeout, std::function<EZTask(EZCoStream &)> handler);
+};
+
+#endif // EZCOROUTINE.h
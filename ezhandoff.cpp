@@ -0,0 +1,158 @@
+#include "ezhandoff.h"
+#include <cstring>
+#include <fcntl.h>
+
+EZHandOffRecord::EZHandOffRecord(uint8_t record_type) {
+	type = record_type;
+	offset = 0;
+}
+
+void EZHandOffRecord::putInt(uint64_t value, int bytes) {
+	for(int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+		body.push_back((char)(value >> shift));
+	}
+}
+
+void EZHandOffRecord::putString(const std::string &value) {
+	putInt(value.size(), 4);
+	body.append(value);
+}
+
+bool EZHandOffRecord::getInt(uint64_t &value, int bytes) {
+	if(body.size() - offset < (size_t)bytes) {
+		return false;
+	}
+	value = 0;
+	for(int i = 0; i < bytes; i++) {
+		value = (value << 8) | (unsigned char)body[offset++];
+	}
+	return true;
+}
+
+bool EZHandOffRecord::getString(std::string &value) {
+	uint64_t length;
+	if(!getInt(length, 4) || body.size() - offset < length) {
+		return false;
+	}
+	value.assign(body, offset, length);
+	offset += length;
+	return true;
+}
+
+bool EZHandOffRecord::send(int sockid) {
+	std::string packet(1, (char)type);
+	packet.append(body);
+	if(packet.size() > EZHANDOFF_MAX_RECORD || fds.size() > EZHANDOFF_MAX_FDS) {
+		errno = EMSGSIZE;
+		return false;
+	}
+	struct iovec iov;
+	iov.iov_base = &packet[0];
+	iov.iov_len = packet.size();
+	char control[CMSG_SPACE(sizeof(int) * EZHANDOFF_MAX_FDS)];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(!fds.empty()) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+		memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+	}
+	ssize_t sent;
+	while((sent = sendmsg(sockid, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+		continue;
+	}
+	return sent == (ssize_t)packet.size();
+}
+
+bool EZHandOffRecord::receive(int sockid) {
+	body.assign(EZHANDOFF_MAX_RECORD, '\0');
+	offset = 0;
+	fds.clear();
+	struct iovec iov;
+	iov.iov_base = &body[0];
+	iov.iov_len = body.size();
+	char control[CMSG_SPACE(sizeof(int) * EZHANDOFF_MAX_FDS)];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t len;
+	while((len = recvmsg(sockid, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+		continue;
+	}
+	if(len > 0) {
+		for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				for(size_t i = 0; i < count; i++) {
+					int fd;
+					memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+					fds.push_back(fd);
+				}
+			}
+		}
+	}
+	if(len <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		closeFds();
+		body.clear();
+		return false;
+	}
+	type = (uint8_t)body[0];
+	body.resize(len);
+	offset = 1;
+	return true;
+}
+
+void EZHandOffRecord::closeFds() {
+	for(size_t i = 0; i < fds.size(); i++) {
+		close(fds[i]);
+	}
+	fds.clear();
+}
+
+static bool handOffAddress(const std::string &path, struct sockaddr_un &addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(addr.sun_path)) {
+		return false;
+	}
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	return true;
+}
+
+int ezHandOffConnect(const std::string &path) {
+	struct sockaddr_un addr;
+	if(!handOffAddress(path, addr)) {
+		return -1;
+	}
+	int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(s != -1 && connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+int ezHandOffListen(const std::string &path) {
+	struct sockaddr_un addr;
+	if(!handOffAddress(path, addr)) {
+		return -1;
+	}
+	//the socket file of the process taken over from, or of one that is gone
+	unlink(path.c_str());
+	int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(s != -1 && (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 || ::listen(s, 1) == -1)) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
@@ -0,0 +1,70 @@
+// ezhandoff.h
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef _EZHANDOFF_H
+#define _EZHANDOFF_H
+
+//Hand-off of a running relay's sockets to a new process, see EZRelay::postHandOff() and EZRelay::takeOver().
+//Records travel over a connected AF_UNIX SOCK_SEQPACKET socket, one record per packet:
+//	uint8 type, then the fields listed for the type, integers big endian,
+//	strings as a uint32 length and the bytes; the sockets a record names ride along as SCM_RIGHTS.
+//Client fields refer to a client by its index in the old relay, the new one maps it to its own.
+#define EZHANDOFF_VERSION 2
+#define EZHANDOFF_MAX_RECORD 131072 //fits the default socket buffer, a larger record is not sent
+#define EZHANDOFF_MAX_FDS 4
+
+enum ez_handoff_record {
+	EZHANDOFF_HELLO = 1, //both ways, first record: uint8 version, uint32 shards
+	EZHANDOFF_LISTENERS, //fds: comms, rendezvous, then the stats listener if there is one
+	EZHANDOFF_CLIENT, //fds: control socket, public listener
+	//	uint32 client, uint8 greeted, uint32 setup timeout, uint32 idle timeout, token,
+	//	unparsed control input, unsent control output, service it serves
+	EZHANDOFF_POOLED, //fd: idle pooled connection; uint32 client
+	EZHANDOFF_CARRIER, //fd: carrier with no streams; uint32 client
+	EZHANDOFF_PENDING, //fd: request waiting for its OPEN; uint32 client, uint64 OPEN token, uint64 accepted at
+	EZHANDOFF_HELLO_PENDING, //fd: data connection that has not sent its hello yet
+	EZHANDOFF_PAIR, //fds: external request, client connection; uint32 client, uint64 accepted at
+	EZHANDOFF_END, //last record of a relay
+	EZHANDOFF_SERVICE //fd: listener shared by a service's clients; service name, sent before the clients
+};
+
+//One record, built with the put functions and read back in the same order with the get ones
+class EZHandOffRecord {
+
+private:
+	std::string body;
+	size_t offset;
+
+public:
+	uint8_t type;
+	std::vector<int> fds; //received ones belong to the caller
+
+	//constructor
+	EZHandOffRecord(uint8_t record_type = 0);
+
+	void putInt(uint64_t value, int bytes);
+	void putString(const std::string &value);
+	//return false once the record runs out
+	bool getInt(uint64_t &value, int bytes);
+	bool getString(std::string &value);
+
+	//sends the record and its fds as one packet on a blocking socket, false if it failed
+	bool send(int sockid);
+	//replaces the record with the next packet, false if the socket failed or closed or the packet was cut short
+	bool receive(int sockid);
+	//closes the fds, for records whose sockets are not taken
+	void closeFds();
+};
+
+//connects to the hand-off socket at path, -1 if nothing listens there
+int ezHandOffConnect(const std::string &path);
+//replaces whatever is at path with a new hand-off listener, -1 if it cannot be bound
+int ezHandOffListen(const std::string &path);
+
+#endif // EZHANDOFF.h
@@ -0,0 +1,51 @@
+#include "ezlimit.h"
+
+EZTokenBucket::EZTokenBucket() {
+	rate = 0;
+	tokens = 0;
+	refilled_at = 0;
+}
+
+void EZTokenBucket::setRate(uint64_t per_second, uint64_t now_us) {
+	rate = per_second;
+	tokens = (double)per_second;
+	refilled_at = now_us;
+}
+
+uint64_t EZTokenBucket::getRate() {
+	return rate;
+}
+
+bool EZTokenBucket::limited() {
+	return rate > 0;
+}
+
+int64_t EZTokenBucket::available(uint64_t now_us) {
+	if(rate == 0) {
+		return INT64_MAX;
+	}
+	if(now_us > refilled_at) {
+		tokens = std::min(tokens + (double)(now_us - refilled_at) * rate / 1000000.0, (double)rate);
+		refilled_at = now_us;
+	}
+	return (int64_t)tokens;
+}
+
+void EZTokenBucket::consume(uint64_t amount) {
+	if(rate > 0) {
+		tokens -= (double)amount;
+	}
+}
+
+int EZTokenBucket::waitMillis(uint64_t wanted, uint64_t now_us) {
+	if(rate == 0) {
+		return 0;
+	}
+	available(now_us);
+	double missing = (double)std::min(wanted, rate) - tokens;
+	if(missing <= 0) {
+		return 0;
+	}
+	//rounded up, a wakeup that comes early only finds the bucket short again
+	return (int)(((uint64_t)(missing * 1000000.0 / rate) + 1000) / 1000);
+}
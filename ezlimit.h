@@ -0,0 +1,35 @@
+// ezlimit.h
+#include <stdint.h>
+#include <algorithm>
+#ifndef _EZLIMIT_H
+#define _EZLIMIT_H
+
+//Token bucket refilled at rate tokens a second, holding at most one second's worth.
+//Refills lazily from the monotonic microseconds it is given, so an idle bucket costs nothing.
+//Consuming may take it below zero, the debt is paid back before it allows anything again;
+//a splice cannot be undone, so what it moved past the allowance is counted this way.
+class EZTokenBucket {
+
+private:
+	uint64_t rate; //tokens a second, 0 for no limit
+	double tokens;
+	uint64_t refilled_at; //microseconds
+
+public:
+	//constructor, unlimited
+	EZTokenBucket();
+
+	//starts full at the new rate, 0 removes the limit
+	void setRate(uint64_t per_second, uint64_t now_us);
+	uint64_t getRate();
+	bool limited();
+
+	//whole tokens there are at now_us, INT64_MAX while unlimited
+	int64_t available(uint64_t now_us);
+	void consume(uint64_t amount);
+	//ms from now_us until there are wanted tokens, wanted is capped at a full bucket; 0 once there are
+	//refills like available()
+	int waitMillis(uint64_t wanted, uint64_t now_us);
+};
+
+#endif // EZLIMIT.h
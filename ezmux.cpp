@@ -0,0 +1,103 @@
+#include "ezmux.h"
+
+EZMuxChannel::EZMuxChannel() {
+	in_offset = 0;
+	out_offset = 0;
+}
+
+void EZMuxChannel::queueFrame(uint32_t stream, uint8_t type, const char *payload, size_t length) {
+	char header[EZMUX_HEADER_SIZE];
+	header[0] = (char)(stream >> 24);
+	header[1] = (char)(stream >> 16);
+	header[2] = (char)(stream >> 8);
+	header[3] = (char)stream;
+	header[4] = (char)type;
+	header[5] = (char)(length >> 16);
+	header[6] = (char)(length >> 8);
+	header[7] = (char)length;
+	out.append(header, sizeof(header));
+	if(length > 0) {
+		out.append(payload, length);
+	}
+}
+
+void EZMuxChannel::queueWindow(uint32_t stream, uint32_t credit) {
+	char payload[4];
+	payload[0] = (char)(credit >> 24);
+	payload[1] = (char)(credit >> 16);
+	payload[2] = (char)(credit >> 8);
+	payload[3] = (char)credit;
+	queueFrame(stream, EZMUX_WINDOW_UPDATE, payload, sizeof(payload));
+}
+
+size_t EZMuxChannel::pending() {
+	return out.size() - out_offset;
+}
+
+size_t EZMuxChannel::buffered() {
+	return in.size() - in_offset;
+}
+
+bool EZMuxChannel::fill(int sockid) {
+	//drop what has been parsed before it grows the buffer
+	if(in_offset > 0 && in_offset * 2 >= in.size()) {
+		in.erase(0, in_offset);
+		in_offset = 0;
+	}
+	char buffer[EZMUX_MAX_PAYLOAD];
+	while(true) {
+		ssize_t len = recv(sockid, buffer, sizeof(buffer), 0);
+		if(len > 0) {
+			in.append(buffer, len);
+		} else if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		} else if(len == -1 && errno == EINTR) {
+			continue;
+		} else {
+			return false;
+		}
+	}
+}
+
+bool EZMuxChannel::nextFrame(frame &f) {
+	if(in.size() - in_offset < EZMUX_HEADER_SIZE) {
+		return false;
+	}
+	const unsigned char *h = (const unsigned char *)in.data() + in_offset;
+	size_t length = ((size_t)h[5] << 16) | ((size_t)h[6] << 8) | h[7];
+	if(in.size() - in_offset < EZMUX_HEADER_SIZE + length) {
+		return false;
+	}
+	f.stream = ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) | ((uint32_t)h[2] << 8) | h[3];
+	f.type = h[4];
+	f.payload = in.data() + in_offset + EZMUX_HEADER_SIZE;
+	f.length = length;
+	in_offset += EZMUX_HEADER_SIZE + length;
+	return true;
+}
+
+bool EZMuxChannel::flush(int sockid) {
+	while(out_offset < out.size()) {
+		ssize_t sent = send(sockid, out.data() + out_offset, out.size() - out_offset, MSG_NOSIGNAL);
+		if(sent > 0) {
+			out_offset += sent;
+		} else if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		} else if(sent == -1 && errno == EINTR) {
+			continue;
+		} else {
+			return false;
+		}
+	}
+	out.clear();
+	out_offset = 0;
+	return true;
+}
+
+uint32_t EZMuxChannel::windowCredit(const frame &f) {
+	if(f.length < 4) {
+		return 0;
+	}
+	const unsigned char *p = (const unsigned char *)f.payload;
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
@@ -0,0 +1,63 @@
+// ezmux.h
+#include <string>
+#include <cstring>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifndef _EZMUX_H
+#define _EZMUX_H
+
+//Framing for multiplexed streams, many requests share one carrier connection.
+//Each frame is an 8 byte header, all fields big endian, followed by the payload:
+//	uint32 stream id, uint8 type, uint24 payload length
+#define EZMUX_HEADER_SIZE 8
+#define EZMUX_MAX_PAYLOAD 16384
+//bytes either side may send on a stream before the receiver grants more with EZMUX_WINDOW_UPDATE
+#define EZMUX_WINDOW 65536
+//output queued on a carrier before its streams stop reading
+#define EZMUX_OUT_LIMIT 262144
+
+enum ez_mux_frame {
+	EZMUX_OPEN = 1, //relay to client, a new request, no payload
+	EZMUX_DATA, //payload is stream data
+	EZMUX_WINDOW_UPDATE, //payload is a uint32 of additional credit
+	EZMUX_CLOSE //stream is finished, no payload
+};
+
+//Buffers one carrier connection in both directions
+class EZMuxChannel {
+
+private:
+	std::string in, out;
+	size_t in_offset, out_offset;
+
+public:
+	struct frame {
+		uint32_t stream;
+		uint8_t type;
+		const char *payload; //valid until the next fill()
+		size_t length;
+	};
+
+	//constructor
+	EZMuxChannel();
+
+	void queueFrame(uint32_t stream, uint8_t type, const char *payload, size_t length);
+	void queueWindow(uint32_t stream, uint32_t credit);
+	//bytes queued and not yet written to the carrier
+	size_t pending();
+	//bytes read from the carrier and not yet taken as frames
+	size_t buffered();
+
+	//reads what the non-blocking carrier has, returns false once it is closed or failed
+	bool fill(int sockid);
+	//takes the next complete frame off the input, false if there is none
+	bool nextFrame(frame &f);
+	//writes queued frames until the carrier would block, returns false if it failed
+	bool flush(int sockid);
+
+	static uint32_t windowCredit(const frame &f);
+};
+
+#endif // EZMUX.h
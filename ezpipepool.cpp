@@ -0,0 +1,85 @@
+#include "ezpipepool.h"
+#include "logger.h"
+
+EZPipePool::EZPipePool() {
+	max_idle = EZPIPEPOOL_DEFAULT_IDLE;
+	pipe_size = 0;
+	verbose = false;
+}
+
+EZPipePool::~EZPipePool() {
+	for(ez_pipe &p : idle_pipes) {
+		close(p.fds[0]);
+		close(p.fds[1]);
+	}
+	idle_pipes.clear();
+}
+
+void EZPipePool::setPipeSize(int bytes) {
+	pipe_size = (bytes > 0 ? bytes : 0);
+	//idle pipes were sized for the old value
+	for(ez_pipe &p : idle_pipes) {
+		resize(p.fds);
+	}
+}
+
+int EZPipePool::getPipeSize() {
+	return pipe_size;
+}
+
+void EZPipePool::setMaxIdle(size_t count) {
+	max_idle = count;
+	while(idle_pipes.size() > max_idle) {
+		close(idle_pipes.back().fds[0]);
+		close(idle_pipes.back().fds[1]);
+		idle_pipes.pop_back();
+	}
+}
+
+void EZPipePool::setVerboseOutput(bool verbose_enabled) {
+	verbose = verbose_enabled;
+}
+
+void EZPipePool::resize(int fds[2]) {
+#ifdef F_SETPIPE_SZ
+	if(pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipe_size) == -1) {
+		//not fatal, the pipe keeps its current capacity
+		EZLOG(Log::wrn, verbose) << "F_SETPIPE_SZ " << pipe_size << " failed, errno " << errno << '\n';
+	}
+#endif
+}
+
+void EZPipePool::lease(int fds[2]) {
+	if(!idle_pipes.empty()) {
+		fds[0] = idle_pipes.back().fds[0];
+		fds[1] = idle_pipes.back().fds[1];
+		idle_pipes.pop_back();
+		return;
+	}
+	if(pipe2(fds, O_CLOEXEC) == -1) {
+		fds[0] = fds[1] = -1;
+		std::throw_with_nested(
+			std::runtime_error("EZPipePool::lease: Error produced in pipe2, errno " + std::to_string(errno) + ".")
+		);
+	}
+	resize(fds);
+}
+
+void EZPipePool::release(int fds[2]) {
+	if(fds[0] == -1 || fds[1] == -1) {
+		return;
+	}
+	int pending = 0;
+	bool reusable = (idle_pipes.size() < max_idle && ioctl(fds[0], FIONREAD, &pending) == 0 && pending == 0);
+	if(reusable) {
+		ez_pipe p;
+		p.fds[0] = fds[0];
+		p.fds[1] = fds[1];
+		idle_pipes.push_back(p);
+	} else {
+		EZLOG(Log::dbg, verbose) << "closing pipe with " << pending << " bytes left" << '\n';
+		close(fds[0]);
+		close(fds[1]);
+	}
+	fds[0] = fds[1] = -1;
+}
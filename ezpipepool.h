@@ -0,0 +1,53 @@
+// ezpipepool.h
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <exception>
+#include <stdexcept>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#ifndef _EZPIPEPOOL_H
+#define _EZPIPEPOOL_H
+
+#define EZPIPEPOOL_DEFAULT_IDLE 64
+
+//Hands out pipe pairs for splice().
+//Each forwarding direction leases its own pipe so data left in it can never reach another connection.
+//Empty pipes are kept for reuse, anything still holding data is closed on release.
+class EZPipePool {
+
+private:
+	struct ez_pipe {
+		int fds[2];
+	};
+	std::vector<ez_pipe> idle_pipes;
+	size_t max_idle;
+	int pipe_size; //bytes requested through F_SETPIPE_SZ, 0 leaves the kernel default
+	bool verbose;
+
+	void resize(int fds[2]);
+
+public:
+	//constructor
+	EZPipePool();
+	~EZPipePool();
+
+	//capacity for every pipe leased from now on, 0 for the kernel default
+	//the kernel rounds up to a power of two pages and caps unprivileged sizes at /proc/sys/fs/pipe-max-size
+	void setPipeSize(int bytes);
+	int getPipeSize();
+
+	//number of empty pipes kept around for reuse
+	void setMaxIdle(size_t count);
+
+	//sets printing of debug info
+	void setVerboseOutput(bool verbose_enabled);
+
+	//fills fds with a read and write end, reusing an idle pipe when there is one
+	void lease(int fds[2]);
+	//returns a pipe to the pool, fds are set to -1
+	void release(int fds[2]);
+};
+
+#endif // EZPIPEPOOL.h
@@ -0,0 +1,269 @@
+#include "ezpoller.h"
+#include "logger.h"
+
+EZPoller::EZPoller() {
+#ifdef EZRELAY_USE_POLL
+	backend = poll_backend;
+#else
+	backend = epoll_backend;
+#endif
+	verbose = false;
+	epoll_fd = -1;
+	registered_count = 0;
+	openBackend();
+}
+
+EZPoller::~EZPoller() {
+	closeBackend();
+}
+
+EZPoller::poll_entry &EZPoller::entryFor(int sockid) {
+	if(sockid >= (int)entries.size()) {
+		poll_entry blank = {false, 0, 0, 0};
+		entries.resize(sockid + 1, blank);
+	}
+	return entries[sockid];
+}
+
+void EZPoller::openBackend() {
+#ifdef __linux__
+	if(backend == epoll_backend) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if(epoll_fd == -1) {
+			std::throw_with_nested(
+				std::runtime_error("EZPoller::openBackend: Error produced in epoll_create1, errno " + std::to_string(errno) + ".")
+			);
+		}
+	}
+#endif
+}
+
+void EZPoller::closeBackend() {
+	if(epoll_fd != -1) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+}
+
+//Switching backends drops nothing because it is refused once sockets are registered.
+void EZPoller::setBackend(backend_type bt) {
+#ifndef __linux__
+	bt = poll_backend;
+#endif
+	if(bt == backend) {
+		return;
+	}
+	if(size() > 0) {
+		std::throw_with_nested(
+			std::runtime_error("EZPoller::setBackend: Unable to change backend to " + backendName(bt) + " with " + std::to_string(size()) + " sockets registered.")
+		);
+	}
+	closeBackend();
+	backend = bt;
+	openBackend();
+}
+
+EZPoller::backend_type EZPoller::getBackend() {
+	return backend;
+}
+
+void EZPoller::setVerboseOutput(bool verbose_enabled) {
+	verbose = verbose_enabled;
+}
+
+#ifdef __linux__
+uint32_t EZPoller::toEpollEvents(short events, bool edge) {
+	uint32_t ev = 0;
+	if(events & POLLIN) {
+		ev |= EPOLLIN;
+	}
+	if(events & POLLOUT) {
+		ev |= EPOLLOUT;
+	}
+	if(edge) {
+		ev |= EPOLLET;
+	}
+	return ev;
+}
+
+short EZPoller::fromEpollEvents(uint32_t events) {
+	short revents = 0;
+	if(events & EPOLLIN) {
+		revents |= POLLIN;
+	}
+	if(events & EPOLLOUT) {
+		revents |= POLLOUT;
+	}
+	if(events & EPOLLHUP) {
+		revents |= POLLHUP;
+	}
+	if(events & EPOLLERR) {
+		revents |= POLLERR;
+	}
+	return revents;
+}
+#endif
+
+void EZPoller::add(int sockid, short events, bool edge) {
+	if(sockid < 0) {
+		return;
+	}
+	poll_entry &entry = entryFor(sockid);
+	if(entry.registered) {
+		modify(sockid, events, edge);
+		return;
+	}
+	entry.registered = true;
+	entry.generation++;
+	registered_count++;
+	entry.events = events;
+#ifdef __linux__
+	if(backend == epoll_backend) {
+		struct epoll_event ev;
+		ev.events = toEpollEvents(events, edge);
+		ev.data.u64 = ((uint64_t)entry.generation << 32) | (uint32_t)sockid;
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockid, &ev) == -1) {
+			entry.registered = false;
+			registered_count--;
+			std::throw_with_nested(
+				std::runtime_error("EZPoller::add: Error produced in epoll_ctl(EPOLL_CTL_ADD, " + std::to_string(sockid) + "), errno " + std::to_string(errno) + ".")
+			);
+		}
+		EZLOG(Log::dbg, verbose) << "Added poll_socket: " << sockid << "\n";
+		return;
+	}
+#endif
+	struct pollfd new_pfd;
+	new_pfd.fd = sockid;
+	new_pfd.events = events;
+	new_pfd.revents = 0;
+	entry.index = pollers.size();
+	pollers.push_back(new_pfd);
+	EZLOG(Log::dbg, verbose) << "Added poll_socket: " << sockid << "\n";
+}
+
+void EZPoller::modify(int sockid, short events, bool edge) {
+	if(!contains(sockid)) {
+		return;
+	}
+	poll_entry &entry = entries[sockid];
+	entry.events = events;
+#ifdef __linux__
+	if(backend == epoll_backend) {
+		struct epoll_event ev;
+		ev.events = toEpollEvents(events, edge);
+		ev.data.u64 = ((uint64_t)entry.generation << 32) | (uint32_t)sockid;
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sockid, &ev) == -1) {
+			std::throw_with_nested(
+				std::runtime_error("EZPoller::modify: Error produced in epoll_ctl(EPOLL_CTL_MOD, " + std::to_string(sockid) + "), errno " + std::to_string(errno) + ".")
+			);
+		}
+		return;
+	}
+#endif
+	pollers[entry.index].events = events;
+}
+
+//O(1) for both backends, the poll backend swaps the last entry into the hole
+void EZPoller::remove(int sockid) {
+	if(!contains(sockid)) {
+		return;
+	}
+	EZLOG(Log::dbg, verbose) << "Removing poll_socket: " << sockid << "\n";
+	poll_entry &entry = entries[sockid];
+	entry.registered = false;
+	registered_count--;
+#ifdef __linux__
+	if(backend == epoll_backend) {
+		//the socket may already be closed, which removed it from the epoll set
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sockid, NULL);
+		return;
+	}
+#endif
+	size_t last = pollers.size() - 1;
+	if(entry.index != last) {
+		pollers[entry.index] = pollers[last];
+		entries[pollers[entry.index].fd].index = entry.index;
+	}
+	pollers.pop_back();
+}
+
+bool EZPoller::contains(int sockid) {
+	return (sockid >= 0 && sockid < (int)entries.size() && entries[sockid].registered);
+}
+
+size_t EZPoller::size() {
+	return registered_count;
+}
+
+int EZPoller::wait(int timeout, std::function<void(pollfd)> callback) {
+	ready.clear();
+	ready_generations.clear();
+#ifdef __linux__
+	if(backend == epoll_backend) {
+		struct epoll_event evs[EZPOLLER_MAX_EVENTS];
+		int poll_reads = epoll_wait(epoll_fd, evs, EZPOLLER_MAX_EVENTS, timeout);
+		if(poll_reads == -1) {
+			if(errno == EINTR) {
+				return 0;
+			}
+			std::throw_with_nested(
+				std::runtime_error("EZPoller::wait: Error produced in epoll_wait(" + std::to_string(epoll_fd) + ", " + std::to_string(timeout) + "), errno " + std::to_string(errno) + ".")
+			);
+		}
+		EZLOG(Log::dbg, verbose) << "epoll reads: " << poll_reads << '\n';
+		for(int i = 0; i < poll_reads; i++) {
+			struct pollfd pfd;
+			pfd.fd = (int)(evs[i].data.u64 & 0xffffffff);
+			pfd.events = 0;
+			pfd.revents = fromEpollEvents(evs[i].events);
+			ready.push_back(pfd);
+			ready_generations.push_back((uint32_t)(evs[i].data.u64 >> 32));
+		}
+	}
+#endif
+	if(backend == poll_backend) {
+		if(pollers.empty()) {
+			return 0;
+		}
+		int poll_reads = poll(&pollers[0], pollers.size(), timeout);
+		if(poll_reads == -1) {
+			if(errno == EINTR) {
+				return 0;
+			}
+			std::throw_with_nested(
+				std::runtime_error("EZPoller::wait: Error produced in poll(pollers, " + std::to_string(pollers.size()) + ", " + std::to_string(timeout) + "), errno " + std::to_string(errno) + ".")
+			);
+		}
+		EZLOG(Log::dbg, verbose) << "poll reads: " << poll_reads << '\n';
+		for(size_t i = 0; i < pollers.size() && (int)ready.size() < poll_reads; i++) {
+			if(pollers[i].revents != 0) {
+				ready.push_back(pollers[i]);
+				ready_generations.push_back(entries[pollers[i].fd].generation);
+			}
+		}
+	}
+	//handlers may close or replace sockets, so each entry is checked before delivery
+	int delivered = 0;
+	for(size_t i = 0; i < ready.size(); i++) {
+		int sockid = ready[i].fd;
+		if(!contains(sockid) || entries[sockid].generation != ready_generations[i]) {
+			continue;
+		}
+		ready[i].events = entries[sockid].events;
+		callback(ready[i]);
+		delivered++;
+	}
+	return delivered;
+}
+
+std::string EZPoller::backendName(backend_type bt) {
+	switch(bt) {
+		case epoll_backend:
+			return "epoll";
+		case poll_backend:
+			return "poll";
+		default:
+			return "unknown";
+	}
+}
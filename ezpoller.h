@@ -0,0 +1,95 @@
+// ezpoller.h
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <stdint.h>
+#include <errno.h>
+#include <exception>
+#include <stdexcept>
+#include <unistd.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#ifndef _EZPOLLER_H
+#define _EZPOLLER_H
+
+//Build with -DEZRELAY_USE_POLL to make poll() the default backend.
+//Systems without epoll always use poll().
+#if !defined(__linux__) && !defined(EZRELAY_USE_POLL)
+#define EZRELAY_USE_POLL
+#endif
+
+#define EZPOLLER_MAX_EVENTS 256
+
+//Readiness notification for the relay and client event loops.
+//The epoll backend only reports fds that are ready, so each wakeup costs
+//as much as the ready set instead of the whole set of registered sockets.
+//Events are described with the poll() flags (POLLIN, POLLOUT, ...) for both backends.
+class EZPoller {
+
+public:
+	enum backend_type {
+		epoll_backend = 1,
+		poll_backend
+	};
+
+private:
+	backend_type backend;
+	bool verbose;
+	int epoll_fd;
+	size_t registered_count;
+
+	//per-fd user data, a generation is bumped on every add() so events queued
+	//for a closed fd are never delivered to a new socket reusing that number
+	struct poll_entry {
+		bool registered;
+		uint32_t generation;
+		short events;
+		size_t index; //position in pollers, poll backend only
+	};
+	std::vector<poll_entry> entries;
+	std::vector<pollfd> pollers; //poll backend only
+	std::vector<pollfd> ready; //scratch list of ready fds handed to the callback
+	std::vector<uint32_t> ready_generations;
+
+	poll_entry &entryFor(int sockid);
+	void openBackend();
+	void closeBackend();
+
+#ifdef __linux__
+	uint32_t toEpollEvents(short events, bool edge);
+	short fromEpollEvents(uint32_t events);
+#endif
+
+public:
+	//constructor
+	EZPoller();
+	~EZPoller();
+
+	//selects the backend, only allowed while no sockets are registered
+	void setBackend(backend_type bt);
+	backend_type getBackend();
+
+	//sets printing of debug info
+	void setVerboseOutput(bool verbose_enabled);
+
+	//registers a socket for the events given
+	//edge triggered registrations only report new readiness, handlers must drain until EAGAIN
+	void add(int sockid, short events, bool edge);
+	//changes the events a registered socket is polled for
+	void modify(int sockid, short events, bool edge);
+	//removes a socket from the poll set
+	void remove(int sockid);
+	bool contains(int sockid);
+	size_t size();
+
+	//waits up to timeout ms and calls callback once for each ready socket
+	//returns number of sockets handed to callback
+	int wait(int timeout, std::function<void(pollfd)> callback);
+
+	static std::string backendName(backend_type bt);
+};
+
+#endif // EZPOLLER.h
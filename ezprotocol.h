@@ -0,0 +1,27 @@
+// ezprotocol.h
+#ifndef _EZPROTOCOL_H
+#define _EZPROTOCOL_H
+
+//Wire constants shared by EZRelay and EZRelayClient.
+//
+//Control socket, see ezcontrol.h for the binary messages:
+//	the client sends HELLO with the versions it speaks, the relay answers with a WELCOME carrying
+//	its hostname, the public port, the rendezvous port and the client's token.
+//OPEN, relay to client on the control socket when no pooled connection is idle:
+//	one token per request, the client opens a data connection presenting each.
+//Data connections, client to relay on the rendezvous port, start with a hello of one
+//kind byte followed by a token:
+//	EZRELAY_POOL_HELLO "<client token>", a pooled connection that idles until the relay pairs it
+//	with an external request and sends EZRELAY_POOL_ACTIVATE as its first byte.
+//	EZRELAY_MUX_HELLO "<client token>", a carrier, then frames as described in ezmux.h.
+//	EZRELAY_OPEN_HELLO "<OPEN token>", carries the request that OPEN was sent for.
+
+#define EZRELAY_TOKEN_LENGTH 16 //hex digits, a 64 bit secret per client or per OPEN
+#define EZRELAY_HELLO_LENGTH (1 + EZRELAY_TOKEN_LENGTH)
+#define EZRELAY_POOL_HELLO 'P'
+#define EZRELAY_MUX_HELLO 'M'
+#define EZRELAY_OPEN_HELLO 'O'
+#define EZRELAY_POOL_ACTIVATE '+'
+#define EZRELAY_MAX_POOLED 256 //idle pooled connections a client may hold at the relay
+
+#endif // EZPROTOCOL.h
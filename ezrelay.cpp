@@ -4,18 +4,59 @@
 #define DEFAULT_PORT 8000
 #define DEFAULT_BACKLOG 10
 #define RCVBUFSIZE 32
-#define FLUSH_LIMIT 10000000
+#define URING_ENTRIES 1024
+//Splice chunks start small for interactive requests and double up to the maximum for bulk ones.
+//A pipe is kept at SPLICE_PIPE_FACTOR chunks, since each socket fragment takes a pipe slot however small it is.
+#define SPLICE_CHUNK_MIN 4096
+#define SPLICE_CHUNK_MAX 262144
+#define SPLICE_PIPE_FACTOR 4
+#define SPLICE_PIPE_DEFAULT 65536
+//bytes one direction of a request may forward per turn before the rest of the loop gets one
+#define FORWARD_BUDGET 1048576
+//bytes all of one client's requests may forward per turn in a round of scheduleForwarding()
+#define FORWARD_QUANTUM 1048576
+//io_uring operation tags, kept in bits 24-31 of each sqe's user_data
+#define URING_ACCEPT 1
+#define URING_POLL_IN 2
+#define URING_SPLICE_IN 3
+#define URING_POLL_OUT 4
+#define URING_SPLICE_OUT 5
+#define URING_CLOSE 6
+#define URING_CANCEL 7
+#define URING_POLL_READ 8
+#define URING_POLL_WRITE 9
+#define DEFAULT_SETUP_TIMEOUT 30000
 
-EZRelay::EZRelay() {
+EZRelay::EZRelay() : timers(ezMonotonicMicros() / 1000) {
 	comms_port = DEFAULT_PORT;
+	rendezvous_port = 0;
+	rendezvous_socket = -1;
+	stats_port = 0;
+	stats_socket = -1;
 	backlog_size = DEFAULT_BACKLOG;
 	relay_hostname = "localhost";
 	verbose = false;
+	reuse_port = false;
 	is_listening = false;
-	if (pipe(ezpipe) == -1) {
-		Log(Log::err, 1) << "Critical Error: Unable to create pipe, unable to start relay.\n";
-		exit(1);
-	}
+	uring_requested = false;
+	uring_active = false;
+	commands_watched = false;
+	listen_held = false;
+	draining = false;
+	drained = false;
+	setup_timeout = DEFAULT_SETUP_TIMEOUT;
+	idle_timeout = 0;
+	drain_timeout = 0;
+	drain_deadline = 0;
+	handoff_socket = -1;
+	byte_rate = 0;
+	request_rate = 0;
+	service_ports = std::make_shared<EZServicePorts>();
+	std::random_device seed;
+	token_rng.seed(((uint64_t)seed() << 32) | seed());
+#ifdef EZRELAY_HAVE_IO_URING
+	uring_multishot = true;
+#endif
 }
 
 int EZRelay::getPortFromSocket(int sockid) {
@@ -49,161 +90,401 @@ bool EZRelay::isConnected(int sockid) {
 
 //Creates a listener at the port specified
 //Returns a socket for the listener
-int EZRelay::createListener(int portnum, int blsize) {
-	addrinfo hints, *res;
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET; //AF_UNSPEC; // use IPv4 or IPv6, whichever
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE; // fill in my IP for me
-	getaddrinfo(NULL, std::to_string(portnum).c_str(), &hints, &res);
-	int s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+int EZRelay::createListener(int portnum, int blsize, bool shared_port) {
+	//listeners bind the wildcard address, which needs no lookup
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(portnum);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	int s = socket(AF_INET, SOCK_STREAM, 0);
 	int enable = 1;
 	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
 		std::throw_with_nested(
 			std::runtime_error("EZRelay::createListener: Error produced in setsockopt(" + std::to_string(s) + ", SOL_SOCKET, SO_REUSEADDR, " + std::to_string(enable) + ").")
 		);
 	}
-	//fcntl(s, F_SETFL, O_NONBLOCK); //Stops blocking on listeners
-	bind(s, res->ai_addr, res->ai_addrlen); // -1 on good, errno on bad
+	if (shared_port && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelay::createListener: Error produced in setsockopt(" + std::to_string(s) + ", SOL_SOCKET, SO_REUSEPORT, " + std::to_string(enable) + ").")
+		);
+	}
+	setNonBlocking(s); //listeners are edge triggered, accept() runs until EAGAIN
+	bind(s, (struct sockaddr *)&addr, sizeof(addr)); // -1 on good, errno on bad
 	::listen(s, blsize); // -1 on good, errno on bad
 	return s;
 }
 
-//Adds socket to the list of sockets to be polled
-void EZRelay::addPollSocket(int sockid) {
-	struct pollfd new_pfd;
-	new_pfd.fd = sockid;
-	new_pfd.events = POLLIN;
-	poll_sockets.push_back(new_pfd);
-	Log(Log::dbg, verbose) << "Added poll_socket: " << std::to_string(sockid) << "\n";
-}
-
-//Remove socket from the list of sockets to be polled
-void EZRelay::removePollSocket(int sockid) {
-	Log(Log::dbg, verbose) << "Removing poll_socket: " << std::to_string(sockid) << "\n";
-	poll_sockets.erase(std::remove_if(poll_sockets.begin(), poll_sockets.end(), [&](pollfd const& v) { return (v.fd == sockid); }), poll_sockets.end());
-	auto iter = std::find_if(poll_sockets.begin(), poll_sockets.end(), [&](const pollfd& pf){return pf.fd == sockid;});
-	std::string is_removed = (iter == poll_sockets.end() ? "YES" : "NO");
-	Log(Log::dbg, verbose) << "Is poll_socket " << std::to_string(sockid) <<  " removed? -- " << is_removed << "\n";
-}
-
-//Registers request with system
-void EZRelay::registerRequest(int new_listener) {
-	Log(Log::dbg, verbose) << "Entering registerRequest" << '\n';
-	Log(Log::dbg, verbose) << "using listener: " << std::to_string(new_listener) << '\n';
-	int portnum = listener_nr_ports[new_listener];
-	int newrequest = listener_newrequests[new_listener];
-	struct sockaddr_storage their_addr;
-	socklen_t addr_size;
-	int cli_receiver = -1;
-	try {
-		cli_receiver = accept(new_listener, (struct sockaddr *)&their_addr, &addr_size);
-		int optval = 1;
-		setsockopt(new_listener, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
-	} catch(...) {
+void EZRelay::setNonBlocking(int sockid) {
+	int flags = fcntl(sockid, F_GETFL, 0);
+	if(flags == -1 || fcntl(sockid, F_SETFL, flags | O_NONBLOCK) == -1) {
 		std::throw_with_nested(
-			std::runtime_error("EZRelay::registerRequest: Error produced in accept( " + std::to_string(new_listener) +  ", their_addr, addr_size).")
+			std::runtime_error("EZRelay::setNonBlocking: Error produced in fcntl(" + std::to_string(sockid) + ", F_SETFL, O_NONBLOCK).")
 		);
-	} 
-	if(cli_receiver != -1) {
-		Log(Log::dbg, verbose) << "accepted cli_socket: " << std::to_string(cli_receiver) << '\n';
-		socket_ports[portnum] = newrequest;
-		socket_ports[portnum] = cli_receiver;
-		socket_requests[cli_receiver] = newrequest;
-		socket_requests[newrequest] = cli_receiver;
-		addPollSocket(newrequest);
-		addPollSocket(cli_receiver);
-		addToCloseQueue(new_listener);
-		closeConnection(new_listener);
-		listener_newrequests.erase(new_listener);
-		listener_nr_ports.erase(new_listener);
+	}
+}
+
+//Opens the table entry for a socket the relay now owns.
+//A new generation is started so events or closes queued for an earlier socket with this fd are dropped.
+EZConnection &EZRelay::openConnection(int sockid, uint8_t type, int client) {
+	if(sockid >= (int)connections.size()) {
+		EZConnection blank;
+		memset(&blank, 0, sizeof(blank));
+		blank.client = blank.client_prev = blank.client_next = -1;
+		connections.resize(sockid + 1, blank);
+	}
+	unlinkClient(sockid);
+	EZConnection &conn = connections[sockid];
+	uint32_t generation = conn.generation + 1;
+	memset(&conn, 0, sizeof(conn));
+	conn.generation = generation;
+	conn.type = type;
+	conn.peer = -1;
+	conn.client = conn.client_prev = conn.client_next = -1;
+	conn.pipe_fds[0] = conn.pipe_fds[1] = -1;
+	linkClient(sockid, client);
+	return conn;
+}
+
+//Hands a socket to client, putting it at the head of the client's list so teardown only walks its own
+void EZRelay::linkClient(int sockid, int client) {
+	unlinkClient(sockid);
+	if(client < 0) {
+		return;
+	}
+	EZConnection &conn = connections[sockid];
+	conn.client = client;
+	conn.client_prev = -1;
+	conn.client_next = clients[client].first_connection;
+	if(conn.client_next != -1) {
+		connections[conn.client_next].client_prev = sockid;
+	}
+	clients[client].first_connection = sockid;
+}
+
+//Takes a socket off its client's list, O(1), leaving it with no client
+void EZRelay::unlinkClient(int sockid) {
+	EZConnection &conn = connections[sockid];
+	if(conn.client < 0) {
+		return;
+	}
+	if(conn.client_prev != -1) {
+		connections[conn.client_prev].client_next = conn.client_next;
 	} else {
-		try {
-			std::throw_with_nested(
-				std::runtime_error("error on accept() which returned cli_receiver of " + std::to_string(cli_receiver) + '\n')
-			);
-		} catch(...) {
-			std::throw_with_nested(
-				std::runtime_error("EZRelay::registerRequest: Error produced in accept( " + std::to_string(new_listener) +  ", their_addr, addr_size).")
-			);
+		clients[conn.client].first_connection = conn.client_next;
+	}
+	if(conn.client_next != -1) {
+		connections[conn.client_next].client_prev = conn.client_prev;
+	}
+	conn.client = conn.client_prev = conn.client_next = -1;
+}
+
+//Frees the entry of a closed socket, returning its pipe to the pool
+void EZRelay::resetConnection(int sockid) {
+	EZConnection &conn = connections[sockid];
+	if(conn.type == conn_mux_carrier) {
+		mux_carriers.erase(sockid);
+	} else if(conn.type == conn_stream) {
+		stream_pending.erase(sockid);
+		std::unordered_map<int, mux_carrier>::iterator carrier = mux_carriers.find(conn.peer);
+		if(carrier != mux_carriers.end()) {
+			carrier->second.streams--;
+			retireCarrier(conn.peer);
+		}
+	} else if(conn.type == conn_stats) {
+		stats_out.erase(sockid);
+	} else if(conn.type == conn_service_listener) {
+		std::unordered_map<int, service_group>::iterator group = services.find(sockid);
+		if(group != services.end()) {
+			//members still listed carry on with their own ports
+			for(size_t i = 0; i < group->second.members.size(); i++) {
+				clients[group->second.members[i]].service_listener = -1;
+			}
+			//a new listener may already serve the name, see joinService()
+			std::unordered_map<std::string, int>::iterator name = service_names.find(group->second.name);
+			if(name != service_names.end() && name->second == sockid) {
+				service_names.erase(name);
+			}
+			service_ports->release(group->second.name);
+			services.erase(group);
+		}
+	}
+	if(conn.open_token != 0) {
+		//the client never answered this request's OPEN
+		open_tokens.erase(conn.open_token);
+		conn.open_token = 0;
+		if(conn.client >= 0) {
+			clients[conn.client].stats.pending--;
+			clients[conn.client].stats.rejected++;
 		}
-		Log(Log::err, verbose) << "registerRequest: accept() returned: " << std::to_string(cli_receiver) << '\n';
 	}
-	Log(Log::dbg, verbose) << "Leaving registerRequest" << '\n';
+	if(conn.traced) {
+		//a request that never forwarded a byte shows how far its setup got
+		finishTrace(sockid);
+	}
+	if(conn.external && conn.client >= 0) {
+		clients[conn.client].stats.open--;
+	}
+	conn.external = false;
+	if(conn.pipe_capacity > pipeFloor() && conn.in_pipe == 0 && conn.pipe_fds[1] != -1) {
+		//pooled pipes go back at their configured size
+		fcntl(conn.pipe_fds[1], F_SETPIPE_SZ, (int)pipeFloor());
+	}
+	conn.pipe_capacity = 0;
+	conn.pipe_limited = false;
+	pipe_pool.release(conn.pipe_fds);
+	conn.type = conn_free;
+	conn.close_state = close_none;
+	conn.peer = -1;
+	unlinkClient(sockid);
+	conn.accepting = conn.blocked = conn.paused = conn.forward_queued = false;
+	conn.interest = 0;
+	conn.in_pipe = 0;
+	conn.generation++;
+	timers.cancel(sockid);
+}
+
+//Drops the relay's copy of a socket another process took over.
+//Nothing is shut down or counted as closed, the new owner carries on with it.
+void EZRelay::releaseConnection(int sockid) {
+	EZConnection &conn = connections[sockid];
+	if(conn.open_token != 0) {
+		open_tokens.erase(conn.open_token);
+		conn.open_token = 0;
+		clients[conn.client].stats.pending--;
+	}
+	conn.traced = false;
+	if(!uring_active) {
+		poller.remove(sockid);
+	}
+	close(sockid);
+	resetConnection(sockid);
+}
+
+uint8_t EZRelay::connectionType(int sockid) {
+	if(sockid < 0 || sockid >= (int)connections.size()) {
+		return conn_free;
+	}
+	return connections[sockid].type;
+}
+
+//Starts accepting on a listener with whichever engine is active
+void EZRelay::watchListener(int sockid) {
+#ifdef EZRELAY_HAVE_IO_URING
+	if(uring_active) {
+		uringArmAccept(sockid);
+		return;
+	}
+#endif
+	poller.add(sockid, POLLIN, true);
+}
+
+//Starts forwarding in both directions between two paired sockets
+void EZRelay::watchPair(int first_socket, int second_socket) {
+	pipe_pool.lease(connections[first_socket].pipe_fds);
+	pipe_pool.lease(connections[second_socket].pipe_fds);
+	connections[first_socket].splice_chunk = connections[second_socket].splice_chunk = SPLICE_CHUNK_MIN;
+#ifdef EZRELAY_HAVE_IO_URING
+	if(uring_active) {
+		uringStartFlow(first_socket);
+		uringStartFlow(second_socket);
+		return;
+	}
+#endif
+	poller.add(first_socket, POLLIN, true);
+	poller.add(second_socket, POLLIN, true);
+}
+
+//Polls a socket for the events given with whichever engine is active, edge triggered.
+//Handlers drain until EAGAIN; io_uring polls are one-shot and re-armed from interest after each event.
+void EZRelay::watchSocket(int sockid, short events) {
+	connections[sockid].interest = events;
+#ifdef EZRELAY_HAVE_IO_URING
+	if(uring_active) {
+		uringWatch(sockid, events);
+		return;
+	}
+#endif
+	poller.add(sockid, events, true);
+}
+
+//A random 64 bit secret, never 0 so that can mean none
+uint64_t EZRelay::newToken() {
+	uint64_t token = 0;
+	while(token == 0) {
+		token = token_rng();
+	}
+	return token;
+}
+
+std::string EZRelay::formatToken(uint64_t token) {
+	char hex[EZRELAY_TOKEN_LENGTH + 1];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)token);
+	return std::string(hex);
+}
+
+//Returns false unless token is all hex digits of a formatted token
+bool EZRelay::parseToken(const std::string &token, uint64_t &value) {
+	char *end = NULL;
+	value = strtoull(token.c_str(), &end, 16);
+	return token.size() == EZRELAY_TOKEN_LENGTH && end == token.c_str() + EZRELAY_TOKEN_LENGTH;
+}
+
+//Pairs the client's data connection with the request waiting for it
+void EZRelay::pairRequest(int newrequest, int cli_receiver) {
+	EZConnection &receiver = connections[cli_receiver];
+	receiver.type = conn_request;
+	linkClient(cli_receiver, connections[newrequest].client);
+	receiver.peer = newrequest;
+	//the flows drive the pair from here, the hello's poll must not be re-armed
+	receiver.interest = 0;
+	connections[newrequest].peer = cli_receiver;
+	setNonBlocking(newrequest);
+	watchPair(newrequest, cli_receiver);
+	scheduleTimer(newrequest, clients[receiver.client].idle_timeout);
 }
 
 void EZRelay::addToCloseQueue(int sockid) {
-	if(close_queue.count(sockid) == 0) {
-		close_queue[sockid] = false;
-		Log(Log::dbg, verbose) << "Added socket to close_queue: " << std::to_string(sockid) << "\n";
+	if(sockid >= 0 && sockid < (int)connections.size() && connections[sockid].type != conn_free && connections[sockid].close_state == close_none) {
+		connections[sockid].close_state = close_queued;
+		close_queue.push_back(std::make_pair(sockid, connections[sockid].generation));
+		EZLOG(Log::dbg, verbose) << "Added socket to close_queue: " << sockid << "\n";
 	}
 }
 
 void EZRelay::processCloseQueue() {
-	for(std::pair<int, bool> element : close_queue){
-		int sockid = element.first;
-		Log(Log::dbg, verbose) << "Processing close_queue " << (close_queue[sockid] ? "(true)" : "(false)") << " for socket: " << std::to_string(sockid) << "\n";
-		if(close_queue[sockid] == true){
-			//skip sockets already closed
+	//closing a socket queues its peers, so the queue can grow while it is walked
+	for(size_t i = 0; i < close_queue.size(); i++) {
+		int sockid = close_queue[i].first;
+		if(connections[sockid].generation != close_queue[i].second || connections[sockid].close_state != close_queued) {
+			//skip sockets already closed, or whose fd has been reused since
 			continue;
 		}
-		if(listener_client.count(sockid) > 0) {
-			//is an client listener that needs to close
-			removeClientListener(sockid);
-		} 
-		if(socket_requests.count(sockid) > 0){
-			//this is a socket_request that must close
-			int to_socket = socket_requests[sockid];
-			Log(Log::dbg, verbose) << "Closing socket_requests: " << std::to_string(sockid) << " and " << std::to_string(to_socket) << "\n";
-			addToCloseQueue(sockid);
-			closeConnection(sockid);
-			addToCloseQueue(to_socket);
-			closeConnection(to_socket);
-		}
-		if(listener_newrequests.count(sockid) > 0){
-			Log(Log::dbg, verbose) << "Closing listener_newrequests: " << std::to_string(sockid) << " and " << std::to_string(listener_newrequests[sockid]) << "\n";
-			addToCloseQueue(listener_newrequests[sockid]);
-			closeConnection(listener_newrequests[sockid]);
-			addToCloseQueue(sockid);
-			closeConnection(sockid);
+		EZLOG(Log::dbg, verbose) << "Processing close_queue for socket: " << sockid << "\n";
+		int to_socket = connections[sockid].peer;
+		switch(connections[sockid].type) {
+			case conn_client_listener:
+				//is an client listener that needs to close
+				removeClientListener(sockid);
+				break;
+			case conn_client_control:
+				//the client went away, everything it owns goes with it
+				removeClientListener(clients[connections[sockid].client].listener);
+				break;
+			case conn_request:
+				//this is a socket_request that must close, along with its peer
+				EZLOG(Log::dbg, verbose) << "Closing socket_requests: " << sockid << " and " << to_socket << "\n";
+				if(to_socket != -1) {
+					countClose(sockid, !connections[sockid].external);
+				}
+				closeConnection(sockid);
+				addToCloseQueue(to_socket);
+				closeConnection(to_socket);
+				break;
+			case conn_pool_idle: {
+				std::vector<int> &idle = clients[connections[sockid].client].idle_pool;
+				idle.erase(std::remove(idle.begin(), idle.end(), sockid), idle.end());
+				closeConnection(sockid);
+				break;
+			}
+			case conn_stream:
+				//tell the client unless it closed the stream itself
+				if(!connections[sockid].eof && connectionType(to_socket) == conn_mux_carrier && connections[to_socket].close_state == close_none) {
+					mux_carriers[to_socket].channel.queueFrame(streamId(sockid), EZMUX_CLOSE, NULL, 0);
+					flushCarrier(to_socket);
+				}
+				countClose(sockid, connections[sockid].eof);
+				closeConnection(sockid);
+				break;
+			case conn_mux_carrier: {
+				EZLOG(Log::dbg, verbose) << "Closing carrier " << sockid << " and its streams" << "\n";
+				//its streams are among its client's sockets, closing one unlinks it so the next is read first
+				int stream = clients[connections[sockid].client].first_connection;
+				while(stream != -1) {
+					int next = connections[stream].client_next;
+					if(connections[stream].type == conn_stream && connections[stream].peer == sockid) {
+						connections[stream].eof = true;
+						countClose(stream, true);
+						addToCloseQueue(stream);
+						closeConnection(stream);
+					}
+					stream = next;
+				}
+				std::vector<int> &carriers = clients[connections[sockid].client].mux_carriers;
+				carriers.erase(std::remove(carriers.begin(), carriers.end(), sockid), carriers.end());
+				closeConnection(sockid);
+				break;
+			}
+			default:
+				closeConnection(sockid);
+				break;
 		}
 	}
 	close_queue.clear();
 }
 
 void EZRelay::runHandler(pollfd tmp_pfd) {
-	Log(Log::dbg, verbose) << "reading revent: " << std::to_string(tmp_pfd.revents) << '\n';
+	EZLOG(Log::dbg, verbose) << "reading revent: " << tmp_pfd.revents << '\n';
 	int from_fd = tmp_pfd.fd;
-	int to_fd = -1;
+	uint8_t type = connectionType(from_fd);
+	if((tmp_pfd.revents & POLLOUT) && type == conn_request) {
+		//destination has room again for what its peer left in the pipe
+		resumeRequest(from_fd);
+	} else if((tmp_pfd.revents & POLLOUT) && type == conn_stream) {
+		writeStream(from_fd);
+	} else if((tmp_pfd.revents & POLLOUT) && type == conn_mux_carrier) {
+		flushCarrier(from_fd);
+	} else if((tmp_pfd.revents & POLLOUT) && type == conn_client_control) {
+		queueControl(connections[from_fd].client);
+	} else if((tmp_pfd.revents & POLLOUT) && type == conn_stats) {
+		writeStats(from_fd);
+	}
 	if (tmp_pfd.revents & POLLIN) {
-		Log(Log::dbg, verbose) << "in POLLIN with socket: " << tmp_pfd.fd  <<  '\n';
+		EZLOG(Log::dbg, verbose) << "in POLLIN with socket: " << tmp_pfd.fd  <<  '\n';
 		//can read data here
-		if(from_fd == comms_socket) {
-			Log(Log::dbg, verbose) << "start comms_socket" << '\n';
+		if(type == conn_comms) {
+			EZLOG(Log::dbg, verbose) << "start comms_socket" << '\n';
 			acceptClient();
-			Log(Log::dbg, verbose) << "end comms_socket" << '\n';
-		} else if(listener_newrequests.count(from_fd) > 0) {
-			registerRequest(from_fd);
-		} else if(listener_client.count(from_fd) > 0) {
-			Log(Log::dbg, verbose) << "start acceptRequest" << '\n';
+			EZLOG(Log::dbg, verbose) << "end comms_socket" << '\n';
+		} else if(type == conn_client_listener) {
+			EZLOG(Log::dbg, verbose) << "start acceptRequest" << '\n';
 			acceptRequest(from_fd);
-			Log(Log::dbg, verbose) << "end acceptRequest" << '\n';
-		} else if(socket_requests.count(from_fd) > 0) {
-			Log(Log::dbg, verbose) << "start socket_requests" << '\n';
-			to_fd = socket_requests[from_fd];
-			Log(Log::dbg, verbose) << "to_fd: " << std::to_string(to_fd) << '\n';
-			Log(Log::dbg, verbose) << "from_fd: " << std::to_string(from_fd) << '\n';
-			forwardRequest(from_fd, to_fd);
-			Log(Log::dbg, verbose) << "end socket_requests" << '\n';
+			EZLOG(Log::dbg, verbose) << "end acceptRequest" << '\n';
+		} else if(type == conn_service_listener) {
+			acceptService(from_fd);
+		} else if(type == conn_rendezvous) {
+			acceptRendezvous(from_fd);
+		} else if(type == conn_rendezvous_pending) {
+			readHello(from_fd);
+		} else if(type == conn_pool_idle) {
+			readPooled(from_fd);
+		} else if(type == conn_mux_carrier) {
+			readCarrier(from_fd);
+		} else if(type == conn_client_control) {
+			readControl(from_fd);
+		} else if(type == conn_stats_listener) {
+			acceptStats(from_fd);
+		} else if(type == conn_commands) {
+			//applied once the poll is done
+			commands.clearWake();
+		} else if(type == conn_stats) {
+			readStats(from_fd);
+		} else if(type == conn_stream) {
+			readStream(from_fd);
+			flushCarrier(connections[from_fd].peer);
+		} else if(type == conn_request && connections[from_fd].peer != -1) {
+			//forwarded in its client's turn once every ready socket has been seen, see scheduleForwarding()
+			EZLOG(Log::dbg, verbose) << "queueing socket_request " << from_fd << " for " << connections[from_fd].peer << '\n';
+			queueForward(from_fd);
 		} else {
 			//houston we have a problem
 			//skipping for the moment, but should be handled
-			Log(Log::err, verbose) << "The polled socket doesn't exist." << '\n';
+			EZLOG(Log::err, verbose) << "The polled socket doesn't exist." << '\n';
 			addToCloseQueue(from_fd);
 		}
 	} else if(tmp_pfd.revents & POLLHUP || tmp_pfd.revents & POLLERR || tmp_pfd.revents & POLLNVAL) {
-		Log(Log::dbg, verbose) << "Detected closed connection." << '\n';
-		if(from_fd == comms_socket) {
+		EZLOG(Log::dbg, verbose) << "Detected closed connection." << '\n';
+		if(type == conn_comms) {
 			try {
 				std::throw_with_nested(
 					std::runtime_error("ERROR ON MAIN COMMINICATION SOCKET, EXIT!\n")
@@ -213,15 +494,12 @@ void EZRelay::runHandler(pollfd tmp_pfd) {
 					std::runtime_error("EZRelay::runHandler: Communication listening to port " + std::to_string(comms_port) +  " has terminated.")
 				);
 			}
-		} else if(socket_requests.count(from_fd) > 0) {
-			to_fd = socket_requests[from_fd];
-			Log(Log::dbg, verbose) << "Connection closed, flushing." << '\n';
-			int flush_limit = FLUSH_LIMIT;
-			while(forwardRequest(from_fd, to_fd) && flush_limit > 0) {
-				flush_limit--;
-				continue;
-			}
-			Log(Log::dbg, verbose) << "Flushed" << '\n';
+		} else if(type == conn_request && connections[from_fd].peer != -1) {
+			//what is left to read goes out in its client's turn, within its quantum and byte bucket like any other data,
+			//forwardRequest() closes the pair once it reads the end or the error
+			EZLOG(Log::dbg, verbose) << "Connection closed, queueing the rest of " << from_fd << '\n';
+			queueForward(from_fd);
+			return;
 		}
 		addToCloseQueue(from_fd);
 	}
@@ -230,9 +508,10 @@ void EZRelay::runHandler(pollfd tmp_pfd) {
 //While listening for new client requests
 //Adds new clients to the relay
 void EZRelay::acceptClient() {
-	if(is_listening) {
+	//edge triggered, so accept every pending client
+	while(is_listening) {
 		struct sockaddr_storage their_addr;
-		socklen_t addr_size;
+		socklen_t addr_size = sizeof(their_addr);
 		int newsocket; 
 		try {
 			newsocket = accept(comms_socket, (struct sockaddr *)&their_addr, &addr_size); 
@@ -243,247 +522,2751 @@ void EZRelay::acceptClient() {
 				std::runtime_error("EZRelay::acceptClient: Error produced in accept(" + std::to_string(comms_socket) + ", their_addr, addr_size).")
 			);
 		}
-		if(newsocket != -1) {
-			int cli_listener = addClientListener();
-			int portnum = listener_client[cli_listener];
-			std::string sendData = relay_hostname + ":" + std::to_string(portnum) + "\n";
-			sendString(newsocket, sendData);
-			client_socket[portnum] = newsocket;
+		if(newsocket == -1) {
+			break;
 		}
+		addClient(newsocket);
+	}
+}
+
+//Takes a slot in clients for the client on control_socket, registering its token
+int EZRelay::allocateClient(int control_socket, const std::string &token) {
+	int client;
+	if(free_clients.empty()) {
+		client = clients.size();
+		clients.push_back(EZClient());
+	} else {
+		client = free_clients.back();
+		free_clients.pop_back();
 	}
+	clients[client].in_use = true;
+	clients[client].control_socket = control_socket;
+	clients[client].service_listener = -1;
+	clients[client].first_connection = -1;
+	clients[client].control = EZControlChannel();
+	clients[client].greeted = false;
+	clients[client].pending_opens.clear();
+	clients[client].traced_opens.clear();
+	clients[client].control_dirty = false;
+	clients[client].stats.reset();
+	clients[client].token = token;
+	clients[client].idle_pool.clear();
+	clients[client].mux_carriers.clear();
+	clients[client].next_carrier = 0;
+	clients[client].setup_timeout = setup_timeout;
+	clients[client].idle_timeout = idle_timeout;
+	uint64_t now = ezMonotonicMicros();
+	clients[client].byte_bucket.setRate(byte_rate, now);
+	clients[client].request_bucket.setRate(request_rate, now);
+	//forward_active and throttle_listed stay as they are, they say whether the slot is still listed
+	clients[client].forward_queue.clear();
+	clients[client].forward_throttled = clients[client].accept_deferred = false;
+	clients[client].deferred_accepts.clear();
+	client_tokens[token] = client;
+	return client;
+}
+
+//Gives a newly connected client its listener and tells it the relay address
+void EZRelay::addClient(int newsocket) {
+	int client = allocateClient(newsocket, formatToken(newToken()));
+	openConnection(newsocket, conn_client_control, client);
+	addClientListener(client);
+	//the greeting waits for the client's HELLO, see readControl()
+	setNonBlocking(newsocket);
+	watchSocket(newsocket, POLLIN);
+	scheduleTimer(newsocket, setup_timeout);
 }
 
 //Adds an client to the client pool. 
 //Allocates a port and listener for the client.
 //Returns socket for the client. 
-int EZRelay::addClientListener() {
+int EZRelay::addClientListener(int client) {
 	//Binding to port 0 will return a random open port
 	//Not a big fan of selecting random ports, but leaving that as a TODO
-	int sockid = createListener(0, backlog_size);
-	int portnum = getPortFromSocket(sockid);
-	client_ports.push_back(portnum);
-	client_listeners[portnum] = sockid;
-	listener_client[sockid] = portnum;
-	addPollSocket(sockid);
+	int sockid = createListener(0, backlog_size, false);
+	openConnection(sockid, conn_client_listener, client);
+	clients[client].port = getPortFromSocket(sockid);
+	clients[client].listener = sockid;
+	client_ports[clients[client].port] = client;
+	watchListener(sockid);
 	return sockid;
 }
 
 //Closes socket connection at the port specified.
 //Removes an client from the client pool.
+//Only the client's own list is walked, so a client with k sockets takes O(k) however many others the relay holds.
+//While it serves a service, its requests still waiting for their OPEN fail over to another member instead.
 void EZRelay::removeClientListener(int cli_listener) {
-	int portnum = listener_client[cli_listener];
-	addToCloseQueue(cli_listener);
-	closeConnection(cli_listener);
-	listener_client.erase(cli_listener);
-	client_listeners.erase(portnum);
-	std::unordered_map<int, int>::iterator it = socket_requests.begin();
-	while (it != socket_requests.end()) {
-		if (socket_ports[it->first] == portnum) {
-			socket_ports.erase(it->first);
-			addToCloseQueue(it->first);
-			closeConnection(it->first);
-			it = socket_requests.erase(it);
+	int client = connections[cli_listener].client;
+	int control_socket = clients[client].control_socket;
+	int service = clients[client].service_listener;
+	leaveService(client);
+	if(services.count(service) == 0) {
+		service = -1;
+	}
+	//the listener, requests and pooled connections all belong to the client, the control socket goes last
+	int sockid = clients[client].first_connection;
+	while(sockid != -1) {
+		int next = connections[sockid].client_next;
+		int successor;
+		if(sockid == control_socket) {
+			//closed below
+		} else if(service != -1 && connections[sockid].open_token != 0 && connections[sockid].close_state == close_none
+			&& (successor = pickMember(service, false)) != -1) {
+			failOverRequest(sockid, successor);
 		} else {
-			it++;
+			addToCloseQueue(sockid);
+			closeConnection(sockid);
+			//io_uring may free the entry later, by then the client slot can belong to someone else
+			unlinkClient(sockid);
+		}
+		sockid = next;
+	}
+	addToCloseQueue(control_socket);
+	closeConnection(control_socket);
+	if(control_socket != -1) {
+		unlinkClient(control_socket);
+	}
+	for(size_t i = 0; i < clients[client].deferred_accepts.size(); i++) {
+		int successor = (service != -1 ? pickMember(service, false) : -1);
+		if(successor == -1) {
+			close(clients[client].deferred_accepts[i]);
+			continue;
 		}
+		//io_uring accepted it over the limit, it waits for the successor's bucket instead
+		clients[successor].deferred_accepts.push_back(clients[client].deferred_accepts[i]);
+		clients[successor].accept_deferred = true;
+		throttleClient(successor);
 	}
-	addToCloseQueue(client_socket[portnum]);
-	closeConnection(client_socket[portnum]);
-	client_socket.erase(portnum);
-	client_ports.erase(std::remove(client_ports.begin(), client_ports.end(), portnum), client_ports.end());
+	clients[client].deferred_accepts.clear();
+	clients[client].forward_queue.clear();
+	clients[client].forward_throttled = clients[client].accept_deferred = false;
+	clients[client].in_use = false;
+	std::unordered_map<int, int>::iterator port = client_ports.find(clients[client].port);
+	if(port != client_ports.end() && port->second == client) {
+		client_ports.erase(port);
+	}
+	clients[client].listener = clients[client].control_socket = -1;
+	client_tokens.erase(clients[client].token);
+	clients[client].idle_pool.clear();
+	clients[client].mux_carriers.clear();
+	free_clients.push_back(client);
 }
 
-//Accepts requests for an client open at listener socket sent
-void EZRelay::acceptRequest(int sockid) {
-	int portnum = listener_client[sockid];
-	Log(Log::dbg, verbose) << "acceptRequest: portnum for client = " << std::to_string(portnum) << '\n'; 
-	struct sockaddr_storage their_addr;
-	socklen_t addr_size;
-	Log(Log::dbg, verbose) << "accepting newrequest" << '\n';
-	int newrequest; 
-	try {
-		newrequest = accept(sockid, (struct sockaddr *)&their_addr, &addr_size);
-		int optval = 1;
-		setsockopt(newrequest, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
-	} catch(...) {
-		std::throw_with_nested( 
-			std::runtime_error("EZRelay::acceptRequest: Error produced in accept(" + std::to_string(sockid) + ", their_addr, addr_size).")
-		);
+//Reads what a client sent on its control socket.
+//The first message must be a HELLO with the control versions the client speaks, the relay answers
+//with a WELCOME in the highest version both speak, or with a REJECT before closing the connection.
+void EZRelay::readControl(int control_socket) {
+	int client = connections[control_socket].client;
+	EZClient &cli = clients[client];
+	bool open = cli.control.fill(control_socket);
+	EZControlChannel::message m;
+	while(cli.control.nextMessage(m)) {
+		if(cli.greeted) {
+			if(m.type == EZCTL_OPEN_FAILED) {
+				failOpens(client, m);
+				continue;
+			}
+			EZLOG(Log::dbg, verbose) << "ignoring control message " << m.type << " from client " << client << '\n';
+			continue;
+		}
+		uint8_t lowest, highest;
+		if(m.type != EZCTL_HELLO || !EZControlChannel::parseVersions(m, lowest, highest)) {
+			EZLOG(Log::err, verbose) << "client " << client << " did not start with HELLO" << '\n';
+			addToCloseQueue(control_socket);
+			return;
+		}
+		if(highest < EZCTL_MIN_VERSION || lowest > EZCTL_VERSION) {
+			EZLOG(Log::err, verbose) << "client " << client << " speaks control versions " << lowest << "-" << highest << '\n';
+			cli.control.queueReject();
+			cli.control.flush(control_socket);
+			addToCloseQueue(control_socket);
+			return;
+		}
+		EZControlChannel::welcome w;
+		w.version = std::min(highest, (uint8_t)EZCTL_VERSION);
+		w.port = cli.port;
+		std::string service = EZControlChannel::helloService(m);
+		if(service != "" && w.version >= 4) {
+			int port = joinService(client, service);
+			w.port = (port != 0 ? port : w.port);
+		}
+		w.rendezvous_port = getRendezvousPort();
+		w.token = cli.token;
+		w.hostname = relay_hostname;
+		cli.control.queueWelcome(w);
+		cli.greeted = true;
+		timers.cancel(control_socket);
+		queueControl(client);
 	}
-	Log(Log::dbg, verbose) << "accepted newrequest" << '\n'; 
-	if(newrequest != -1){
-		int cli_socket = client_socket[portnum];
-		Log(Log::dbg, verbose) << "accepting cli_socket" << '\n';
-
-		int newcon_listener = createListener(0, backlog_size);
-		int newcon_port = getPortFromSocket(newcon_listener);
-		addPollSocket(newcon_listener);
-		listener_newrequests[newcon_listener] = newrequest;
-		listener_nr_ports[newcon_listener] = portnum;
-		//tell the client to open a new connection for this request
-		std::string cmd = std::to_string(newcon_port) + "\n";
-		sendString(cli_socket, cmd);
-		Log(Log::dbg, verbose) << "sent OPEN " <<  std::to_string(newcon_port) << '\n';
-	} else {
-		Log(Log::err, verbose) << "New request rejected." << '\n';
+	if(!open) {
+		addToCloseQueue(control_socket);
 	}
 }
 
-bool EZRelay::forwardRequest(int from_socket, int to_socket) { 
-	Log(Log::dbg, verbose) << "forwarding" << '\n';
-	char buffer[4096];
-	ssize_t len;
-	try {
-		len = splice(from_socket, NULL, ezpipe[1], NULL, sizeof(buffer), SPLICE_F_MOVE);
-	} catch(...) {
-		std::throw_with_nested(
-				std::runtime_error("EZRelay::forwardRequest: Error produced in receiving splice(" + std::to_string(to_socket) + ", buffer, " + std::to_string(len) + ", 0).")
-			);
+//Closes the requests whose OPEN the client could not connect back for.
+//Tokens of other clients' requests, or already answered, are ignored.
+void EZRelay::failOpens(int client, const EZControlChannel::message &m) {
+	for(size_t i = 0; i < EZControlChannel::openCount(m); i++) {
+		uint64_t value = 0;
+		if(!parseToken(EZControlChannel::openToken(m, i), value)) {
+			continue;
+		}
+		std::unordered_map<uint64_t, int>::iterator it = open_tokens.find(value);
+		if(it == open_tokens.end() || connections[it->second].client != client) {
+			continue;
+		}
+		//resetConnection() counts it as rejected while the token is still set
+		EZLOG(Log::dbg, verbose) << "client " << client << " failed to connect for request " << it->second << '\n';
+		addToCloseQueue(it->second);
 	}
-	if(len > 0) {
-		ssize_t sent;
-		try {
-			sent = splice(ezpipe[0], NULL, to_socket, NULL, len, SPLICE_F_MOVE);
-		} catch(...) {
-			std::throw_with_nested(
-				std::runtime_error("EZRelay::forwardRequest: Error produced in sending splice(" + std::to_string(to_socket) + ", buffer, " + std::to_string(sent) + ", 0).")
-			);
+}
+
+//Adds a greeted client to the members of the named service, opening the service's listener for its first one.
+//Returns the port the service is reached on, 0 if its listener could not be opened.
+int EZRelay::joinService(int client, const std::string &name) {
+	std::unordered_map<std::string, int>::iterator it = service_names.find(name);
+	int listener;
+	if(it != service_names.end() && connections[it->second].close_state == close_none) {
+		listener = it->second;
+	} else if((listener = openService(name)) == -1) {
+		EZLOG(Log::err, verbose) << "unable to open a listener for service " << name << ", client " << client << " keeps its own port" << '\n';
+		return 0;
+	}
+	service_group &group = services[listener];
+	group.members.push_back(client);
+	clients[client].service_listener = listener;
+	//the listener is left unpolled while every member is out of request tokens, see acceptService()
+	poller.modify(listener, POLLIN, true);
+	EZLOG(Log::dbg, verbose) << "client " << client << " joined service " << name << " on port " << group.port << ", " << group.members.size() << " members" << '\n';
+	return group.port;
+}
+
+//Opens the shared listener of a service, on the port the other relays of this process serve it on if they do
+//Returns the listener, -1 if its port could not be bound
+int EZRelay::openService(const std::string &name) {
+	int listener = -1;
+	int port = service_ports->acquire(name, [&](int portnum) {
+		listener = createListener(portnum, backlog_size, true);
+		int bound = getPortFromSocket(listener);
+		if(bound == 0 || (portnum != 0 && bound != portnum)) {
+			//bind failed, listen() gave it a port of its own
+			close(listener);
+			listener = -1;
+			return 0;
 		}
-		return true;
-	} else {
-		Log(Log::dbg, verbose) << "forwardRequest, recv, len: " << std::to_string(len) << '\n';
-		addToCloseQueue(from_socket);
-		addToCloseQueue(to_socket);
-		return false;
+		return bound;
+	});
+	if(port == 0) {
+		return -1;
 	}
+	addService(listener, name, port);
+	return listener;
 }
 
-void EZRelay::closeConnection(int sockid) {
-	if(close_queue.count(sockid) > 0) {
-		if(!close_queue[sockid]){
-			Log(Log::dbg, verbose) << "Closing connection: " << std::to_string(sockid) << "\n";
-			try {
-				shutdown(sockid, SHUT_RDWR);
-				close(sockid);
-			} catch(...) {
-				std::throw_with_nested(
-					std::runtime_error("EZRelay::closeConnection: Error produced in shutdown and close of socket #" + std::to_string(sockid) + ".")
-				);
+//Serves a service on listener, which has no members until they join
+void EZRelay::addService(int listener, const std::string &name, int port) {
+	openConnection(listener, conn_service_listener, -1);
+	service_group &group = services[listener];
+	group.name = name;
+	group.port = port;
+	group.members.clear();
+	service_names[name] = listener;
+	watchListener(listener);
+}
+
+//Takes a client out of the service it serves, the service's listener closes with its last member
+void EZRelay::leaveService(int client) {
+	int listener = clients[client].service_listener;
+	clients[client].service_listener = -1;
+	std::unordered_map<int, service_group>::iterator group = services.find(listener);
+	if(group == services.end()) {
+		return;
+	}
+	std::vector<int> &members = group->second.members;
+	members.erase(std::remove(members.begin(), members.end(), client), members.end());
+	if(members.empty()) {
+		EZLOG(Log::dbg, verbose) << "service " << group->second.name << " lost its last member" << '\n';
+		addToCloseQueue(listener);
+		closeConnection(listener);
+	}
+}
+
+//Marks a client's control output to be sent by flushControl() at the end of this loop iteration
+void EZRelay::queueControl(int client) {
+	if(!clients[client].control_dirty) {
+		clients[client].control_dirty = true;
+		dirty_clients.push_back(client);
+	}
+}
+
+//Sends each client what was queued for it this loop iteration, with every OPEN packed into one message.
+//A control socket that would block is polled for POLLOUT and finished from runHandler.
+void EZRelay::flushControl() {
+	for(size_t i = 0; i < dirty_clients.size(); i++) {
+		EZClient &cli = clients[dirty_clients[i]];
+		cli.control_dirty = false;
+		//OPENs wait for the WELCOME, which queues the client again
+		if(!cli.in_use || !cli.greeted || connections[cli.control_socket].close_state != close_none) {
+			continue;
+		}
+		if(!cli.pending_opens.empty()) {
+			cli.control.queueOpens(cli.pending_opens);
+			cli.pending_opens.clear();
+		}
+		if(!cli.control.flush(cli.control_socket)) {
+			addToCloseQueue(cli.control_socket);
+			continue;
+		}
+		for(size_t j = 0; j < cli.traced_opens.size(); j++) {
+			int request = cli.traced_opens[j].first;
+			if(connections[request].generation == cli.traced_opens[j].second) {
+				traceStage(request, trace_open_sent);
 			}
-			close_queue[sockid] = true;
-			removePollSocket(sockid);
+		}
+		cli.traced_opens.clear();
+		short events = (cli.control.pending() > 0 ? POLLIN | POLLOUT : POLLIN);
+		if(events != connections[cli.control_socket].interest) {
+			watchSocket(cli.control_socket, events);
 		}
 	}
+	dirty_clients.clear();
 }
 
-void EZRelay::doPoll(std::vector<pollfd> pollers, int timeout, std::function<void(pollfd)> callback){
-	int pollers_len = pollers.size();
-	pollfd *pollers_ptr;
-	pollers_ptr = &pollers[0];
-	if(pollers_len > 0) {
-		Log(Log::dbg, verbose) << "calling poll(), poll 0 is comms_socket? " << ((pollers[0].fd == comms_socket) ? "YES" : "NO") << '\n';
-		int poll_reads = 0;
-		try {
-			poll_reads = poll(pollers_ptr, pollers_len, timeout);
-		} catch(...) {
-			std::throw_with_nested( 
-				std::runtime_error("EZRelay::doPoll: Error produced in poll(pollers_ptr, " + std::to_string(pollers_len) + ", " + std::to_string(timeout) + ").")
-			);
+//Accepts client data connections on the rendezvous port, they belong to no client until their hello
+void EZRelay::acceptRendezvous(int listener) {
+	//edge triggered, so accept every pending connection
+	while(true) {
+		struct sockaddr_storage their_addr;
+		socklen_t addr_size = sizeof(their_addr);
+		int sockid = accept(listener, (struct sockaddr *)&their_addr, &addr_size);
+		if(sockid == -1) {
+			break;
 		}
-		Log(Log::dbg, verbose) << "poll reads: " << std::to_string(poll_reads) << '\n';
-		if (poll_reads > 0){
-			Log(Log::dbg, verbose) << "past poll reads check." << '\n';
-			Log(Log::dbg, verbose) << "pollers_len: " << std::to_string(pollers_len) << '\n';
-			for(int i = 0; i<pollers_len;i++){
-				Log(Log::dbg, verbose) << "calling poll callback" << '\n';
-				try {
-					callback(pollers[i]);
-				} catch(...) {
-					std::throw_with_nested(
-						std::runtime_error("EZRelay::doPoll: Error produced in callback(pollers[" + std::to_string(i) + "]).")
-					);
-				}
-			}
+		addRendezvous(sockid);
+	}
+}
+
+void EZRelay::addRendezvous(int sockid) {
+	EZLOG(Log::dbg, verbose) << "accepted data connection " << sockid << " on the rendezvous port" << '\n';
+	openConnection(sockid, conn_rendezvous_pending, -1);
+	setNonBlocking(sockid);
+	watchSocket(sockid, POLLIN);
+	scheduleTimer(sockid, setup_timeout);
+}
+
+//Reads the hello of a new data connection, see ezprotocol.h.
+//A client token makes it an idle pooled connection or a carrier for multiplexed streams,
+//an OPEN token pairs it with the request that OPEN was sent for. The token is only taken
+//off the socket once all of it has arrived, anything else closes the connection.
+void EZRelay::readHello(int sockid) {
+	char hello[EZRELAY_HELLO_LENGTH];
+	ssize_t len = recv(sockid, hello, sizeof(hello), MSG_PEEK);
+	if((len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) || (len > 0 && len < (ssize_t)sizeof(hello))) {
+		return;
+	}
+	if(len != (ssize_t)sizeof(hello) || recv(sockid, hello, sizeof(hello), 0) != len) {
+		addToCloseQueue(sockid);
+		return;
+	}
+	std::string token(hello + 1, EZRELAY_TOKEN_LENGTH);
+	timers.cancel(sockid);
+	if(hello[0] == EZRELAY_OPEN_HELLO) {
+		uint64_t value = 0;
+		std::unordered_map<uint64_t, int>::iterator it = open_tokens.end();
+		if(parseToken(token, value)) {
+			it = open_tokens.find(value);
+		}
+		if(it != open_tokens.end()) {
+			int newrequest = it->second;
+			//one-time, a second connection with the same token is refused
+			open_tokens.erase(it);
+			connections[newrequest].open_token = 0;
+			clients[connections[newrequest].client].stats.pending--;
+			countSetup(newrequest);
+			traceStage(newrequest, trace_paired);
+			EZLOG(Log::dbg, verbose) << "paired request " << newrequest << " with data connection " << sockid << '\n';
+			pairRequest(newrequest, sockid);
+			return;
+		}
+	} else {
+		std::unordered_map<std::string, int>::iterator it = client_tokens.find(token);
+		int client = (it == client_tokens.end() ? -1 : it->second);
+		EZConnection &conn = connections[sockid];
+		if(client != -1 && hello[0] == EZRELAY_POOL_HELLO && clients[client].idle_pool.size() < EZRELAY_MAX_POOLED) {
+			EZLOG(Log::dbg, verbose) << "pooled connection " << sockid << " idle" << '\n';
+			conn.type = conn_pool_idle;
+			linkClient(sockid, client);
+			clients[client].idle_pool.push_back(sockid);
+			return;
+		}
+		if(client != -1 && hello[0] == EZRELAY_MUX_HELLO && clients[client].mux_carriers.size() < EZRELAY_MAX_POOLED) {
+			EZLOG(Log::dbg, verbose) << "pooled connection " << sockid << " carries streams" << '\n';
+			conn.type = conn_mux_carrier;
+			//a WINDOW frame followed by DATA would otherwise wait out the client's delayed ACK
+			int enable = 1;
+			setsockopt(sockid, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+			linkClient(sockid, client);
+			clients[client].mux_carriers.push_back(sockid);
+			mux_carriers[sockid];
+			//frames may have followed the hello
+			readCarrier(sockid);
+			return;
 		}
 	}
+	EZLOG(Log::err, verbose) << "data connection " << sockid << " rejected" << '\n';
+	addToCloseQueue(sockid);
 }
 
-//Sets public hostname for connections.
-//Used to return data to the client to notify connections how to access the relay.
-void EZRelay::setRelayHostname(std::string hn) {
-	relay_hostname = hn;
+//Idle pooled connections should stay silent, so input on one means it was closed or is misbehaving
+void EZRelay::readPooled(int pooled) {
+	char byte;
+	if(recv(pooled, &byte, 1, MSG_PEEK) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	addToCloseQueue(pooled);
 }
 
-std::string EZRelay::getRelayHostname() {
-	return relay_hostname;
+//Pairs a new request with an idle pooled connection of its client, if there is one.
+//The activation byte tells the client the connection now carries a request.
+bool EZRelay::pairPooled(int newrequest) {
+	std::vector<int> &idle = clients[connections[newrequest].client].idle_pool;
+	while(!idle.empty()) {
+		int pooled = idle.back();
+		idle.pop_back();
+		char activate = EZRELAY_POOL_ACTIVATE;
+		if(send(pooled, &activate, 1, MSG_NOSIGNAL) != 1) {
+			addToCloseQueue(pooled);
+			continue;
+		}
+		EZLOG(Log::dbg, verbose) << "paired request " << newrequest << " with pooled connection " << pooled << '\n';
+		connections[pooled].type = conn_request;
+		connections[pooled].peer = newrequest;
+		connections[newrequest].peer = pooled;
+		setNonBlocking(newrequest);
+		watchPair(newrequest, pooled);
+		scheduleTimer(newrequest, clients[connections[newrequest].client].idle_timeout);
+		countSetup(newrequest);
+		traceStage(newrequest, trace_paired);
+		return true;
+	}
+	return false;
 }
 
-//Sets the communication port for EZRelay
-//Stops listening for clients if called, listen() must be invoked again.
-void EZRelay::setCommsPort(int portnum) {
-	if(is_listening) {
-		stopListening();
+//Stream ids carry the relay's fd for the request and 12 bits of its generation,
+//so a frame for a stream that has closed never reaches a request reusing the fd.
+uint32_t EZRelay::streamId(int sockid) {
+	return ((connections[sockid].generation & 0xfff) << 20) | (uint32_t)sockid;
+}
+
+//Returns the request a frame from carrier is for, -1 if the stream is gone
+int EZRelay::streamSocket(int carrier, uint32_t stream) {
+	int sockid = (int)(stream & 0xfffff);
+	if(connectionType(sockid) != conn_stream || connections[sockid].peer != carrier || streamId(sockid) != stream) {
+		return -1;
 	}
-	comms_port = portnum;
+	return sockid;
 }
 
-int EZRelay::getCommsPort() {
-	return comms_port;
+//Multiplexes a new request over one of its client's carriers, if it has any
+bool EZRelay::openStream(int newrequest) {
+	EZClient &cli = clients[connections[newrequest].client];
+	if(cli.mux_carriers.empty() || newrequest > 0xfffff) {
+		return false;
+	}
+	int carrier = cli.mux_carriers[cli.next_carrier++ % cli.mux_carriers.size()];
+	EZConnection &conn = connections[newrequest];
+	conn.type = conn_stream;
+	conn.peer = carrier;
+	conn.send_window = EZMUX_WINDOW;
+	setNonBlocking(newrequest);
+	EZLOG(Log::dbg, verbose) << "opened stream " << streamId(newrequest) << " on carrier " << carrier << '\n';
+	mux_carriers[carrier].streams++;
+	mux_carriers[carrier].channel.queueFrame(streamId(newrequest), EZMUX_OPEN, NULL, 0);
+	flushCarrier(carrier);
+	watchSocket(newrequest, POLLIN);
+	scheduleTimer(newrequest, cli.idle_timeout);
+	countSetup(newrequest);
+	traceStage(newrequest, trace_paired);
+	return true;
 }
 
-//Sets the backlog size for communication requests on each socket.
-//Stops listening if called, listen() must be invoked again.
-void EZRelay::setBacklogSize(int blsize) {
-	if(is_listening) {
-		stopListening();
+//Frames what the request sent for its carrier, as far as the stream's window and the carrier's buffer allow.
+//The caller flushes the carrier.
+void EZRelay::readStream(int sockid) {
+	char buffer[EZMUX_MAX_PAYLOAD];
+	int carrier = connections[sockid].peer;
+	mux_carrier &mc = mux_carriers[carrier];
+	EZTokenBucket &bucket = clients[connections[sockid].client].byte_bucket;
+	while(connections[sockid].close_state == close_none && !connections[sockid].eof) {
+		EZConnection &conn = connections[sockid];
+		if(bucket.limited() && bucket.waitMillis(SPLICE_CHUNK_MIN, ezMonotonicMicros()) > 0) {
+			//resumed by wakeThrottled() once the client's bucket refills
+			conn.paused = true;
+			updateStreamInterest(sockid);
+			throttleForward(sockid);
+			return;
+		}
+		if(conn.send_window == 0 || mc.channel.pending() >= EZMUX_OUT_LIMIT) {
+			//resumed by a window update, or by flushCarrier once the carrier drains
+			if(conn.send_window > 0) {
+				mc.paused.push_back(sockid);
+			}
+			conn.paused = true;
+			updateStreamInterest(sockid);
+			return;
+		}
+		ssize_t len = recv(sockid, buffer, std::min((size_t)conn.send_window, sizeof(buffer)), 0);
+		if(len > 0) {
+			mc.channel.queueFrame(streamId(sockid), EZMUX_DATA, buffer, len);
+			conn.send_window -= len;
+			clients[conn.client].stats.bytes_in += len;
+			bucket.consume(len);
+			markActive(sockid);
+			traceFirstByte(sockid);
+		} else if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		} else {
+			//processCloseQueue sends the CLOSE
+			addToCloseQueue(sockid);
+			return;
+		}
 	}
-	backlog_size = blsize;
 }
 
-void EZRelay::setVerboseOutput(bool verbose_enabled){
-	verbose = verbose_enabled;
+//Sends a DATA payload from the client on to the request.
+//What the request cannot take now waits in stream_pending, credit is returned as bytes are delivered.
+//Frames can be any size, so a pipe is no use here: small writes fragment it well before a window fits.
+void EZRelay::deliverStream(int sockid, const char *data, size_t length) {
+	EZConnection &conn = connections[sockid];
+	size_t sent = 0;
+	clients[conn.client].stats.bytes_out += length;
+	//already read off the carrier, so it is counted against the bucket however far over it goes
+	clients[conn.client].byte_bucket.consume(length);
+	markActive(sockid);
+	traceFirstByte(sockid);
+	if(conn.in_pipe == 0) {
+		ssize_t len = send(sockid, data, length, MSG_NOSIGNAL);
+		if(len > 0) {
+			sent = len;
+		} else if(len == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			addToCloseQueue(sockid);
+			return;
+		}
+	}
+	if(sent < length) {
+		if(conn.in_pipe + (length - sent) > EZMUX_WINDOW) {
+			EZLOG(Log::err, verbose) << "stream " << streamId(sockid) << " overran its window" << '\n';
+			addToCloseQueue(sockid);
+			return;
+		}
+		stream_pending[sockid].append(data + sent, length - sent);
+		conn.in_pipe += length - sent;
+		updateStreamInterest(sockid);
+	}
+	if(sent > 0) {
+		mux_carriers[conn.peer].channel.queueWindow(streamId(sockid), sent);
+	}
 }
 
-//Listens on the inbound relay commsport for clients
-void EZRelay::listen() {
-	if(!is_listening){
-		try{
-			comms_socket = createListener(comms_port, backlog_size);
-		} catch(...) {
-			std::throw_with_nested(
-				std::runtime_error("EZRelay::listen: Unable to createListener in listen(" + std::to_string(comms_port) + ", " + std::to_string(backlog_size) + ").")
-			);
+//Delivers what waits for the request once it is writable
+void EZRelay::writeStream(int sockid) {
+	EZConnection &conn = connections[sockid];
+	size_t delivered = 0;
+	if(conn.in_pipe > 0) {
+		std::string &pending = stream_pending[sockid];
+		while(delivered < pending.size()) {
+			ssize_t sent = send(sockid, pending.data() + delivered, pending.size() - delivered, MSG_NOSIGNAL);
+			if(sent > 0) {
+				delivered += sent;
+			} else {
+				if(sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+					addToCloseQueue(sockid);
+				}
+				break;
+			}
 		}
-		addPollSocket(comms_socket);
-		is_listening = true;
+		pending.erase(0, delivered);
+		conn.in_pipe = pending.size();
+	}
+	if(delivered > 0 && conn.close_state == close_none) {
+		mux_carriers[conn.peer].channel.queueWindow(streamId(sockid), delivered);
+		flushCarrier(conn.peer);
 	}
+	if(conn.eof && conn.in_pipe == 0) {
+		//the client closed the stream and everything it sent has been delivered
+		addToCloseQueue(sockid);
+	}
+	updateStreamInterest(sockid);
 }
 
-//Stops listening for new client clients.
-void EZRelay::stopListening() {
-	if(is_listening){
-		addToCloseQueue(comms_socket);
-		is_listening = false;
+//Reads a stream again once what paused it is gone, the caller flushes the carrier
+void EZRelay::resumeStream(int sockid) {
+	connections[sockid].paused = false;
+	readStream(sockid);
+	updateStreamInterest(sockid);
+}
+
+void EZRelay::updateStreamInterest(int sockid) {
+	EZConnection &conn = connections[sockid];
+	short events = 0;
+	if(!conn.paused && !conn.eof) {
+		events |= POLLIN;
+	}
+	if(conn.in_pipe > 0) {
+		events |= POLLOUT;
+	}
+	if(events != conn.interest) {
+		watchSocket(sockid, events);
 	}
 }
 
-void EZRelay::run(int timeout) {
-	if(!is_listening){
-		listen();
+//Reads frames from a carrier and applies them to its streams
+void EZRelay::readCarrier(int carrier) {
+	mux_carrier &mc = mux_carriers[carrier];
+	bool open = mc.channel.fill(carrier);
+	EZMuxChannel::frame f;
+	while(mc.channel.nextFrame(f)) {
+		int sockid = streamSocket(carrier, f.stream);
+		if(sockid == -1 || connections[sockid].close_state != close_none) {
+			//stream already closed here, the client learns from its CLOSE
+			continue;
+		}
+		EZConnection &conn = connections[sockid];
+		switch(f.type) {
+			case EZMUX_DATA:
+				deliverStream(sockid, f.payload, f.length);
+				break;
+			case EZMUX_WINDOW_UPDATE:
+				conn.send_window += EZMuxChannel::windowCredit(f);
+				if(conn.paused && !conn.forward_queued) {
+					resumeStream(sockid);
+				}
+				break;
+			case EZMUX_CLOSE:
+				conn.eof = true;
+				if(conn.in_pipe == 0) {
+					addToCloseQueue(sockid);
+				}
+				updateStreamInterest(sockid);
+				break;
+			default:
+				EZLOG(Log::err, verbose) << "unknown frame " << f.type << " on carrier " << carrier << '\n';
+				break;
+		}
 	}
-	auto cb = [&](pollfd tmp_pfd) {
-		runHandler(tmp_pfd);
-	};
-	try{
-		processCloseQueue();
-		doPoll(poll_sockets, timeout, cb);
-	} catch(...) {
-		std::throw_with_nested(
-			std::runtime_error("EZRelay::run: Error in processCloseQueue or doPoll.")
-		);
+	if(open) {
+		flushCarrier(carrier);
+	} else {
+		addToCloseQueue(carrier);
 	}
 }
 
+//Writes queued frames and resumes streams that paused on a full carrier
+void EZRelay::flushCarrier(int carrier) {
+	mux_carrier &mc = mux_carriers[carrier];
+	while(true) {
+		if(!mc.channel.flush(carrier)) {
+			addToCloseQueue(carrier);
+			return;
+		}
+		if(mc.channel.pending() >= EZMUX_OUT_LIMIT || mc.paused.empty()) {
+			break;
+		}
+		std::vector<int> resume;
+		resume.swap(mc.paused);
+		for(size_t i = 0; i < resume.size(); i++) {
+			int sockid = resume[i];
+			if(connectionType(sockid) == conn_stream && connections[sockid].peer == carrier && connections[sockid].paused) {
+				connections[sockid].paused = false;
+				readStream(sockid);
+				updateStreamInterest(sockid);
+			}
+		}
+		if(mc.channel.pending() == 0) {
+			break;
+		}
+	}
+	//blocked tracks whether the carrier is polled for POLLOUT
+	bool want_out = (mc.channel.pending() > 0);
+	if(want_out != connections[carrier].blocked) {
+		connections[carrier].blocked = want_out;
+		watchSocket(carrier, POLLIN | (want_out ? POLLOUT : 0));
+	}
+	retireCarrier(carrier);
+}
+
+//Closes a carrier a hand-off kept once it has no streams left and the client has every frame sent on it.
+//The client then connects a new one, which reaches the relay that took over.
+void EZRelay::retireCarrier(int carrier) {
+	mux_carrier &mc = mux_carriers[carrier];
+	if(mc.retiring && mc.streams == 0 && mc.channel.pending() == 0) {
+		EZLOG(Log::dbg, verbose) << "retiring carrier " << carrier << '\n';
+		addToCloseQueue(carrier);
+	}
+}
+
+//Sets sockid's only timer to fire timeout ms from now, or cancels it if timeout is 0
+void EZRelay::scheduleTimer(int sockid, int timeout) {
+	if(timeout <= 0) {
+		timers.cancel(sockid);
+		return;
+	}
+	timers.schedule(sockid, connections[sockid].generation, ezMonotonicMicros() / 1000 + timeout);
+}
+
+void EZRelay::markActive(int sockid) {
+	connections[sockid].last_active = ezMonotonicMicros() / 1000;
+}
+
+//Closes what missed its deadline. An idle timer that finds data moved since it was set
+//is set again for the idle timeout after that, so an active request costs no work per byte.
+void EZRelay::expireTimers() {
+	uint64_t now = ezMonotonicMicros() / 1000;
+	expired.clear();
+	timers.advance(now, expired);
+	for(size_t i = 0; i < expired.size(); i++) {
+		int sockid = expired[i].first;
+		EZConnection &conn = connections[sockid];
+		if(conn.generation != expired[i].second || conn.close_state != close_none) {
+			continue;
+		}
+		if(conn.open_token != 0) {
+			EZLOG(Log::dbg, verbose) << "OPEN for request " << sockid << " was not answered in time" << '\n';
+			clients[conn.client].stats.timeouts_setup++;
+			addToCloseQueue(sockid);
+		} else if(conn.type == conn_rendezvous_pending || (conn.type == conn_client_control && !clients[conn.client].greeted)) {
+			EZLOG(Log::dbg, verbose) << "connection " << sockid << " did not send its hello in time" << '\n';
+			addToCloseQueue(sockid);
+		} else if(conn.type == conn_stats) {
+			EZLOG(Log::dbg, verbose) << "stats reader " << sockid << " did not finish in time" << '\n';
+			addToCloseQueue(sockid);
+		} else if((conn.type == conn_request || conn.type == conn_stream) && conn.external && conn.peer != -1) {
+			int idle = clients[conn.client].idle_timeout;
+			uint64_t active = std::max(conn.last_active, conn.accepted_at / 1000);
+			if(conn.type == conn_request) {
+				//a stream's peer is its carrier, shared with every other stream
+				active = std::max(active, connections[conn.peer].last_active);
+			}
+			if(idle <= 0) {
+				continue;
+			}
+			if(now - active < (uint64_t)idle) {
+				timers.schedule(sockid, conn.generation, active + idle);
+				continue;
+			}
+			EZLOG(Log::dbg, verbose) << "request " << sockid << " idle for " << now - active << " ms" << '\n';
+			clients[conn.client].stats.timeouts_idle++;
+			addToCloseQueue(sockid);
+		}
+	}
+	expireDrain();
+}
+
+//Closes every external request still open once a timed drain passes its deadline
+void EZRelay::expireDrain() {
+	if(!draining || drain_deadline == 0 || ezMonotonicMicros() / 1000 < drain_deadline) {
+		return;
+	}
+	drain_deadline = 0;
+	for(int sockid = 0; sockid < (int)connections.size(); sockid++) {
+		EZConnection &conn = connections[sockid];
+		if(conn.external && conn.close_state == close_none && (conn.type == conn_request || conn.type == conn_stream)) {
+			EZLOG(Log::dbg, verbose) << "drain timed out, closing request " << sockid << '\n';
+			clients[conn.client].stats.timeouts_drain++;
+			addToCloseQueue(sockid);
+		}
+	}
+}
+
+//The poll waits no longer than timeout, nor past the next deadline
+int EZRelay::pollTimeout(int timeout) {
+	uint64_t now = ezMonotonicMicros() / 1000;
+	int next = timers.nextTimeout(now);
+	if(draining && drain_deadline != 0) {
+		int drain_wait = (drain_deadline > now ? (int)(drain_deadline - now) : 0);
+		next = (next == -1 ? drain_wait : std::min(next, drain_wait));
+	}
+	if(!throttled_clients.empty()) {
+		int throttle_wait = throttleTimeout(now * 1000);
+		if(throttle_wait != -1) {
+			next = (next == -1 ? throttle_wait : std::min(next, throttle_wait));
+		}
+	}
+	if(next != -1 && (timeout < 0 || next < timeout)) {
+		return next;
+	}
+	return timeout;
+}
+
+//Counts a request that is ending against its client, by the side that ended it
+void EZRelay::countClose(int sockid, bool by_client) {
+	int client = connections[sockid].client;
+	if(client < 0) {
+		return;
+	}
+	if(by_client) {
+		clients[client].stats.closed_client++;
+	} else {
+		clients[client].stats.closed_external++;
+	}
+}
+
+//Records how long a request waited between its accept and being handed to the client
+void EZRelay::countSetup(int newrequest) {
+	EZConnection &conn = connections[newrequest];
+	clients[conn.client].stats.setup.record(ezMonotonicMicros() - conn.accepted_at);
+}
+
+//Records that a traced request reached stage, once per stage
+void EZRelay::traceStage(int request, int stage) {
+	EZConnection &conn = connections[request];
+	if(!conn.traced || conn.trace_at[stage] != 0) {
+		return;
+	}
+	conn.trace_at[stage] = ezMonotonicMicros();
+	if(stage == trace_first_byte) {
+		finishTrace(request);
+	}
+}
+
+//Stamps the first forwarded byte of the request sockid is, or is paired with
+void EZRelay::traceFirstByte(int sockid) {
+	int request = (connections[sockid].external ? sockid : connections[sockid].peer);
+	if(request >= 0 && connections[request].traced) {
+		traceStage(request, trace_first_byte);
+	}
+}
+
+void EZRelay::finishTrace(int request) {
+	EZConnection &conn = connections[request];
+	conn.traced = false;
+	tracer.finish(conn.trace_at, request, (conn.client >= 0 ? clients[conn.client].port : 0));
+}
+
+//Opens the stats endpoint if one was configured, on a Unix socket or on a loopback port.
+//Returns the listener, -1 if there is none.
+int EZRelay::createStatsListener() {
+	int s = -1;
+	if(stats_path != "") {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, stats_path.c_str(), sizeof(addr.sun_path) - 1);
+		//a socket file left by an earlier run would make bind() fail
+		unlink(stats_path.c_str());
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(s == -1 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+			std::throw_with_nested(
+				std::runtime_error("EZRelay::createStatsListener: Error produced in bind(" + stats_path + "), errno " + std::to_string(errno) + ".")
+			);
+		}
+	} else if(stats_port > 0) {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(stats_port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		int enable = 1;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+		if(s == -1 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+			std::throw_with_nested(
+				std::runtime_error("EZRelay::createStatsListener: Error produced in bind(127.0.0.1:" + std::to_string(stats_port) + "), errno " + std::to_string(errno) + ".")
+			);
+		}
+	} else {
+		return -1;
+	}
+	setNonBlocking(s);
+	::listen(s, backlog_size);
+	return s;
+}
+
+void EZRelay::acceptStats(int listener) {
+	//edge triggered, so accept every pending reader
+	while(true) {
+		int sockid = accept(listener, NULL, NULL);
+		if(sockid == -1) {
+			break;
+		}
+		addStats(sockid);
+	}
+}
+
+//Sends a new reader one snapshot as an HTTP response, whatever it asked for,
+//so both curl and a scraper pointed at the endpoint get the metrics.
+void EZRelay::addStats(int sockid) {
+	openConnection(sockid, conn_stats, -1);
+	setNonBlocking(sockid);
+	//a reader that never takes its snapshot or never closes would hold the socket for good
+	scheduleTimer(sockid, setup_timeout);
+	std::string body = renderStats();
+	stats_out[sockid] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+	writeStats(sockid);
+}
+
+//Writes what is left of a reader's snapshot, then half-closes and waits for the reader to close
+//so its request is read rather than reset.
+void EZRelay::writeStats(int sockid) {
+	std::unordered_map<int, std::string>::iterator it = stats_out.find(sockid);
+	if(it == stats_out.end()) {
+		return;
+	}
+	std::string &out = it->second;
+	size_t offset = 0;
+	while(offset < out.size()) {
+		ssize_t sent = send(sockid, out.data() + offset, out.size() - offset, MSG_NOSIGNAL);
+		if(sent > 0) {
+			offset += sent;
+		} else if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			addToCloseQueue(sockid);
+			return;
+		}
+	}
+	out.erase(0, offset);
+	if(out.empty()) {
+		stats_out.erase(it);
+		shutdown(sockid, SHUT_WR);
+		watchSocket(sockid, POLLIN);
+	} else {
+		watchSocket(sockid, POLLIN | POLLOUT);
+	}
+}
+
+//Discards what the reader sent and closes once it has
+void EZRelay::readStats(int sockid) {
+	char buffer[4096];
+	while(true) {
+		ssize_t len = recv(sockid, buffer, sizeof(buffer), 0);
+		if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if(len <= 0) {
+			addToCloseQueue(sockid);
+			return;
+		}
+	}
+}
+
+std::string EZRelay::renderStats() {
+	std::vector<std::pair<int, const EZClientStats *> > snapshot;
+	for(size_t client = 0; client < clients.size(); client++) {
+		if(clients[client].in_use) {
+			snapshot.push_back(std::make_pair(clients[client].port, &clients[client].stats));
+		}
+	}
+	return formatStats(snapshot) + tracer.format();
+}
+
+//Accepts requests for an client open at listener socket sent
+void EZRelay::acceptRequest(int sockid) {
+	int client = connections[sockid].client;
+	EZTokenBucket &bucket = clients[client].request_bucket;
+	uint64_t now = (bucket.limited() ? ezMonotonicMicros() : 0);
+	//edge triggered, so accept every pending request
+	while(true) {
+		if(bucket.available(now) < 1) {
+			//the rest wait in the backlog, resumeAccepts() comes back for them
+			if(!clients[client].accept_deferred) {
+				clients[client].accept_deferred = true;
+				clients[client].stats.throttled_requests++;
+			}
+			throttleClient(client);
+			//level triggered poll() would report the backlog on every call meanwhile
+			poller.modify(sockid, 0, true);
+			break;
+		}
+		struct sockaddr_storage their_addr;
+		socklen_t addr_size = sizeof(their_addr);
+		EZLOG(Log::dbg, verbose) << "accepting newrequest" << '\n';
+		int newrequest; 
+		try {
+			newrequest = accept(sockid, (struct sockaddr *)&their_addr, &addr_size);
+		} catch(...) {
+			std::throw_with_nested( 
+				std::runtime_error("EZRelay::acceptRequest: Error produced in accept(" + std::to_string(sockid) + ", their_addr, addr_size).")
+			);
+		}
+		if(newrequest == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				EZLOG(Log::err, verbose) << "New request rejected." << '\n';
+				clients[connections[sockid].client].stats.rejected++;
+			}
+			break;
+		}
+		int optval = 1;
+		setsockopt(newrequest, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+		EZLOG(Log::dbg, verbose) << "accepted newrequest" << '\n'; 
+		bucket.consume(1);
+		openRequest(client, newrequest);
+	}
+}
+
+//Picks the member of a service a new request goes to: of two drawn at random, the one with fewer open requests.
+//Two choices keep the load close to that of always taking the least loaded one without walking every member,
+//and members that finish requests slowly get fewer of them. Members out of request tokens are passed over
+//unless limited is false; returns -1 if every member is, or the service has none.
+int EZRelay::pickMember(int listener, bool limited) {
+	std::vector<int> &members = services[listener].members;
+	size_t count = members.size();
+	uint64_t now = (limited ? ezMonotonicMicros() : 0);
+	size_t picks[2] = {0, 1};
+	if(count > 2) {
+		picks[0] = token_rng() % count;
+		picks[1] = token_rng() % (count - 1);
+		if(picks[1] >= picks[0]) {
+			picks[1]++;
+		}
+	}
+	int best = -1;
+	for(size_t i = 0; i < 2 && i < count; i++) {
+		int client = members[picks[i]];
+		if((!limited || clients[client].request_bucket.available(now) >= 1) && (best == -1 || clients[client].stats.open < clients[best].stats.open)) {
+			best = client;
+		}
+	}
+	if(best != -1 || count <= 2) {
+		return best;
+	}
+	//both are held back by their limits, the least loaded of those that are not takes it
+	for(size_t i = 0; i < count; i++) {
+		int client = members[i];
+		if(clients[client].request_bucket.available(now) >= 1 && (best == -1 || clients[client].stats.open < clients[best].stats.open)) {
+			best = client;
+		}
+	}
+	return best;
+}
+
+//Accepts requests on a service's listener, each one handed to the member pickMember() chooses for it
+void EZRelay::acceptService(int listener) {
+	//edge triggered, so accept every pending request
+	while(true) {
+		int client = pickMember(listener, true);
+		if(client == -1) {
+			//every member is out of request tokens, the rest wait in the backlog until resumeAccepts() of one of them
+			std::vector<int> &members = services[listener].members;
+			for(size_t i = 0; i < members.size(); i++) {
+				if(!clients[members[i]].accept_deferred) {
+					clients[members[i]].accept_deferred = true;
+					clients[members[i]].stats.throttled_requests++;
+				}
+				throttleClient(members[i]);
+			}
+			poller.modify(listener, 0, true);
+			break;
+		}
+		struct sockaddr_storage their_addr;
+		socklen_t addr_size = sizeof(their_addr);
+		int newrequest = accept(listener, (struct sockaddr *)&their_addr, &addr_size);
+		if(newrequest == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				EZLOG(Log::err, verbose) << "New request rejected." << '\n';
+				clients[client].stats.rejected++;
+			}
+			break;
+		}
+		int optval = 1;
+		setsockopt(newrequest, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+		clients[client].request_bucket.consume(1);
+		openRequest(client, newrequest);
+	}
+}
+
+//Accepts the requests a client's request limit held back, as far as its bucket allows now
+void EZRelay::resumeAccepts(int client) {
+	EZClient &cli = clients[client];
+	cli.accept_deferred = false;
+#ifdef EZRELAY_HAVE_IO_URING
+	if(uring_active) {
+		uint64_t now = ezMonotonicMicros();
+		size_t opened = 0;
+		while(opened < cli.deferred_accepts.size() && cli.request_bucket.available(now) >= 1) {
+			cli.request_bucket.consume(1);
+			openRequest(client, cli.deferred_accepts[opened++]);
+		}
+		cli.deferred_accepts.erase(cli.deferred_accepts.begin(), cli.deferred_accepts.begin() + opened);
+		if(!cli.deferred_accepts.empty()) {
+			cli.accept_deferred = true;
+		} else if(!connections[cli.listener].accepting && handoff_socket == -1) {
+			uringArmAccept(cli.listener);
+		}
+		return;
+	}
+#endif
+	//the listeners were left unpolled while deferred, re-arming reports the backlog again
+	poller.modify(cli.listener, POLLIN, true);
+	acceptRequest(cli.listener);
+	if(cli.service_listener != -1) {
+		poller.modify(cli.service_listener, POLLIN, true);
+		acceptService(cli.service_listener);
+	}
+}
+
+//Takes a new request on for client, from its own listener or a service's
+void EZRelay::openRequest(int client, int newrequest) {
+	EZLOG(Log::dbg, verbose) << "openRequest: portnum for client = " << clients[client].port << '\n'; 
+	if(draining) {
+		clients[client].stats.rejected++;
+		close(newrequest);
+		return;
+	}
+	EZConnection &conn = openConnection(newrequest, conn_request, client);
+	conn.external = true;
+	conn.accepted_at = ezMonotonicMicros();
+	clients[client].stats.accepted++;
+	clients[client].stats.open++;
+	if(tracer.sample()) {
+		conn.traced = true;
+		conn.trace_at[trace_accepted] = conn.accepted_at;
+		traceStage(newrequest, trace_dispatched);
+	}
+	dispatchRequest(newrequest);
+}
+
+//Hands a request to its client: over a carrier, on an idle pooled connection,
+//or with an OPEN asking the client to connect to the rendezvous port for it
+void EZRelay::dispatchRequest(int newrequest) {
+	EZConnection &conn = connections[newrequest];
+	int client = conn.client;
+	if(openStream(newrequest) || pairPooled(newrequest)) {
+		return;
+	}
+	uint64_t token = newToken();
+	conn.open_token = token;
+	open_tokens[token] = newrequest;
+	clients[client].stats.pending++;
+	if(conn.traced) {
+		clients[client].traced_opens.push_back(std::make_pair(newrequest, conn.generation));
+	}
+	//the client answers with a connection that presents the token, OPENs from one loop iteration go out together
+	clients[client].pending_opens.push_back(formatToken(token));
+	queueControl(client);
+	scheduleTimer(newrequest, clients[client].setup_timeout);
+	EZLOG(Log::dbg, verbose) << "queued OPEN for request " <<  newrequest << " on " << clients[client].control_socket << '\n';
+}
+
+//Moves a request whose OPEN went unanswered by a member leaving its service to another member, which is sent a new one.
+//It counts as accepted by the member that takes it.
+void EZRelay::failOverRequest(int request, int client) {
+	EZConnection &conn = connections[request];
+	EZClientStats &old_stats = clients[conn.client].stats;
+	open_tokens.erase(conn.open_token);
+	conn.open_token = 0;
+	old_stats.pending--;
+	old_stats.open--;
+	linkClient(request, client);
+	clients[client].stats.accepted++;
+	clients[client].stats.open++;
+	EZLOG(Log::dbg, verbose) << "request " << request << " fails over to client " << client << '\n';
+	dispatchRequest(request);
+}
+
+//Moves one chunk from from_socket to to_socket through the pipe leased for that direction.
+//Returns true if a chunk was forwarded and more may be waiting, false once the source would block or closed.
+bool EZRelay::forwardRequest(int from_socket, int to_socket, size_t &budget) { 
+	EZLOG(Log::dbg, verbose) << "forwarding" << '\n';
+	ssize_t len;
+	EZConnection &conn = connections[from_socket];
+	if(conn.blocked) {
+		//to_socket is full, resumeRequest picks this up on its POLLOUT
+		return false;
+	}
+	//whatever an earlier call could not deliver goes out before new data
+	if(conn.in_pipe > 0 && !flushPipe(from_socket, to_socket)) {
+		return false;
+	}
+	try {
+		len = splice(from_socket, NULL, conn.pipe_fds[1], NULL, std::min((size_t)conn.splice_chunk, budget), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} catch(...) {
+		std::throw_with_nested(
+				std::runtime_error("EZRelay::forwardRequest: Error produced in receiving splice(" + std::to_string(from_socket) + ", pipe, " + std::to_string(conn.splice_chunk) + ").")
+			);
+	}
+	if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return false;
+	}
+	if(len > 0) {
+		conn.in_pipe += len;
+		budget -= std::min((size_t)len, budget);
+		EZClientStats &stats = clients[conn.client].stats;
+		(conn.external ? stats.bytes_in : stats.bytes_out) += len;
+		clients[conn.client].byte_bucket.consume(len);
+		markActive(from_socket);
+		traceFirstByte(from_socket);
+		return flushPipe(from_socket, to_socket);
+	} else {
+		EZLOG(Log::dbg, verbose) << "forwardRequest, recv, len: " << len << '\n';
+		addToCloseQueue(from_socket);
+		addToCloseQueue(to_socket);
+		return false;
+	}
+}
+
+//Forwards from_socket to to_socket until the source would block or budget is spent.
+//Returns true if it spent the budget with the source still readable, edge triggered,
+//so the caller must come back for the rest.
+bool EZRelay::drainRequest(int from_socket, int to_socket, size_t &budget) {
+	size_t allowed = budget;
+	bool more = false;
+	while((more = forwardRequest(from_socket, to_socket, budget)) && budget > 0) {
+		continue;
+	}
+	EZConnection &conn = connections[from_socket];
+	if(conn.close_state != close_none) {
+		return false;
+	}
+	adaptSplice(from_socket, allowed - budget, 2 * (size_t)conn.splice_chunk);
+	return more && budget == 0;
+}
+
+//Lists a readable request for its client's next turn
+void EZRelay::queueForward(int sockid) {
+	EZConnection &conn = connections[sockid];
+	if(conn.client < 0) {
+		return;
+	}
+	if(!conn.forward_queued) {
+		conn.forward_queued = true;
+		clients[conn.client].forward_queue.push_back(std::make_pair(sockid, conn.generation));
+	}
+	if(clients[conn.client].forward_throttled && conn.type == conn_request) {
+		//it waits for the bucket, see updateInterest()
+		updateInterest(sockid);
+	}
+	activateClient(conn.client);
+}
+
+//Holds a request or stream back until its client's byte bucket refills, see wakeThrottled()
+void EZRelay::throttleForward(int sockid) {
+	EZConnection &conn = connections[sockid];
+	EZClient &cli = clients[conn.client];
+	if(!conn.forward_queued) {
+		conn.forward_queued = true;
+		cli.forward_queue.push_back(std::make_pair(sockid, conn.generation));
+	}
+	if(!cli.forward_throttled) {
+		cli.forward_throttled = true;
+		cli.stats.throttled_bytes++;
+		updateQueuedInterest(conn.client);
+	}
+	throttleClient(conn.client);
+}
+
+//Gives a client with queued requests a turn in the next round, unless it waits for its bucket
+void EZRelay::activateClient(int client) {
+	EZClient &cli = clients[client];
+	if(!cli.forward_active && !cli.forward_throttled) {
+		cli.forward_active = true;
+		active_clients.push_back(client);
+	}
+}
+
+void EZRelay::throttleClient(int client) {
+	if(!clients[client].throttle_listed) {
+		clients[client].throttle_listed = true;
+		throttled_clients.push_back(client);
+	}
+}
+
+//One round of round robin over the clients with requests to forward.
+//Each client gets a quantum of FORWARD_QUANTUM bytes, spent on its queued requests in turn,
+//a request that uses its share and is still readable goes to the back of the client's queue.
+//Splices can stop at any byte, so a turn never overshoots and, unlike deficit round robin, nothing is owed to the next round.
+//A client whose byte bucket runs dry keeps its queue and sits out until wakeThrottled() finds it refilled.
+void EZRelay::scheduleForwarding() {
+	uint64_t now = ezMonotonicMicros();
+	if(!throttled_clients.empty()) {
+		wakeThrottled(now);
+	}
+	for(size_t round = active_clients.size(); round > 0; round--) {
+		int client = active_clients.front();
+		active_clients.pop_front();
+		EZClient &cli = clients[client];
+		cli.forward_active = false;
+		int64_t deficit = FORWARD_QUANTUM;
+		for(size_t turns = cli.forward_queue.size(); turns > 0 && deficit > 0; turns--) {
+			if(cli.byte_bucket.limited() && cli.byte_bucket.waitMillis(SPLICE_CHUNK_MIN, now) > 0) {
+				cli.forward_throttled = true;
+				cli.stats.throttled_bytes++;
+				throttleClient(client);
+				updateQueuedInterest(client);
+				break;
+			}
+			std::pair<int, uint32_t> entry = cli.forward_queue.front();
+			cli.forward_queue.pop_front();
+			EZConnection &conn = connections[entry.first];
+			if(conn.generation != entry.second || !conn.forward_queued) {
+				continue;
+			}
+			conn.forward_queued = false;
+			if(conn.close_state != close_none) {
+				continue;
+			}
+			if(conn.type == conn_stream) {
+				resumeStream(entry.first);
+				flushCarrier(conn.peer);
+				continue;
+			}
+			if(conn.type != conn_request || conn.peer == -1) {
+				continue;
+			}
+			size_t allowed = (size_t)std::min(std::min(deficit, (int64_t)FORWARD_BUDGET), cli.byte_bucket.available(now));
+			size_t budget = allowed;
+			if(drainRequest(entry.first, conn.peer, budget)) {
+				conn.forward_queued = true;
+				cli.forward_queue.push_back(entry);
+			}
+			deficit -= (int64_t)(allowed - budget);
+		}
+		if(!cli.forward_queue.empty()) {
+			activateClient(client);
+		}
+	}
+}
+
+//Lets clients whose buckets refilled carry on
+void EZRelay::wakeThrottled(uint64_t now_us) {
+	size_t kept = 0;
+	for(size_t i = 0; i < throttled_clients.size(); i++) {
+		int client = throttled_clients[i];
+		EZClient &cli = clients[client];
+		if(cli.forward_throttled && cli.byte_bucket.waitMillis(SPLICE_CHUNK_MIN, now_us) == 0) {
+			cli.forward_throttled = false;
+#ifdef EZRELAY_HAVE_IO_URING
+			if(uring_active) {
+				//flows drive themselves, each one restarted may find the bucket short again
+				for(size_t n = cli.forward_queue.size(); n > 0 && !cli.forward_throttled; n--) {
+					std::pair<int, uint32_t> entry = cli.forward_queue.front();
+					cli.forward_queue.pop_front();
+					EZConnection &conn = connections[entry.first];
+					if(conn.generation != entry.second || !conn.forward_queued) {
+						continue;
+					}
+					conn.forward_queued = false;
+					if(conn.close_state != close_none) {
+						continue;
+					}
+					if(conn.type == conn_request) {
+						uringAdvanceFlow(entry.first);
+					} else if(conn.type == conn_stream) {
+						resumeStream(entry.first);
+						flushCarrier(conn.peer);
+					}
+				}
+			} else {
+				updateQueuedInterest(client);
+				activateClient(client);
+			}
+#else
+			updateQueuedInterest(client);
+			activateClient(client);
+#endif
+		}
+		if(cli.accept_deferred && cli.request_bucket.waitMillis(1, now_us) == 0) {
+			resumeAccepts(client);
+		}
+		if(cli.in_use && (cli.forward_throttled || cli.accept_deferred)) {
+			throttled_clients[kept++] = client;
+		} else {
+			cli.throttle_listed = false;
+		}
+	}
+	throttled_clients.resize(kept);
+}
+
+//ms until the first throttled client's bucket has refilled enough to go on, -1 for none
+int EZRelay::throttleTimeout(uint64_t now_us) {
+	int next = -1;
+	for(size_t i = 0; i < throttled_clients.size(); i++) {
+		EZClient &cli = clients[throttled_clients[i]];
+		if(cli.forward_throttled) {
+			int wait = cli.byte_bucket.waitMillis(SPLICE_CHUNK_MIN, now_us);
+			next = (next == -1 ? wait : std::min(next, wait));
+		}
+		if(cli.accept_deferred) {
+			int wait = cli.request_bucket.waitMillis(1, now_us);
+			next = (next == -1 ? wait : std::min(next, wait));
+		}
+	}
+	return next;
+}
+
+//Doubles the chunk spliced from sockid while it moves at least bulk_at bytes at a time,
+//and halves it again once it moves under a quarter of a chunk, so small requests keep small pipes.
+void EZRelay::adaptSplice(int sockid, size_t moved, size_t bulk_at) {
+	EZConnection &conn = connections[sockid];
+	if(moved >= bulk_at && conn.splice_chunk < SPLICE_CHUNK_MAX && !conn.pipe_limited) {
+		conn.splice_chunk *= 2;
+	} else if(moved < conn.splice_chunk / 4 && conn.splice_chunk > SPLICE_CHUNK_MIN) {
+		conn.splice_chunk /= 2;
+	} else {
+		return;
+	}
+	resizePipe(sockid);
+}
+
+//Sizes sockid's pipe for its chunk, never below the pool's size.
+//A pipe still holding data is not shrunk, the next adaptation tries again.
+void EZRelay::resizePipe(int sockid) {
+#ifdef F_SETPIPE_SZ
+	EZConnection &conn = connections[sockid];
+	if(conn.pipe_fds[1] == -1) {
+		return;
+	}
+	if(conn.pipe_capacity == 0) {
+		int current = fcntl(conn.pipe_fds[1], F_GETPIPE_SZ);
+		conn.pipe_capacity = (current > 0 ? current : SPLICE_PIPE_DEFAULT);
+	}
+	size_t wanted = std::max((size_t)conn.splice_chunk * SPLICE_PIPE_FACTOR, pipeFloor());
+	if(wanted == conn.pipe_capacity || (wanted < conn.pipe_capacity && conn.in_pipe > 0)) {
+		return;
+	}
+	int resized = fcntl(conn.pipe_fds[1], F_SETPIPE_SZ, (int)wanted);
+	if(resized == -1) {
+		if(wanted > conn.pipe_capacity) {
+			//pipe-max-size or the per-user pipe limit, stay within what the pipe has
+			EZLOG(Log::dbg, verbose) << "F_SETPIPE_SZ " << wanted << " refused for " << sockid << ", errno " << errno << '\n';
+			conn.pipe_limited = true;
+			conn.splice_chunk = std::max((uint32_t)SPLICE_CHUNK_MIN, conn.pipe_capacity / SPLICE_PIPE_FACTOR);
+		}
+		return;
+	}
+	conn.pipe_capacity = resized;
+#endif
+}
+
+//Capacity pipes return to, the pool's configured size or the kernel default
+size_t EZRelay::pipeFloor() {
+	return (pipe_pool.getPipeSize() > 0 ? (size_t)pipe_pool.getPipeSize() : SPLICE_PIPE_DEFAULT);
+}
+
+//Sends what is held in from_socket's pipe on to to_socket.
+//Returns false and queues the pair for closing if the destination is gone.
+bool EZRelay::flushPipe(int from_socket, int to_socket) {
+	EZConnection &rp = connections[from_socket];
+	ssize_t sent = 0;
+	while(rp.in_pipe > 0) {
+		try {
+			sent = splice(rp.pipe_fds[0], NULL, to_socket, NULL, rp.in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		} catch(...) {
+			std::throw_with_nested(
+				std::runtime_error("EZRelay::flushPipe: Error produced in sending splice(" + std::to_string(to_socket) + ", buffer, " + std::to_string(sent) + ", 0).")
+			);
+		}
+		if(sent > 0) {
+			rp.in_pipe -= sent;
+		} else if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			//destination is full, stop reading from_socket until to_socket reports POLLOUT
+			EZLOG(Log::dbg, verbose) << "flushPipe, " << to_socket << " is full, pausing " << from_socket << '\n';
+			rp.blocked = true;
+			updateInterest(from_socket);
+			updateInterest(to_socket);
+			return false;
+		} else {
+			//destination is gone, the pipe still holds data so the pool closes it on release
+			EZLOG(Log::dbg, verbose) << "flushPipe, send failed on: " << to_socket << '\n';
+			addToCloseQueue(from_socket);
+			addToCloseQueue(to_socket);
+			return false;
+		}
+	}
+	return true;
+}
+
+//Delivers what is waiting for to_socket and resumes reading its peer once the pipe is empty
+void EZRelay::resumeRequest(int to_socket) {
+	int from_socket = connections[to_socket].peer;
+	if(from_socket == -1 || !connections[from_socket].blocked) {
+		return;
+	}
+	connections[from_socket].blocked = false;
+	if(flushPipe(from_socket, to_socket)) {
+		EZLOG(Log::dbg, verbose) << "resumeRequest, " << to_socket << " drained, resuming " << from_socket << '\n';
+		updateInterest(from_socket);
+		updateInterest(to_socket);
+	}
+}
+
+//Polls sockid for POLLIN unless its own pipe is waiting on the peer or it is queued on a client out of byte tokens,
+//and for POLLOUT while the peer's pipe is waiting on sockid.
+//Re-arming POLLIN reports data that arrived while paused, even when edge triggered.
+//A socket with nothing to poll for leaves the poll set: poll() reports a hang up whatever it is asked for,
+//and level triggered it would do so on every call while nothing can act on it.
+void EZRelay::updateInterest(int sockid) {
+	EZConnection &conn = connections[sockid];
+	short events = 0;
+	if(!conn.blocked && !(conn.forward_queued && clients[conn.client].forward_throttled)) {
+		events |= POLLIN;
+	}
+	if(connections[conn.peer].blocked) {
+		events |= POLLOUT;
+	}
+	if(events == 0) {
+		poller.remove(sockid);
+	} else {
+		poller.add(sockid, events, true);
+	}
+}
+
+//Updates the interest of the requests a client has queued when it runs out of byte tokens or gets them back
+void EZRelay::updateQueuedInterest(int client) {
+	if(uring_active) {
+		//flows poll nothing while throttled, wakeThrottled() restarts them
+		return;
+	}
+	std::deque<std::pair<int, uint32_t> > &queue = clients[client].forward_queue;
+	for(size_t i = 0; i < queue.size(); i++) {
+		EZConnection &conn = connections[queue[i].first];
+		if(conn.generation == queue[i].second && conn.forward_queued && conn.close_state == close_none && conn.type == conn_request && conn.peer != -1) {
+			updateInterest(queue[i].first);
+		}
+	}
+}
+
+void EZRelay::closeConnection(int sockid) {
+	if(sockid >= 0 && sockid < (int)connections.size() && connections[sockid].close_state == close_queued) {
+		EZLOG(Log::dbg, verbose) << "Closing connection: " << sockid << "\n";
+		connections[sockid].close_state = close_done;
+#ifdef EZRELAY_HAVE_IO_URING
+		if(uring_active) {
+			uringCloseConnection(sockid);
+			return;
+		}
+#endif
+		try {
+			poller.remove(sockid);
+			shutdown(sockid, SHUT_RDWR);
+			close(sockid);
+		} catch(...) {
+			std::throw_with_nested(
+				std::runtime_error("EZRelay::closeConnection: Error produced in shutdown and close of socket #" + std::to_string(sockid) + ".")
+			);
+		}
+		//the pipe goes back to the pool, or is closed if the peer left data in it
+		resetConnection(sockid);
+	}
+}
+
+void EZRelay::doPoll(int timeout, std::function<void(pollfd)> callback){
+	if(poller.size() > 0) {
+		EZLOG(Log::dbg, verbose) << "calling " << EZPoller::backendName(poller.getBackend()) << " wait on " << poller.size() << " sockets" << '\n';
+		try {
+			poller.wait(timeout, callback);
+		} catch(...) {
+			std::throw_with_nested( 
+				std::runtime_error("EZRelay::doPoll: Error produced in wait(" + std::to_string(poller.size()) + ", " + std::to_string(timeout) + ").")
+			);
+		}
+	}
+}
+
+#ifdef EZRELAY_HAVE_IO_URING
+//user_data layout: generation in the high 32 bits, operation tag, then the socket
+uint64_t EZRelay::uringUserData(int sockid, int op) {
+	return ((uint64_t)connections[sockid].generation << 32) | ((uint64_t)op << 24) | (uint64_t)(sockid & 0xffffff);
+}
+
+bool EZRelay::openUring() {
+	if(!uring.open(URING_ENTRIES)) {
+		EZLOG(Log::err, verbose) << "io_uring unavailable (errno " << errno << "), using " << EZPoller::backendName(poller.getBackend()) << '\n';
+		return false;
+	}
+	if(!uring.supports(IORING_OP_ACCEPT) || !uring.supports(IORING_OP_SPLICE) || !uring.supports(IORING_OP_POLL_ADD) || !uring.supports(IORING_OP_CLOSE) || !uring.supports(IORING_OP_ASYNC_CANCEL)) {
+		uring.close();
+		EZLOG(Log::err, verbose) << "io_uring lacks accept/splice/close support, using " << EZPoller::backendName(poller.getBackend()) << '\n';
+		return false;
+	}
+	return true;
+}
+
+//Arms a multishot accept, or a single accept re-armed on each completion on older kernels
+void EZRelay::uringArmAccept(int sockid) {
+	if(handoff_socket != -1) {
+		//a listener opened while the others' accepts are cancelled, it is handed over unarmed
+		return;
+	}
+	connections[sockid].accepting = true;
+	struct io_uring_sqe *sqe = uring.getSqe();
+	if(sqe == NULL) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelay::uringArmAccept: Submission queue full arming accept on socket #" + std::to_string(sockid) + ".")
+		);
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sockid;
+	if(uring_multishot) {
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}
+	sqe->user_data = uringUserData(sockid, URING_ACCEPT);
+}
+
+//Arms a one-shot poll for each event in events that has none in flight
+void EZRelay::uringWatch(int sockid, short events) {
+	EZConnection &conn = connections[sockid];
+	bool *armed[2] = {&conn.uring_in_armed, &conn.uring_out_armed};
+	short wanted[2] = {POLLIN, POLLOUT};
+	int ops[2] = {URING_POLL_READ, URING_POLL_WRITE};
+	for(int i = 0; i < 2; i++) {
+		if(!(events & wanted[i]) || *armed[i]) {
+			continue;
+		}
+		struct io_uring_sqe *sqe = uring.getSqe();
+		if(sqe == NULL) {
+			std::throw_with_nested(
+				std::runtime_error("EZRelay::uringWatch: Submission queue full watching socket #" + std::to_string(sockid) + ".")
+			);
+		}
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = sockid;
+		sqe->poll32_events = wanted[i];
+		sqe->user_data = uringUserData(sockid, ops[i]);
+		*armed[i] = true;
+	}
+}
+
+//Queues poll(POLLIN) -> splice(socket to pipe) -> splice(pipe to peer) as one linked chain.
+//A short read breaks the link and the remainder is sent by uringSubmitOut.
+void EZRelay::uringStartFlow(int from_socket) {
+	EZConnection &flow = connections[from_socket];
+	if(flow.closing || flow.eof) {
+		return;
+	}
+	struct io_uring_sqe *poll_sqe = uring.getSqe();
+	struct io_uring_sqe *in_sqe = uring.getSqe();
+	struct io_uring_sqe *out_sqe = uring.getSqe();
+	if(poll_sqe == NULL || in_sqe == NULL || out_sqe == NULL) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelay::uringStartFlow: Submission queue full forwarding socket #" + std::to_string(from_socket) + ".")
+		);
+	}
+	flow.in_pending = true;
+	flow.out_pending = true;
+	poll_sqe->opcode = IORING_OP_POLL_ADD;
+	poll_sqe->fd = from_socket;
+	poll_sqe->poll32_events = POLLIN;
+	poll_sqe->flags = IOSQE_IO_LINK;
+	poll_sqe->user_data = uringUserData(from_socket, URING_POLL_IN);
+
+	in_sqe->opcode = IORING_OP_SPLICE;
+	in_sqe->splice_fd_in = from_socket;
+	in_sqe->splice_off_in = (uint64_t)-1;
+	in_sqe->fd = flow.pipe_fds[1];
+	in_sqe->off = (uint64_t)-1;
+	in_sqe->len = flow.splice_chunk;
+	in_sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+	in_sqe->flags = IOSQE_IO_LINK;
+	in_sqe->user_data = uringUserData(from_socket, URING_SPLICE_IN);
+
+	out_sqe->opcode = IORING_OP_SPLICE;
+	out_sqe->splice_fd_in = flow.pipe_fds[0];
+	out_sqe->splice_off_in = (uint64_t)-1;
+	out_sqe->fd = flow.peer;
+	out_sqe->off = (uint64_t)-1;
+	out_sqe->len = flow.splice_chunk;
+	out_sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+	out_sqe->user_data = uringUserData(from_socket, URING_SPLICE_OUT);
+}
+
+//Queues poll(POLLOUT) -> splice(pipe to peer) for whatever is still in the flow's pipe
+void EZRelay::uringSubmitOut(int from_socket) {
+	EZConnection &flow = connections[from_socket];
+	struct io_uring_sqe *poll_sqe = uring.getSqe();
+	struct io_uring_sqe *out_sqe = uring.getSqe();
+	if(poll_sqe == NULL || out_sqe == NULL) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelay::uringSubmitOut: Submission queue full forwarding socket #" + std::to_string(from_socket) + ".")
+		);
+	}
+	flow.out_pending = true;
+	poll_sqe->opcode = IORING_OP_POLL_ADD;
+	poll_sqe->fd = flow.peer;
+	poll_sqe->poll32_events = POLLOUT;
+	poll_sqe->flags = IOSQE_IO_LINK;
+	poll_sqe->user_data = uringUserData(from_socket, URING_POLL_OUT);
+
+	out_sqe->opcode = IORING_OP_SPLICE;
+	out_sqe->splice_fd_in = flow.pipe_fds[0];
+	out_sqe->splice_off_in = (uint64_t)-1;
+	out_sqe->fd = flow.peer;
+	out_sqe->off = (uint64_t)-1;
+	out_sqe->len = (unsigned)flow.in_pipe;
+	out_sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+	out_sqe->user_data = uringUserData(from_socket, URING_SPLICE_OUT);
+}
+
+//Decides the next step for a flow once none of its operations are in flight
+void EZRelay::uringAdvanceFlow(int from_socket) {
+	EZConnection &flow = connections[from_socket];
+	if(flow.in_pending || flow.out_pending) {
+		return;
+	}
+	if(flow.closing) {
+		uringQueueClose(from_socket);
+	} else if(flow.in_pipe > 0) {
+		uringSubmitOut(from_socket);
+	} else if(flow.eof) {
+		EZLOG(Log::dbg, verbose) << "uring flow finished: " << from_socket << '\n';
+		addToCloseQueue(from_socket);
+		addToCloseQueue(flow.peer);
+	} else if(flow.client >= 0 && clients[flow.client].byte_bucket.limited()
+		&& clients[flow.client].byte_bucket.waitMillis(SPLICE_CHUNK_MIN, ezMonotonicMicros()) > 0) {
+		//restarted by wakeThrottled() once the client's bucket refills
+		throttleForward(from_socket);
+	} else {
+		uringStartFlow(from_socket);
+	}
+}
+
+//Queues the close of a socket, submitted with the rest of the batch.
+//No operation is in flight by now, so the entry and its pipe can be released.
+void EZRelay::uringQueueClose(int sockid) {
+	resetConnection(sockid);
+	struct io_uring_sqe *sqe = uring.getSqe();
+	if(sqe == NULL) {
+		close(sockid);
+		return;
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = sockid;
+	sqe->user_data = ((uint64_t)URING_CLOSE << 24);
+}
+
+void EZRelay::uringCloseConnection(int sockid) {
+	EZConnection &flow = connections[sockid];
+	if(flow.accepting) {
+		struct io_uring_sqe *sqe = uring.getSqe();
+		if(sqe != NULL) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = uringUserData(sockid, URING_ACCEPT);
+			sqe->user_data = ((uint64_t)URING_CANCEL << 24);
+		}
+		uringQueueClose(sockid);
+	} else if(flow.type == conn_request && flow.pipe_fds[0] != -1) {
+		//wakes the poll and splices still in flight, the socket is closed once they complete
+		flow.closing = true;
+		shutdown(sockid, SHUT_RDWR);
+		uringAdvanceFlow(sockid);
+	} else {
+		shutdown(sockid, SHUT_RDWR);
+		close(sockid);
+		resetConnection(sockid);
+	}
+}
+
+void EZRelay::uringHandleCompletion(uint64_t user_data, int res, unsigned flags) {
+	int sockid = (int)(user_data & 0xffffff);
+	int op = (int)((user_data >> 24) & 0xff);
+	uint32_t generation = (uint32_t)(user_data >> 32);
+	if(op == URING_CLOSE || op == URING_CANCEL) {
+		return;
+	}
+	bool stale = (sockid >= (int)connections.size() || generation != connections[sockid].generation);
+	if(op == URING_ACCEPT) {
+		if(stale || !connections[sockid].accepting) {
+			//listener was retired while this accept was in flight
+			if(res >= 0) {
+				close(res);
+			}
+			return;
+		}
+		if(res >= 0) {
+			EZLOG(Log::dbg, verbose) << "uring accepted " << res << " on " << sockid << '\n';
+			uint8_t type = connections[sockid].type;
+			if(type == conn_comms) {
+				addClient(res);
+			} else if(type == conn_rendezvous) {
+				addRendezvous(res);
+			} else if(type == conn_stats_listener) {
+				addStats(res);
+			} else if(type == conn_client_listener) {
+				int optval = 1;
+				setsockopt(res, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+				int client = connections[sockid].client;
+				EZClient &cli = clients[client];
+				if(cli.accept_deferred || (cli.request_bucket.limited() && cli.request_bucket.available(ezMonotonicMicros()) < 1)) {
+					//already accepted, so it waits here for resumeAccepts() while the listener stops accepting
+					cli.deferred_accepts.push_back(res);
+					if(!cli.accept_deferred) {
+						cli.accept_deferred = true;
+						cli.stats.throttled_requests++;
+						throttleClient(client);
+						struct io_uring_sqe *sqe;
+						if(uring_multishot && (sqe = uring.getSqe()) != NULL) {
+							sqe->opcode = IORING_OP_ASYNC_CANCEL;
+							sqe->fd = -1;
+							sqe->addr = uringUserData(sockid, URING_ACCEPT);
+							sqe->user_data = ((uint64_t)URING_CANCEL << 24);
+						}
+					}
+				} else {
+					cli.request_bucket.consume(1);
+					openRequest(client, res);
+				}
+			} else if(type == conn_service_listener) {
+				int optval = 1;
+				setsockopt(res, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+				int client = pickMember(sockid, true);
+				if(client == -1) {
+					//every member is out of tokens; the listener goes on accepting, each request waits with a member
+					//for resumeAccepts() as a private listener's would
+					if((client = pickMember(sockid, false)) == -1) {
+						close(res);
+						return;
+					}
+					EZClient &cli = clients[client];
+					cli.deferred_accepts.push_back(res);
+					if(!cli.accept_deferred) {
+						cli.accept_deferred = true;
+						cli.stats.throttled_requests++;
+					}
+					throttleClient(client);
+				} else {
+					clients[client].request_bucket.consume(1);
+					openRequest(client, res);
+				}
+			} else {
+				close(res);
+			}
+		} else if(res == -EINVAL && uring_multishot) {
+			EZLOG(Log::dbg, verbose) << "multishot accept unsupported, re-arming single accepts" << '\n';
+			uring_multishot = false;
+		} else if(res != -ECANCELED) {
+			EZLOG(Log::err, verbose) << "uring accept failed on " << sockid << ": " << res << '\n';
+		}
+		//handlers above may have retired the listener
+		if(!(flags & IORING_CQE_F_MORE) && connections[sockid].accepting && connections[sockid].generation == generation) {
+			if(handoff_socket != -1) {
+				//the last completion of a cancelled accept, see beginHandOff()
+				connections[sockid].accepting = false;
+			} else if(connections[sockid].type == conn_client_listener && clients[connections[sockid].client].accept_deferred) {
+				//re-armed by resumeAccepts()
+				connections[sockid].accepting = false;
+			} else {
+				uringArmAccept(sockid);
+			}
+		}
+		return;
+	}
+	if(op == URING_POLL_READ || op == URING_POLL_WRITE) {
+		if(stale) {
+			return;
+		}
+		if(op == URING_POLL_READ) {
+			connections[sockid].uring_in_armed = false;
+		} else {
+			connections[sockid].uring_out_armed = false;
+		}
+		//sockets paired since the poll was armed are driven by their flows instead
+		uint8_t type = connections[sockid].type;
+		if(connections[sockid].close_state != close_none || type == conn_request) {
+			return;
+		}
+		struct pollfd pfd;
+		pfd.fd = sockid;
+		pfd.events = connections[sockid].interest;
+		pfd.revents = (res < 0 ? POLLERR : (short)res);
+		runHandler(pfd);
+		if(connections[sockid].generation == generation && connections[sockid].close_state == close_none && connections[sockid].type != conn_free) {
+			uringWatch(sockid, connections[sockid].interest);
+		}
+		return;
+	}
+	EZConnection &flow = connections[sockid];
+	if(stale || flow.type != conn_request) {
+		return;
+	}
+	switch(op) {
+		case URING_SPLICE_IN:
+			flow.in_pending = false;
+			if(res > 0) {
+				flow.in_pipe += res;
+				//a splice that filled its chunk is a bulk flow, the next one asks for more
+				adaptSplice(sockid, res, flow.splice_chunk);
+				if(flow.client >= 0) {
+					EZClientStats &stats = clients[flow.client].stats;
+					(flow.external ? stats.bytes_in : stats.bytes_out) += res;
+					clients[flow.client].byte_bucket.consume(res);
+				}
+				markActive(sockid);
+				traceFirstByte(sockid);
+			} else if(res == 0 || (res != -EAGAIN && !flow.closing)) {
+				flow.eof = true;
+			}
+			break;
+		case URING_SPLICE_OUT:
+			flow.out_pending = false;
+			if(res > 0) {
+				flow.in_pipe -= res;
+			} else if(res != -EAGAIN && res != -ECANCELED) {
+				//destination is gone, what is left in this flow's pipe is dropped with it
+				flow.eof = true;
+				flow.in_pipe = 0;
+			}
+			break;
+		default:
+			//polls only gate the linked splice, which reports the outcome
+			return;
+	}
+	uringAdvanceFlow(sockid);
+}
+
+void EZRelay::doUring(int timeout) {
+	if(uring.submitAndWait(timeout) < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelay::doUring: Error produced in io_uring_enter(" + std::to_string(timeout) + "), errno " + std::to_string(errno) + ".")
+		);
+	}
+	uring.reap([&](uint64_t user_data, int res, unsigned flags) {
+		uringHandleCompletion(user_data, res, flags);
+	});
+}
+#endif // EZRELAY_HAVE_IO_URING
+
+//Sets public hostname for connections.
+//Used to return data to the client to notify connections how to access the relay.
+void EZRelay::setRelayHostname(std::string hn) {
+	relay_hostname = hn;
+}
+
+std::string EZRelay::getRelayHostname() {
+	return relay_hostname;
+}
+
+//Sets the communication port for EZRelay
+//Stops listening for clients if called, listen() must be invoked again.
+void EZRelay::setCommsPort(int portnum) {
+	if(is_listening) {
+		stopListening();
+	}
+	comms_port = portnum;
+}
+
+int EZRelay::getCommsPort() {
+	return comms_port;
+}
+
+//Sets the port client data connections are accepted on, 0 lets the kernel pick one.
+//Stops listening if called, listen() must be invoked again.
+void EZRelay::setRendezvousPort(int portnum) {
+	if(is_listening) {
+		stopListening();
+	}
+	rendezvous_port = portnum;
+}
+
+//Returns the rendezvous port, the one actually bound once listening
+int EZRelay::getRendezvousPort() {
+	if(is_listening) {
+		return getPortFromSocket(rendezvous_socket);
+	}
+	return rendezvous_port;
+}
+
+//Serves the stats endpoint on 127.0.0.1 at portnum, 0 turns it off.
+//Stops listening if called, listen() must be invoked again.
+void EZRelay::setStatsPort(int portnum) {
+	if(is_listening) {
+		stopListening();
+	}
+	stats_port = portnum;
+}
+
+int EZRelay::getStatsPort() {
+	return stats_port;
+}
+
+//Serves the stats endpoint on a Unix socket at path instead, "" turns it off.
+//Stops listening if called, listen() must be invoked again.
+void EZRelay::setStatsSocket(std::string path) {
+	if(is_listening) {
+		stopListening();
+	}
+	stats_path = path;
+}
+
+std::string EZRelay::getStatsSocket() {
+	return stats_path;
+}
+
+//Traces the setup stages of one in every requests, 0 turns tracing off.
+//Stage histograms are added to the stats endpoint.
+void EZRelay::setTraceSampling(int every) {
+	tracer.setSampling(every);
+}
+
+int EZRelay::getTraceSampling() {
+	return tracer.getSampling();
+}
+
+//Writes traced requests to path as Chrome trace events, "" stops writing.
+//Returns false if the file could not be opened.
+bool EZRelay::setTraceFile(std::string path) {
+	trace_path = path;
+	return tracer.setFile(path);
+}
+
+std::string EZRelay::getTraceFile() {
+	return trace_path;
+}
+
+//Sets the backlog size for communication requests on each socket.
+//Stops listening if called, listen() must be invoked again.
+void EZRelay::setBacklogSize(int blsize) {
+	if(is_listening) {
+		stopListening();
+	}
+	backlog_size = blsize;
+}
+
+//Lets other relays in this process bind the comms port, the kernel spreads new clients between them.
+//Stops listening if called, listen() must be invoked again.
+void EZRelay::setReusePort(bool enabled) {
+	if(is_listening) {
+		stopListening();
+	}
+	reuse_port = enabled;
+}
+
+void EZRelay::setVerboseOutput(bool verbose_enabled){
+	verbose = verbose_enabled;
+	poller.setVerboseOutput(verbose_enabled);
+	pipe_pool.setVerboseOutput(verbose_enabled);
+}
+
+//Sets the capacity of the pipes leased to each forwarding direction, 0 for the kernel default.
+void EZRelay::setPipeSize(int bytes) {
+	pipe_pool.setPipeSize(bytes);
+}
+
+int EZRelay::getPipeSize() {
+	return pipe_pool.getPipeSize();
+}
+
+//Selects the readiness backend, epoll unless built with EZRELAY_USE_POLL.
+//Only allowed before any socket is registered, i.e. before listen().
+void EZRelay::setPollBackend(EZPoller::backend_type bt) {
+	try {
+		poller.setBackend(bt);
+	} catch(...) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelay::setPollBackend: Unable to switch to " + EZPoller::backendName(bt) + ", call before listen().")
+		);
+	}
+}
+
+EZPoller::backend_type EZRelay::getPollBackend() {
+	return poller.getBackend();
+}
+
+//Requests the io_uring engine, which takes effect at listen().
+void EZRelay::setIOUringEnabled(bool enabled) {
+	uring_requested = enabled;
+}
+
+bool EZRelay::isIOUringActive() {
+	return uring_active;
+}
+
+//Sets how long new clients' OPENs may go unanswered and new connections may take to say hello, 0 for no limit.
+void EZRelay::setSetupTimeout(int ms) {
+	setup_timeout = std::max(ms, 0);
+}
+
+int EZRelay::getSetupTimeout() {
+	return setup_timeout;
+}
+
+//Sets how long new clients' paired requests may move no data before they are closed, 0 for no limit.
+void EZRelay::setIdleTimeout(int ms) {
+	idle_timeout = std::max(ms, 0);
+}
+
+int EZRelay::getIdleTimeout() {
+	return idle_timeout;
+}
+
+//Sets the bytes a second new clients' requests may forward, 0 for no limit.
+void EZRelay::setByteRate(uint64_t bytes_per_sec) {
+	byte_rate = bytes_per_sec;
+}
+
+uint64_t EZRelay::getByteRate() {
+	return byte_rate;
+}
+
+//Sets the requests a second new clients may accept, 0 for no limit.
+void EZRelay::setRequestRate(int requests_per_sec) {
+	request_rate = std::max(requests_per_sec, 0);
+}
+
+int EZRelay::getRequestRate() {
+	return request_rate;
+}
+
+//Changes the rate limits of the client on port, false if there is none.
+bool EZRelay::setClientRates(int port, uint64_t bytes_per_sec, int requests_per_sec) {
+	std::unordered_map<int, int>::iterator it = client_ports.find(port);
+	if(it == client_ports.end()) {
+		return false;
+	}
+	uint64_t now = ezMonotonicMicros();
+	clients[it->second].byte_bucket.setRate(bytes_per_sec, now);
+	clients[it->second].request_bucket.setRate(std::max(requests_per_sec, 0), now);
+	return true;
+}
+
+//Binds the named service to portnum, 0 lets the kernel pick one, see EZServicePorts.
+void EZRelay::setServicePort(std::string name, int portnum) {
+	service_ports->setPort(name, portnum);
+}
+
+int EZRelay::getServicePort(std::string name) {
+	return service_ports->getPort(name);
+}
+
+//Shares the service ports with the other relays of this process, see EZRelayShards.
+void EZRelay::setServicePorts(std::shared_ptr<EZServicePorts> ports) {
+	service_ports = ports;
+}
+
+//Changes the setup and idle timeouts of the client on port, false if there is none.
+bool EZRelay::setClientTimeouts(int port, int setup_ms, int idle_ms) {
+	std::unordered_map<int, int>::iterator it = client_ports.find(port);
+	if(it == client_ports.end()) {
+		return false;
+	}
+	clients[it->second].setup_timeout = std::max(setup_ms, 0);
+	clients[it->second].idle_timeout = std::max(idle_ms, 0);
+	return true;
+}
+
+//Sets how long a drain waits for open requests before closing them, 0 waits for as long as they last.
+void EZRelay::setDrainTimeout(int ms) {
+	drain_timeout = std::max(ms, 0);
+}
+
+int EZRelay::getDrainTimeout() {
+	return drain_timeout;
+}
+
+//Opens io_uring if it was asked for and nothing is polled yet, and watches the command queue
+void EZRelay::startEngine() {
+#ifdef EZRELAY_HAVE_IO_URING
+	if(uring_requested && !uring_active && poller.size() == 0) {
+		uring_active = openUring();
+	}
+#endif
+	if(!commands_watched) {
+		openConnection(commands.wakeFd(), conn_commands, -1);
+		watchSocket(commands.wakeFd(), POLLIN);
+		commands_watched = true;
+	}
+}
+
+//Listens on the inbound relay commsport for clients
+void EZRelay::listen() {
+	listen_held = false;
+	if(!is_listening){
+		startEngine();
+		try{
+			comms_socket = createListener(comms_port, backlog_size, reuse_port);
+		} catch(...) {
+			std::throw_with_nested(
+				std::runtime_error("EZRelay::listen: Unable to createListener in listen(" + std::to_string(comms_port) + ", " + std::to_string(backlog_size) + ").")
+			);
+		}
+		openConnection(comms_socket, conn_comms, -1);
+		watchListener(comms_socket);
+		try{
+			rendezvous_socket = createListener(rendezvous_port, backlog_size, false);
+		} catch(...) {
+			std::throw_with_nested(
+				std::runtime_error("EZRelay::listen: Unable to createListener in listen(" + std::to_string(rendezvous_port) + ", " + std::to_string(backlog_size) + ").")
+			);
+		}
+		openConnection(rendezvous_socket, conn_rendezvous, -1);
+		watchListener(rendezvous_socket);
+		stats_socket = createStatsListener();
+		if(stats_socket != -1) {
+			openConnection(stats_socket, conn_stats_listener, -1);
+			watchListener(stats_socket);
+		}
+		is_listening = true;
+	}
+}
+
+//Stops listening for new client clients.
+void EZRelay::stopListening() {
+	if(is_listening){
+		addToCloseQueue(comms_socket);
+		addToCloseQueue(rendezvous_socket);
+		addToCloseQueue(stats_socket);
+		tracer.flush();
+		is_listening = false;
+	}
+}
+
+void EZRelay::takeOver(int sockid) {
+	if(is_listening) {
+		throw std::runtime_error("EZRelay::takeOver: Already listening.");
+	}
+	startEngine();
+	std::unordered_map<uint64_t, int> client_map; //client index in the old relay to the one here
+	EZHandOffRecord record;
+	while(true) {
+		if(!record.receive(sockid)) {
+			throw std::runtime_error("EZRelay::takeOver: Hand-off ended early, errno " + std::to_string(errno) + ".");
+		}
+		if(record.type == EZHANDOFF_END) {
+			break;
+		}
+		adoptRecord(record, client_map);
+	}
+	if(!is_listening) {
+		throw std::runtime_error("EZRelay::takeOver: Hand-off had no listeners.");
+	}
+	//services whose members all stayed behind are not served here
+	std::vector<int> unserved;
+	for(std::unordered_map<int, service_group>::iterator group = services.begin(); group != services.end(); ++group) {
+		if(group->second.members.empty()) {
+			unserved.push_back(group->first);
+		}
+	}
+	for(size_t i = 0; i < unserved.size(); i++) {
+		addToCloseQueue(unserved[i]);
+		closeConnection(unserved[i]);
+	}
+	listen_held = false;
+	EZLOG(Log::dbg, verbose) << "took over " << client_map.size() << " clients" << '\n';
+}
+
+//Carries on with the sockets of one record as the old relay left them
+void EZRelay::adoptRecord(EZHandOffRecord &record, std::unordered_map<uint64_t, int> &client_map) {
+	std::vector<int> &fds = record.fds;
+	uint64_t value = 0, accepted_at = 0;
+	int client;
+	switch(record.type) {
+		case EZHANDOFF_LISTENERS:
+			if(fds.size() < 2 || is_listening) {
+				break;
+			}
+			comms_socket = fds[0];
+			openConnection(comms_socket, conn_comms, -1);
+			watchListener(comms_socket);
+			rendezvous_socket = fds[1];
+			openConnection(rendezvous_socket, conn_rendezvous, -1);
+			watchListener(rendezvous_socket);
+			if(fds.size() > 2 && (stats_port > 0 || stats_path != "")) {
+				stats_socket = fds[2];
+			} else {
+				if(fds.size() > 2) {
+					close(fds[2]);
+				}
+				stats_socket = createStatsListener();
+			}
+			if(stats_socket != -1) {
+				openConnection(stats_socket, conn_stats_listener, -1);
+				watchListener(stats_socket);
+			}
+			is_listening = true;
+			return;
+		case EZHANDOFF_CLIENT: {
+			uint64_t greeted = 0, setup = 0, idle = 0;
+			std::string token, input, output, service;
+			if(fds.size() != 2 || !record.getInt(value, 4) || !record.getInt(greeted, 1) || !record.getInt(setup, 4) || !record.getInt(idle, 4)
+				|| !record.getString(token) || !record.getString(input) || !record.getString(output) || !record.getString(service) || client_tokens.count(token) > 0) {
+				break;
+			}
+			client = allocateClient(fds[0], token);
+			client_map[value] = client;
+			EZClient &cli = clients[client];
+			cli.greeted = (greeted != 0);
+			cli.setup_timeout = (int)setup;
+			cli.idle_timeout = (int)idle;
+			cli.control.importBuffers(input, output);
+			openConnection(fds[0], conn_client_control, client);
+			openConnection(fds[1], conn_client_listener, client);
+			cli.listener = fds[1];
+			cli.port = getPortFromSocket(fds[1]);
+			client_ports[cli.port] = client;
+			watchListener(fds[1]);
+			watchSocket(fds[0], POLLIN);
+			if(!cli.greeted) {
+				scheduleTimer(fds[0], setup_timeout);
+			} else if(service != "") {
+				joinService(client, service);
+			}
+			//messages may be waiting in the input taken over
+			readControl(fds[0]);
+			queueControl(client);
+			return;
+		}
+		case EZHANDOFF_SERVICE: {
+			std::string name;
+			int port;
+			if(fds.size() != 1 || !record.getString(name) || name == "" || service_names.count(name) > 0 || (port = getPortFromSocket(fds[0])) == 0) {
+				break;
+			}
+			service_ports->acquire(name, [&](int) {
+				return port;
+			});
+			addService(fds[0], name, port);
+			return;
+		}
+		case EZHANDOFF_POOLED:
+			if(fds.size() != 1 || (client = adoptedClient(record, client_map)) == -1) {
+				break;
+			}
+			openConnection(fds[0], conn_pool_idle, client);
+			clients[client].idle_pool.push_back(fds[0]);
+			watchSocket(fds[0], POLLIN);
+			return;
+		case EZHANDOFF_CARRIER:
+			if(fds.size() != 1 || (client = adoptedClient(record, client_map)) == -1) {
+				break;
+			}
+			openConnection(fds[0], conn_mux_carrier, client);
+			clients[client].mux_carriers.push_back(fds[0]);
+			mux_carriers[fds[0]];
+			watchSocket(fds[0], POLLIN);
+			return;
+		case EZHANDOFF_PENDING: {
+			if(fds.size() != 1 || (client = adoptedClient(record, client_map)) == -1 || !record.getInt(value, 8) || !record.getInt(accepted_at, 8) || value == 0) {
+				break;
+			}
+			EZConnection &conn = openConnection(fds[0], conn_request, client);
+			conn.external = true;
+			conn.accepted_at = accepted_at;
+			conn.open_token = value;
+			open_tokens[value] = fds[0];
+			clients[client].stats.open++;
+			clients[client].stats.pending++;
+			scheduleTimer(fds[0], clients[client].setup_timeout);
+			return;
+		}
+		case EZHANDOFF_HELLO_PENDING:
+			if(fds.size() != 1) {
+				break;
+			}
+			addRendezvous(fds[0]);
+			return;
+		case EZHANDOFF_PAIR: {
+			if(fds.size() != 2 || (client = adoptedClient(record, client_map)) == -1 || !record.getInt(accepted_at, 8)) {
+				break;
+			}
+			EZConnection &conn = openConnection(fds[0], conn_request, client);
+			conn.external = true;
+			conn.accepted_at = accepted_at;
+			clients[client].stats.open++;
+			openConnection(fds[1], conn_request, client);
+			pairRequest(fds[0], fds[1]);
+			return;
+		}
+		default:
+			break;
+	}
+	EZLOG(Log::err, verbose) << "dropped hand-off record " << record.type << '\n';
+	record.closeFds();
+}
+
+//Reads a record's client field, -1 if that client was not taken over
+int EZRelay::adoptedClient(EZHandOffRecord &record, std::unordered_map<uint64_t, int> &client_map) {
+	uint64_t value;
+	if(!record.getInt(value, 4)) {
+		return -1;
+	}
+	std::unordered_map<uint64_t, int>::iterator it = client_map.find(value);
+	return (it == client_map.end() ? -1 : it->second);
+}
+
+void EZRelay::run(int timeout) {
+	if(!is_listening && !listen_held){
+		listen();
+	}
+	auto cb = [&](pollfd tmp_pfd) {
+		runHandler(tmp_pfd);
+	};
+	try{
+		processCloseQueue();
+		//the last request of a drain may have just closed, nothing is left to wait for
+		updateDrained();
+		if(drained) {
+			return;
+		}
+		timeout = pollTimeout(timeout);
+#ifdef EZRELAY_HAVE_IO_URING
+		if(uring_active) {
+			doUring(timeout);
+		} else {
+			//requests that spent their budget are still readable, so the poll must not wait
+			doPoll((active_clients.empty() ? timeout : 0), cb);
+		}
+#else
+		doPoll((active_clients.empty() ? timeout : 0), cb);
+#endif
+		scheduleForwarding();
+		expireTimers();
+		if(handoff_socket != -1) {
+			finishHandOff();
+		}
+		applyCommands();
+		flushControl();
+	} catch(...) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelay::run: Error in processCloseQueue or doPoll.")
+		);
+	}
+}
+
+//Applies what other threads posted since the last call, see ezcommand.h
+void EZRelay::applyCommands() {
+	EZRelayCommand command;
+	while(commands.pop(command)) {
+		EZLOG(Log::dbg, verbose) << "applying command " << command.type << '\n';
+		switch(command.type) {
+			case ezcmd_stop_listening:
+				stopListening();
+				listen_held = true;
+				break;
+			case ezcmd_evict_client: {
+				std::unordered_map<int, int>::iterator port = client_ports.find(command.port);
+				if(port != client_ports.end()) {
+					//the same path as the client disconnecting
+					addToCloseQueue(clients[port->second].control_socket);
+				}
+				break;
+			}
+			case ezcmd_drain:
+				stopListening();
+				listen_held = true;
+				if(!draining && drain_timeout > 0) {
+					drain_deadline = ezMonotonicMicros() / 1000 + drain_timeout;
+				}
+				draining = true;
+				break;
+			case ezcmd_collect_stats:
+				command.reply->set_value(renderStats());
+				break;
+			case ezcmd_hand_off:
+				beginHandOff(command);
+				break;
+			default:
+				break;
+		}
+	}
+	updateDrained();
+}
+
+void EZRelay::updateDrained() {
+	if(!draining || drained) {
+		return;
+	}
+	uint64_t open = 0;
+	for(size_t client = 0; client < clients.size(); client++) {
+		if(clients[client].in_use) {
+			open += clients[client].stats.open;
+		}
+	}
+	drained = (open == 0);
+}
+
+//Starts a hand-off. io_uring keeps accepting on a listener until its accept is cancelled,
+//so the listeners are only handed over by finishHandOff() once every accept has completed.
+void EZRelay::beginHandOff(const EZRelayCommand &command) {
+	if(handoff_socket != -1 || !is_listening) {
+		try {
+			throw std::runtime_error("EZRelay::beginHandOff: Not listening or already handing off.");
+		} catch(...) {
+			command.reply->set_exception(std::current_exception());
+		}
+		return;
+	}
+	handoff_socket = command.sockid;
+	handoff_reply = command.reply;
+#ifdef EZRELAY_HAVE_IO_URING
+	if(uring_active) {
+		for(int sockid = 0; sockid < (int)connections.size(); sockid++) {
+			struct io_uring_sqe *sqe;
+			if(connections[sockid].accepting && (sqe = uring.getSqe()) != NULL) {
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->fd = -1;
+				sqe->addr = uringUserData(sockid, URING_ACCEPT);
+				sqe->user_data = ((uint64_t)URING_CANCEL << 24);
+			}
+		}
+		return;
+	}
+#endif
+	finishHandOff();
+}
+
+void EZRelay::finishHandOff() {
+	for(int sockid = 0; sockid < (int)connections.size(); sockid++) {
+		if(connections[sockid].accepting) {
+			return;
+		}
+	}
+	int sockid = handoff_socket;
+	std::shared_ptr<std::promise<std::string> > reply = handoff_reply;
+	handoff_socket = -1;
+	handoff_reply.reset();
+	try {
+		reply->set_value(handOff(sockid));
+	} catch(...) {
+		reply->set_exception(std::current_exception());
+	}
+	if(!is_listening) {
+		return;
+	}
+#ifdef EZRELAY_HAVE_IO_URING
+	//nothing was handed over, accept again
+	for(int listener = 0; listener < (int)connections.size(); listener++) {
+		uint8_t type = connections[listener].type;
+		if(uring_active && (type == conn_comms || type == conn_rendezvous || type == conn_stats_listener || type == conn_client_listener || type == conn_service_listener)) {
+			uringArmAccept(listener);
+		}
+	}
+#endif
+}
+
+void EZRelay::sendHandOff(int sockid, EZHandOffRecord &record) {
+	if(!record.send(sockid)) {
+		throw std::runtime_error("EZRelay::sendHandOff: Error produced in sendmsg(" + std::to_string(sockid) + ") of record " + std::to_string(record.type) + ", errno " + std::to_string(errno) + ".");
+	}
+}
+
+//Sends everything that can carry on in another process, see ezhandoff.h, and drains the rest.
+//Streams stay with their carriers, and requests with data in their pipes or io_uring operations
+//in flight stay too; so does a client whose control output would not fit in a record.
+std::string EZRelay::handOff(int sockid) {
+	//requests a rate limit held back after io_uring accepted them go over with their clients, unlimited this once
+	for(size_t client = 0; client < clients.size(); client++) {
+		EZClient &cli = clients[client];
+		for(size_t i = 0; cli.in_use && i < cli.deferred_accepts.size(); i++) {
+			openRequest(client, cli.deferred_accepts[i]);
+		}
+		cli.deferred_accepts.clear();
+		cli.accept_deferred = false;
+	}
+	//OPENs queued this loop iteration go into the control output handed over with their clients
+	flushControl();
+	EZHandOffRecord listeners(EZHANDOFF_LISTENERS);
+	listeners.fds.push_back(comms_socket);
+	listeners.fds.push_back(rendezvous_socket);
+	if(stats_socket != -1 && connectionType(stats_socket) == conn_stats_listener) {
+		listeners.fds.push_back(stats_socket);
+	}
+	sendHandOff(sockid, listeners);
+	//services go before their members, who rejoin them as they are taken over
+	std::vector<std::string> serving(clients.size());
+	std::vector<int> service_listeners;
+	for(std::unordered_map<int, service_group>::iterator group = services.begin(); group != services.end(); ++group) {
+		EZHandOffRecord record(EZHANDOFF_SERVICE);
+		record.putString(group->second.name);
+		record.fds.push_back(group->first);
+		sendHandOff(sockid, record);
+		for(size_t i = 0; i < group->second.members.size(); i++) {
+			serving[group->second.members[i]] = group->second.name;
+		}
+		service_listeners.push_back(group->first);
+	}
+	//from here the new relay accepts, this one only finishes what it keeps
+	for(size_t i = 0; i < listeners.fds.size(); i++) {
+		releaseConnection(listeners.fds[i]);
+	}
+	for(size_t i = 0; i < service_listeners.size(); i++) {
+		releaseConnection(service_listeners[i]);
+	}
+	stats_socket = -1;
+	is_listening = false;
+	listen_held = true;
+	tracer.flush();
+	if(!draining && drain_timeout > 0) {
+		drain_deadline = ezMonotonicMicros() / 1000 + drain_timeout;
+	}
+	draining = true;
+	std::vector<bool> moved(clients.size(), false);
+	size_t moved_clients = 0, moved_requests = 0, kept_clients = 0;
+	for(int client = 0; client < (int)clients.size(); client++) {
+		EZClient &cli = clients[client];
+		if(!cli.in_use || cli.control_socket == -1 || connections[cli.control_socket].close_state != close_none) {
+			continue;
+		}
+		EZHandOffRecord record(EZHANDOFF_CLIENT);
+		std::string input, output;
+		cli.control.exportBuffers(input, output);
+		record.putInt(client, 4);
+		record.putInt(cli.greeted, 1);
+		record.putInt(cli.setup_timeout, 4);
+		record.putInt(cli.idle_timeout, 4);
+		record.putString(cli.token);
+		record.putString(input);
+		record.putString(output);
+		record.putString(serving[client]);
+		record.fds.push_back(cli.control_socket);
+		record.fds.push_back(cli.listener);
+		if(input.size() + output.size() + cli.token.size() + serving[client].size() + 64 > EZHANDOFF_MAX_RECORD) {
+			//it stays and goes down with this relay, so say so whether or not verbose is on
+			EZLOG(Log::wrn, true) << "client on port " << cli.port << " has " << (input.size() + output.size()) << " bytes of control data, more than a hand-off record holds, it is not handed off" << '\n';
+			kept_clients++;
+			continue;
+		}
+		sendHandOff(sockid, record);
+		releaseConnection(cli.control_socket);
+		releaseConnection(cli.listener);
+		cli.control_socket = cli.listener = -1;
+		client_tokens.erase(cli.token);
+		moved[client] = true;
+		moved_clients++;
+		for(size_t i = 0; i < cli.idle_pool.size(); i++) {
+			EZHandOffRecord pooled(EZHANDOFF_POOLED);
+			pooled.putInt(client, 4);
+			pooled.fds.push_back(cli.idle_pool[i]);
+			sendHandOff(sockid, pooled);
+			releaseConnection(cli.idle_pool[i]);
+		}
+		cli.idle_pool.clear();
+		std::vector<int> kept;
+		for(size_t i = 0; i < cli.mux_carriers.size(); i++) {
+			int carrier = cli.mux_carriers[i];
+			mux_carrier &mc = mux_carriers[carrier];
+			if(mc.streams > 0 || mc.channel.pending() > 0 || mc.channel.buffered() > 0) {
+				//closed once its streams have ended, the client then connects a new one to the new relay
+				mc.retiring = true;
+				kept.push_back(carrier);
+				continue;
+			}
+			EZHandOffRecord record(EZHANDOFF_CARRIER);
+			record.putInt(client, 4);
+			record.fds.push_back(carrier);
+			sendHandOff(sockid, record);
+			releaseConnection(carrier);
+		}
+		cli.mux_carriers.swap(kept);
+		for(size_t i = 0; i < cli.mux_carriers.size(); i++) {
+			//one kept only for a partial frame from the client has nothing to wait for
+			retireCarrier(cli.mux_carriers[i]);
+		}
+	}
+	for(int request = 0; request < (int)connections.size(); request++) {
+		EZConnection &conn = connections[request];
+		if(conn.close_state != close_none) {
+			continue;
+		}
+		if(conn.type == conn_rendezvous_pending) {
+			EZHandOffRecord record(EZHANDOFF_HELLO_PENDING);
+			record.fds.push_back(request);
+			sendHandOff(sockid, record);
+			releaseConnection(request);
+			continue;
+		}
+		if(conn.type != conn_request || !conn.external || conn.client < 0 || !moved[conn.client]) {
+			continue;
+		}
+		if(conn.open_token != 0) {
+			EZHandOffRecord record(EZHANDOFF_PENDING);
+			record.putInt(conn.client, 4);
+			record.putInt(conn.open_token, 8);
+			record.putInt(conn.accepted_at, 8);
+			record.fds.push_back(request);
+			sendHandOff(sockid, record);
+			releaseConnection(request);
+			moved_requests++;
+			continue;
+		}
+		int peer = conn.peer;
+		if(uring_active || peer == -1 || connections[peer].close_state != close_none
+			|| conn.in_pipe > 0 || connections[peer].in_pipe > 0 || conn.blocked || connections[peer].blocked) {
+			continue;
+		}
+		EZHandOffRecord record(EZHANDOFF_PAIR);
+		record.putInt(conn.client, 4);
+		record.putInt(conn.accepted_at, 8);
+		record.fds.push_back(request);
+		record.fds.push_back(peer);
+		sendHandOff(sockid, record);
+		releaseConnection(request);
+		releaseConnection(peer);
+		moved_requests++;
+	}
+	EZHandOffRecord end(EZHANDOFF_END);
+	sendHandOff(sockid, end);
+	updateDrained();
+	std::string summary = "handed off " + std::to_string(moved_clients) + " clients and " + std::to_string(moved_requests) + " requests";
+	if(kept_clients > 0) {
+		summary += ", kept " + std::to_string(kept_clients) + " clients";
+	}
+	EZLOG(Log::dbg, verbose) << summary << '\n';
+	return summary;
+}
+
+bool EZRelay::postCommand(uint8_t type, int port) {
+	EZRelayCommand command;
+	command.type = type;
+	command.port = port;
+	command.sockid = -1;
+	return commands.push(command);
+}
+
+bool EZRelay::postStopListening() {
+	return postCommand(ezcmd_stop_listening, 0);
+}
+
+bool EZRelay::postEvictClient(int port) {
+	return postCommand(ezcmd_evict_client, port);
+}
+
+bool EZRelay::postDrain() {
+	return postCommand(ezcmd_drain, 0);
+}
+
+bool EZRelay::postWake() {
+	return postCommand(ezcmd_wake, 0);
+}
+
+std::future<std::string> EZRelay::postCollectStats() {
+	EZRelayCommand command;
+	command.type = ezcmd_collect_stats;
+	command.port = 0;
+	command.sockid = -1;
+	command.reply = std::make_shared<std::promise<std::string> >();
+	std::future<std::string> stats = command.reply->get_future();
+	if(!commands.push(command)) {
+		try {
+			throw std::runtime_error("EZRelay::postCollectStats: Command queue full.");
+		} catch(...) {
+			command.reply->set_exception(std::current_exception());
+		}
+	}
+	return stats;
+}
+
+std::future<std::string> EZRelay::postHandOff(int sockid) {
+	EZRelayCommand command;
+	command.type = ezcmd_hand_off;
+	command.port = 0;
+	command.sockid = sockid;
+	command.reply = std::make_shared<std::promise<std::string> >();
+	std::future<std::string> summary = command.reply->get_future();
+	if(!commands.push(command)) {
+		try {
+			throw std::runtime_error("EZRelay::postHandOff: Command queue full.");
+		} catch(...) {
+			command.reply->set_exception(std::current_exception());
+		}
+	}
+	return summary;
+}
+
+bool EZRelay::isDrained() {
+	return drained;
+}
+
 bool EZRelay::readLine(int sockid, std::string &line) {
 	char buffer[1024];
 	ssize_t len;
@@ -3,6 +3,7 @@
 #include <cstring>
 #include <unordered_map>
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <errno.h>
 #include <exception>
@@ -10,6 +11,8 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -17,6 +20,21 @@
 #include <iostream>
 #include <fcntl.h>
 #include <functional>
+#include <random>
+#include <atomic>
+#include <future>
+#include <memory>
+#include "ezpoller.h"
+#include "ezuring.h"
+#include "ezpipepool.h"
+#include "ezconnection.h"
+#include "ezprotocol.h"
+#include "ezmux.h"
+#include "ezcontrol.h"
+#include "ezcommand.h"
+#include "eztimer.h"
+#include "ezhandoff.h"
+#include "ezservice.h"
 #ifndef _EZRELAY_H
 #define _EZRELAY_H
 
@@ -26,49 +44,200 @@ class EZRelay {
 private:
 	std::string relay_hostname;
 	int comms_port, backlog_size, comms_socket;
+	int rendezvous_port, rendezvous_socket; //every client data connection arrives on this one listener
+	int stats_port, stats_socket; //optional stats endpoint, on loopback or at stats_path
+	std::string stats_path;
+	EZRequestTracer tracer; //samples request setup stages, see eztrace.h
+	std::string trace_path;
+	std::unordered_map<int, std::string> stats_out; //snapshot each stats reader has still to be sent
 	bool verbose;
-	int ezpipe[2]; //used for splice() to pipe, created on instantiation.
-	//These can be broken out into their own class definition for client tracking
-	//Left this as-is for simplicity sake
-
-	std::unordered_map<int, int> client_listeners; //maps port to client listeners
-	std::unordered_map<int, int> listener_client; //maps client listeners to port
-	std::unordered_map<int, int> client_socket; //maps port to client connection to relay
-	std::unordered_map<int, int> socket_ports; //maps any socket to its corresponding client port
-	std::unordered_map<int, int> socket_requests; //maps sockets to their corresponding connected socket 
-	std::unordered_map<int, int> listener_newrequests; //temporary for new requests, maps listener for request to socket to connect with
-	std::unordered_map<int, int> listener_nr_ports; //temporary for new requests, maps listener for request to port of client
-	std::vector<pollfd> poll_sockets;
-	std::vector<int> client_ports;
-	std::unordered_map<int, bool> close_queue; //items to be closed along with bool indicating if it has been close already
+	bool reuse_port; //comms listener shares its port with other relays, see EZRelayShards
+	EZPipePool pipe_pool; //pipes for splice(), one leased per forwarding direction
+	//Every socket the relay owns has an entry in connections, indexed by fd.
+	//Only openConnection() grows the table, so references into it must not be held across that call.
+	std::vector<EZConnection> connections;
+	std::vector<EZClient> clients;
+	std::vector<int> free_clients; //unused slots in clients
+	std::vector<int> dirty_clients; //clients with control output to send at the end of this loop iteration
+	//Fair forwarding: a readable request is queued on its client, and each round every client with queued requests
+	//gets one turn of up to FORWARD_QUANTUM bytes, so a busy client cannot starve the others, see scheduleForwarding()
+	std::deque<int> active_clients; //clients with requests to forward and tokens to do it
+	std::vector<int> throttled_clients; //clients waiting for a bucket to refill
+	uint64_t byte_rate; //bytes a second new clients may forward, 0 for no limit
+	int request_rate; //requests a second new clients may accept, 0 for no limit
+	std::mt19937_64 token_rng;
+	std::unordered_map<std::string, int> client_tokens; //client token to index in clients
+	std::unordered_map<int, int> client_ports; //public port to index in clients
+	std::unordered_map<uint64_t, int> open_tokens; //one-time OPEN token to the request waiting for it
+	//Clients naming the same service in their HELLO share its public listener, each keeps its own port too.
+	//A request on the shared one goes to the member pickMember() chooses, see acceptService().
+	struct service_group {
+		std::string name;
+		int port;
+		std::vector<int> members; //clients serving it, in the order they joined
+	};
+	std::unordered_map<int, service_group> services; //keyed by listener
+	std::unordered_map<std::string, int> service_names; //service name to its listener
+	std::shared_ptr<EZServicePorts> service_ports; //port each service is bound on, shared by the relays of a process
+	struct mux_carrier {
+		EZMuxChannel channel;
+		std::vector<int> paused; //streams waiting for the carrier to drain
+		int streams; //open streams on it
+		bool retiring; //kept by a hand-off, closed once its last stream has ended, see retireCarrier()
+		mux_carrier() : streams(0), retiring(false) {}
+	};
+	std::unordered_map<int, mux_carrier> mux_carriers; //keyed by carrier socket
+	std::unordered_map<int, std::string> stream_pending; //data from the client a slow request has not taken yet
+	EZPoller poller; //readiness for every listener and data socket, edge triggered where supported
+	bool uring_requested, uring_active;
+#ifdef EZRELAY_HAVE_IO_URING
+	//completion engine, replaces poller when active
+	//accepts, splices and closes are queued as sqes and submitted once per run()
+	EZUring uring;
+	bool uring_multishot; //cleared if the kernel rejects multishot accept
+	uint64_t uringUserData(int sockid, int op);
+	bool openUring();
+	void uringArmAccept(int sockid);
+	void uringWatch(int sockid, short events);
+	void uringStartFlow(int from_socket);
+	void uringSubmitOut(int from_socket);
+	void uringAdvanceFlow(int from_socket);
+	void uringQueueClose(int sockid);
+	void uringCloseConnection(int sockid);
+	void uringHandleCompletion(uint64_t user_data, int res, unsigned flags);
+	void doUring(int timeout);
+#endif
+	std::vector<std::pair<int, uint32_t> > close_queue; //sockets to be closed with the generation they were queued under
 	bool is_listening;
+	EZCommandQueue commands; //posted by other threads, applied by applyCommands() after each poll
+	bool commands_watched;
+	bool listen_held; //stopped by a command, run() does not listen again by itself
+	bool draining; //new requests are refused, see postDrain()
+	std::atomic<bool> drained;
+	//Deadlines, one timer per socket: setup while a request waits for its OPEN to be answered
+	//or a new connection for its hello, idle once a request is paired. Checked after each poll.
+	EZTimerWheel timers;
+	std::vector<std::pair<int, uint32_t> > expired; //filled by timers.advance(), kept to reuse its storage
+	int setup_timeout, idle_timeout; //ms, defaults of new clients, setup_timeout also bounds hellos
+	int drain_timeout; //ms a drain waits for open requests before closing them, 0 for no limit
+	uint64_t drain_deadline; //monotonic ms, 0 while no drain is timed
+	int handoff_socket; //hand-off waiting for io_uring accepts to be cancelled, -1 for none
+	std::shared_ptr<std::promise<std::string> > handoff_reply;
 
 	int getPortFromSocket(int sockid);
 	std::string getAddressFromSocket(int sockid);
 	bool isConnected(int sockid);
 
-	int createListener(int portnum, int blsize);
-	
-	void addPollSocket(int sockid);
-	void removePollSocket(int sockid);
+	int createListener(int portnum, int blsize, bool shared_port);
+	void setNonBlocking(int sockid);
+
+	EZConnection &openConnection(int sockid, uint8_t type, int client);
+	void resetConnection(int sockid);
+	void releaseConnection(int sockid);
+	void linkClient(int sockid, int client);
+	void unlinkClient(int sockid);
+	uint8_t connectionType(int sockid);
+
+	void watchListener(int sockid);
+	void watchPair(int first_socket, int second_socket);
+	void watchSocket(int sockid, short events);
 
-	void registerRequest(int new_listener);
+	uint64_t newToken();
+	static std::string formatToken(uint64_t token);
+	static bool parseToken(const std::string &token, uint64_t &value);
+	void pairRequest(int newrequest, int cli_receiver);
 	
 	void addToCloseQueue(int sockid);
 	void processCloseQueue();
 
 	void runHandler(pollfd tmp_pfd);
+	void applyCommands();
+	void updateDrained();
+	bool postCommand(uint8_t type, int port);
 
 	void acceptClient();
-	int addClientListener();
+	int allocateClient(int control_socket, const std::string &token);
+	void addClient(int newsocket);
+	int addClientListener(int client);
 	void removeClientListener(int sockid);
+	void readControl(int control_socket);
+	void failOpens(int client, const EZControlChannel::message &m);
+	int joinService(int client, const std::string &name);
+	int openService(const std::string &name);
+	void addService(int listener, const std::string &name, int port);
+	void leaveService(int client);
+	int pickMember(int listener, bool limited);
+	void acceptService(int listener);
+	void failOverRequest(int request, int client);
+	void queueControl(int client);
+	void flushControl();
+	void acceptRendezvous(int listener);
+	void addRendezvous(int sockid);
+	void readHello(int sockid);
+	void readPooled(int pooled);
+	bool pairPooled(int newrequest);
+
+	uint32_t streamId(int sockid);
+	int streamSocket(int carrier, uint32_t stream);
+	bool openStream(int newrequest);
+	void readStream(int sockid);
+	void deliverStream(int sockid, const char *data, size_t length);
+	void writeStream(int sockid);
+	void updateStreamInterest(int sockid);
+	void resumeStream(int sockid);
+	void readCarrier(int carrier);
+	void flushCarrier(int carrier);
+	void retireCarrier(int carrier);
+
+	void scheduleTimer(int sockid, int timeout);
+	void markActive(int sockid);
+	void expireTimers();
+	void expireDrain();
+	int pollTimeout(int timeout);
+
+	void countClose(int sockid, bool by_client);
+	void countSetup(int newrequest);
+	void traceStage(int request, int stage);
+	void traceFirstByte(int sockid);
+	void finishTrace(int request);
+	int createStatsListener();
+	void acceptStats(int listener);
+	void addStats(int sockid);
+	void writeStats(int sockid);
+	void readStats(int sockid);
 
 	void acceptRequest(int sockid);
-	bool forwardRequest(int from_socket, int to_socket);
+	void resumeAccepts(int client);
+	void openRequest(int client, int newrequest);
+	void dispatchRequest(int newrequest);
+	void queueForward(int sockid);
+	void throttleForward(int sockid);
+	void activateClient(int client);
+	void throttleClient(int client);
+	void scheduleForwarding();
+	void wakeThrottled(uint64_t now_us);
+	int throttleTimeout(uint64_t now_us);
+	bool drainRequest(int from_socket, int to_socket, size_t &budget);
+	bool forwardRequest(int from_socket, int to_socket, size_t &budget);
+	void adaptSplice(int sockid, size_t moved, size_t bulk_at);
+	void resizePipe(int sockid);
+	size_t pipeFloor();
+	bool flushPipe(int from_socket, int to_socket);
+	void resumeRequest(int to_socket);
+	void updateInterest(int sockid);
+	void updateQueuedInterest(int client);
 
 	void closeConnection(int sockid);
 
-	void doPoll(std::vector<pollfd> pollers, int timeout, std::function<void(pollfd)> callback);
+	void startEngine();
+	void beginHandOff(const EZRelayCommand &command);
+	void finishHandOff();
+	std::string handOff(int sockid);
+	void sendHandOff(int sockid, EZHandOffRecord &record);
+	void adoptRecord(EZHandOffRecord &record, std::unordered_map<uint64_t, int> &client_map);
+	int adoptedClient(EZHandOffRecord &record, std::unordered_map<uint64_t, int> &client_map);
+
+	void doPoll(int timeout, std::function<void(pollfd)> callback);
 
 public:
 	//constructor
@@ -82,14 +251,88 @@ public:
 	void setCommsPort(int portnum);
 	int getCommsPort();
 
+	//port every client data connection connects to, 0 for one picked by the kernel at listen()
+	//EZRelayShards needs one per shard, a data connection must reach the shard that sent its OPEN
+	void setRendezvousPort(int portnum);
+	int getRendezvousPort();
+
+	//serves per-client counters in the Prometheus text format over HTTP, 0 turns it off
+	//the port is bound on 127.0.0.1, a Unix socket path takes precedence over it
+	//must be called before listen(), EZRelayShards gives each shard its own endpoint
+	void setStatsPort(int portnum);
+	int getStatsPort();
+	void setStatsSocket(std::string path);
+	std::string getStatsSocket();
+	//the text the stats endpoint serves
+	std::string renderStats();
+
+	//traces the setup stages of one in every requests into per-stage histograms on the stats endpoint, 0 turns it off
+	void setTraceSampling(int every);
+	int getTraceSampling();
+	//also writes traced requests to path as Chrome trace events, returns false if it cannot be opened
+	bool setTraceFile(std::string path);
+	std::string getTraceFile();
+
 	//sets the backlog size for sockets
 	void setBacklogSize(int size);
 
+	//binds the comms port with SO_REUSEPORT so several relays can accept on it
+	void setReusePort(bool enabled);
+
 	//sets printing of debug info
 	void setVerboseOutput(bool verbose_enabled);
 
+	//capacity in bytes of each forwarding pipe (F_SETPIPE_SZ), 0 for the kernel default
+	void setPipeSize(int bytes);
+	int getPipeSize();
+
+	//selects epoll or poll() for the event loop, must be called before listen()
+	void setPollBackend(EZPoller::backend_type bt);
+	EZPoller::backend_type getPollBackend();
+
+	//runs accepts, splices and closes through io_uring, must be called before listen()
+	//falls back to the poll backend if the kernel or build has no io_uring support
+	void setIOUringEnabled(bool enabled);
+	bool isIOUringActive();
+
+	//ms a new connection may take to greet the relay, and the default for how long
+	//a client may take to connect back for an OPEN, 0 for no limit -- default value is 30000
+	void setSetupTimeout(int ms);
+	int getSetupTimeout();
+	//default ms a paired request may move no data before it is closed, 0 for no limit -- default value is 0
+	void setIdleTimeout(int ms);
+	int getIdleTimeout();
+	//overrides both for the client registered on its public port, returns false if there is none
+	//applies to requests set up from then on
+	bool setClientTimeouts(int port, int setup_ms, int idle_ms);
+	//ms a drain waits for open requests before closing them, 0 waits for as long as they take
+	void setDrainTimeout(int ms);
+	int getDrainTimeout();
+
+	//default bytes a second each client's requests may forward, both directions together, 0 for no limit -- default value is 0
+	//a client may burst a second's worth, past that its requests wait for their turn instead of being dropped
+	void setByteRate(uint64_t bytes_per_sec);
+	uint64_t getByteRate();
+	//default requests a second each client may accept on its public port, 0 for no limit -- default value is 0
+	//requests over it wait in the listener's backlog
+	void setRequestRate(int requests_per_sec);
+	int getRequestRate();
+	//overrides both for the client registered on its public port, returns false if there is none
+	bool setClientRates(int port, uint64_t bytes_per_sec, int requests_per_sec);
+
+	//port the named service is served on, 0 lets the kernel pick one when its first client registers -- default value is 0
+	//a port that cannot be bound leaves the service's clients with only their own ports
+	void setServicePort(std::string name, int portnum);
+	int getServicePort(std::string name);
+	//shares service ports with other relays in this process, so each serves a service on the same port with SO_REUSEPORT
+	//EZRelayShards gives every shard the same ones, set ports after setThreads()
+	void setServicePorts(std::shared_ptr<EZServicePorts> ports);
+
 	//listens for new clients
 	void listen();
+	//listens on the sockets a relay in another process hands over on sockid instead, see postHandOff()
+	//its clients, idle connections and quiet requests carry on here, throws if the hand-off fails part way
+	void takeOver(int sockid);
 	//stops listening for new clients
 	void stopListening();
 
@@ -97,6 +340,27 @@ public:
 	//should be executed in a loop to poll for messages
 	void run(int timeout);
 
+	//the post functions are safe from any thread, the rest of the API only from the one calling run()
+	//each queues a command and wakes run(), which applies it once its poll returns
+	//they return false if too many commands are already waiting
+	//stops listening, run() does not listen again until listen() is called
+	bool postStopListening();
+	//closes the client registered on its public port and everything it owns
+	bool postEvictClient(int port);
+	//stops listening and refuses new requests, open ones are left to finish, see isDrained()
+	//with a drain timeout, the ones still open once it passes are closed
+	bool postDrain();
+	//only makes run() return
+	bool postWake();
+	//fulfilled with renderStats() by the thread calling run()
+	std::future<std::string> postCollectStats();
+	//sends the listeners, clients, idle connections and quiet requests over sockid to a relay calling takeOver(),
+	//then drains what is left; fulfilled with a summary once all of it is sent
+	//requests still moving data stay here until they finish, as do all of them under io_uring
+	std::future<std::string> postHandOff(int sockid);
+	//true once a drain finished and no request is left open, safe from any thread
+	bool isDrained();
+
 //HELPERS
 	//readLine() takes a socket and reads buffer until it finds a newline
 	//returns entire set of buffers found to newline and extra data after newline
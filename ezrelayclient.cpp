@@ -3,15 +3,26 @@
 
 #define DEFAULT_PORT 8000
 #define RCVBUFSIZE 32
+#define DEFAULT_POOL_SIZE 4
+#define MAX_WORKER_THREADS 256
 
 EZRelayClient::EZRelayClient() {
 	relay_port = DEFAULT_PORT;
 	relay_hostname = "localhost";
 	verbose = false;
-	if (pipe(ezpipe) == -1) {
-		Log(Log::err, 1) << "Critical Error: Unable to create pipe, unable to start relay.\n";
-		exit(1);
-	}
+	rendezvous_port = 0;
+	control_version = 0;
+	pool_size = DEFAULT_POOL_SIZE;
+	pool_connecting = 0;
+	carriers_connecting = 0;
+	mux_count = 0;
+	worker_count = 0;
+	workers_stopping = false;
+	worker_wake = -1;
+}
+
+EZRelayClient::~EZRelayClient() {
+	stopWorkers();
 }
 
 int EZRelayClient::getPortFromSocket(int sockid) {
@@ -42,28 +53,10 @@ bool EZRelayClient::isConnected(int sockid) {
 	return false;
 }
 
-//Adds socket to the list of sockets to be polled
-void EZRelayClient::addPollSocket(int sockid) {
-	struct pollfd new_pfd;
-	new_pfd.fd = sockid;
-	new_pfd.events = POLLIN;
-	poll_sockets.push_back(new_pfd);
-	Log(Log::dbg, verbose) << "Added poll_socket: " << std::to_string(sockid) << "\n";
-}
-
-//Remove socket from the list of sockets to be polled
-void EZRelayClient::removePollSocket(int sockid) {
-	Log(Log::dbg, verbose) << "Removing poll_socket: " << std::to_string(sockid) << "\n";
-	poll_sockets.erase(std::remove_if(poll_sockets.begin(), poll_sockets.end(), [&](pollfd const& v) { return (v.fd == sockid); }), poll_sockets.end());
-	auto iter = std::find_if(poll_sockets.begin(), poll_sockets.end(), [&](const pollfd& pf){return pf.fd == sockid;});
-	std::string is_removed = (iter == poll_sockets.end() ? "YES" : "NO");
-	Log(Log::dbg, verbose) << "Is poll_socket " << std::to_string(sockid) <<  " removed? -- " << is_removed << "\n";
-}
-
 void EZRelayClient::addToCloseQueue(int sockid) {
 	if(close_queue.count(sockid) == 0) {
 		close_queue[sockid] = false;
-		Log(Log::dbg, verbose) << "Added socket to close_queue: " << std::to_string(sockid) << "\n";
+		EZLOG(Log::dbg, verbose) << "Added socket to close_queue: " << sockid << "\n";
 	}
 }
 
@@ -81,53 +74,537 @@ void EZRelayClient::processCloseQueue() {
 
 void EZRelayClient::runHandler(pollfd tmp_pfd, std::function<void(int, int *)> callback) {
 	int from_fd = tmp_pfd.fd;
-	if (tmp_pfd.revents & POLLIN) {
+	if(connecting.count(from_fd) > 0) {
+		std::vector<int> opened;
+		finishConnect(from_fd, opened);
+		for(size_t i = 0; i < opened.size(); i++) {
+			pipe_pool.lease(socket_pipes[opened[i]].fds);
+		}
+	} else if((tmp_pfd.revents & POLLIN) && idle_pool.count(from_fd) > 0) {
+		if(takeActivation(from_fd)) {
+			pipe_pool.lease(socket_pipes[from_fd].fds);
+			//the request may not have sent anything yet, callbacks already expect EAGAIN
+			handleRequest(from_fd, callback);
+		}
+	} else if (tmp_pfd.revents & (POLLIN | POLLOUT)) {
 		if(from_fd == comms_socket) {
-			//handle request from relay
-			int newport = 0;
-			std::string line;
-			bool res = readLine(comms_socket, line);
-			std::stringstream ss;
-			ss << line;
-			ss >> newport;
-			if(newport){
-				Log(Log::dbg, verbose) << "Recieved port: " << std::to_string(newport) << '\n';
-				int newcon = connectToAddress(relay_hostname, newport);
-				Log(Log::dbg, verbose) << "Created new connection: " << std::to_string(newcon) << '\n';
-				addPollSocket(newcon);
+			//handle requests from relay
+			if(tmp_pfd.revents & POLLOUT) {
+				flushControl();
 			}
+			if(tmp_pfd.revents & POLLIN) {
+				acceptOpens();
+			}
+		} else if(from_fd == worker_wake) {
+			collectWorkers();
 		} else {
 			//handle all other requests
-			callback(from_fd, ezpipe);
+			handleRequest(from_fd, callback);
 		}
 	} else if(tmp_pfd.revents & POLLHUP || tmp_pfd.revents & POLLERR || tmp_pfd.revents & POLLNVAL){
 		addToCloseQueue(tmp_pfd.fd);
+		idle_pool.erase(tmp_pfd.fd);
+		if(tmp_pfd.fd == comms_socket) {
+			EZLOG(Log::err, verbose) << "ERROR ON MAIN RELAY SOCKET, EXIT!" << '\n';
+			exit(1);
+		}
+	}
+}
+
+//While a callback leaves data in its pipe the socket is polled for POLLOUT instead of POLLIN,
+//so the callback runs again once it can write and no more input is read until the pipe drains.
+void EZRelayClient::updateInterest(int sockid) {
+	std::unordered_map<int, client_pipe>::iterator it = socket_pipes.find(sockid);
+	if(it == socket_pipes.end() || !poller.contains(sockid)) {
+		return;
+	}
+	int pending = 0;
+	ioctl(it->second.fds[0], FIONREAD, &pending);
+	poller.modify(sockid, (pending > 0 ? POLLOUT : POLLIN), false);
+}
+
+//Runs the callback for a ready data connection, or hands it to a worker.
+//Until the worker is done the connection is left out of the poll set, collectWorkers() puts it back.
+void EZRelayClient::handleRequest(int sockid, std::function<void(int, int *)> &callback) {
+	if(worker_count == 0) {
+		callback(sockid, socket_pipes[sockid].fds);
+		updateInterest(sockid);
+		return;
+	}
+	poller.remove(sockid);
+	worker_job job;
+	job.sockid = sockid;
+	job.fds[0] = socket_pipes[sockid].fds[0];
+	job.fds[1] = socket_pipes[sockid].fds[1];
+	job.callback = callback;
+	{
+		std::lock_guard<std::mutex> lock(worker_lock);
+		worker_jobs.push_back(std::move(job));
+	}
+	worker_ready.notify_one();
+}
+
+void EZRelayClient::startWorkers() {
+	if(worker_count == 0 || !workers.empty()) {
+		return;
+	}
+	worker_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(worker_wake == -1) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelayClient::startWorkers: Error produced in eventfd(), errno " + std::to_string(errno) + ".")
+		);
+	}
+	poller.add(worker_wake, POLLIN, false);
+	workers_stopping = false;
+	for(size_t i = 0; i < worker_count; i++) {
+		workers.push_back(std::thread(&EZRelayClient::workerLoop, this));
+	}
+	EZLOG(Log::dbg, verbose) << "Started " << worker_count << " worker threads" << '\n';
+}
+
+//Lets the workers finish the callbacks already handed to them
+void EZRelayClient::stopWorkers() {
+	if(workers.empty()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(worker_lock);
+		workers_stopping = true;
+	}
+	worker_ready.notify_all();
+	for(size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	workers.clear();
+	poller.remove(worker_wake);
+	close(worker_wake);
+	worker_wake = -1;
+}
+
+void EZRelayClient::workerLoop() {
+	while(true) {
+		worker_job job;
+		{
+			std::unique_lock<std::mutex> lock(worker_lock);
+			while(worker_jobs.empty() && !workers_stopping) {
+				worker_ready.wait(lock);
+			}
+			if(worker_jobs.empty()) {
+				return;
+			}
+			job = std::move(worker_jobs.front());
+			worker_jobs.pop_front();
+		}
+		job.callback(job.sockid, job.fds);
+		{
+			std::lock_guard<std::mutex> lock(worker_lock);
+			worker_done.push_back(job.sockid);
+		}
+		uint64_t one = 1;
+		if(write(worker_wake, &one, sizeof(one)) == -1) {
+			EZLOG(Log::err, verbose) << "Unable to wake the I/O thread, errno " << errno << '\n';
+		}
+	}
+}
+
+//Polls the data connections whose callback a worker finished again
+void EZRelayClient::collectWorkers() {
+	uint64_t count = 0;
+	if(read(worker_wake, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		EZLOG(Log::err, verbose) << "Unable to read worker wakeups, errno " << errno << '\n';
+	}
+	std::vector<int> done;
+	{
+		std::lock_guard<std::mutex> lock(worker_lock);
+		done.swap(worker_done);
+	}
+	for(size_t i = 0; i < done.size(); i++) {
+		poller.add(done[i], POLLIN, false);
+		updateInterest(done[i]);
+	}
+}
+
+//Starts connecting to the relay's rendezvous port without waiting for it.
+//The connection is polled for POLLOUT and finishConnect() sends the hello, see ezprotocol.h.
+//Returns the non-blocking data connection, -1 if the connect failed at once.
+int EZRelayClient::openDataConnection(char kind, const std::string &token) {
+	int sockid = connectToAddress(relay_hostname, rendezvous_port, false);
+	if(sockid == -1) {
+		EZLOG(Log::err, verbose) << "Unable to open data connection to port " << rendezvous_port << ", errno " << errno << '\n';
+		if(kind == EZRELAY_OPEN_HELLO) {
+			reportFailedOpen(token);
+		}
+		return -1;
+	}
+	pending_connect &pc = connecting[sockid];
+	pc.kind = kind;
+	pc.token = token;
+	countConnecting(kind, 1);
+	poller.add(sockid, POLLOUT, false);
+	return sockid;
+}
+
+//Sends the hello once the connect of sockid finished, pooled connections and carriers then wait for the relay,
+//connections answering an OPEN are added to opened. A failed OPEN is reported to the relay.
+void EZRelayClient::finishConnect(int sockid, std::vector<int> &opened) {
+	std::unordered_map<int, pending_connect>::iterator it = connecting.find(sockid);
+	pending_connect pc = it->second;
+	connecting.erase(it);
+	countConnecting(pc.kind, -1);
+	std::string hello = pc.kind + pc.token;
+	//a fresh connection has room for the whole hello, a short send means it failed
+	if(!isConnected(sockid) || send(sockid, hello.data(), hello.size(), MSG_NOSIGNAL) != (ssize_t)hello.size()) {
+		EZLOG(Log::err, verbose) << "Unable to open data connection to port " << rendezvous_port << '\n';
+		addToCloseQueue(sockid);
+		if(pc.kind == EZRELAY_OPEN_HELLO) {
+			reportFailedOpen(pc.token);
+		}
+		return;
+	}
+	poller.modify(sockid, POLLIN, false);
+	if(pc.kind == EZRELAY_POOL_HELLO) {
+		idle_pool[sockid] = true;
+		EZLOG(Log::dbg, verbose) << "Opened pooled connection: " << sockid << '\n';
+	} else if(pc.kind == EZRELAY_MUX_HELLO) {
+		//frames are small and written back to back, Nagle would hold each one for the relay's delayed ACK
+		int enable = 1;
+		setsockopt(sockid, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+		carriers[sockid];
+		EZLOG(Log::dbg, verbose) << "Opened carrier: " << sockid << '\n';
+	} else {
+		EZLOG(Log::dbg, verbose) << "Created new connection: " << sockid << '\n';
+		opened.push_back(sockid);
+	}
+}
+
+void EZRelayClient::countConnecting(char kind, int change) {
+	if(kind == EZRELAY_POOL_HELLO) {
+		pool_connecting += change;
+	} else if(kind == EZRELAY_MUX_HELLO) {
+		carriers_connecting += change;
+	}
+}
+
+//Tells the relay to give up on the request the token was sent for, relays before control version 3 wait for it instead
+void EZRelayClient::reportFailedOpen(const std::string &token) {
+	if(control_version < 3) {
+		return;
+	}
+	control.queueOpenFailures(std::vector<std::string>(1, token));
+	flushControl();
+}
+
+//Writes what is queued for the relay, the control socket is polled for POLLOUT while some is left
+void EZRelayClient::flushControl() {
+	if(!control.flush(comms_socket)) {
+		EZLOG(Log::err, verbose) << "ERROR ON MAIN RELAY SOCKET, EXIT!" << '\n';
+		exit(1);
+	}
+	poller.modify(comms_socket, (control.pending() > 0 ? POLLIN | POLLOUT : POLLIN), false);
+}
+
+//Opens pooled data connections until pool_size of them are idle or connecting.
+//Each one presents the token from the relay's greeting so only this client's connections join its pool.
+void EZRelayClient::fillPool() {
+	while(rendezvous_port != 0 && idle_pool.size() + pool_connecting < pool_size) {
+		if(openDataConnection(EZRELAY_POOL_HELLO, client_token) == -1) {
+			return;
+		}
+	}
+}
+
+//The relay sends the activation byte on a pooled connection when it pairs it with a request.
+//From then on it is an ordinary data connection, and a replacement is opened.
+//Returns true if sockid now carries a request.
+bool EZRelayClient::takeActivation(int sockid) {
+	char activate = 0;
+	ssize_t len = recv(sockid, &activate, 1, 0);
+	if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return false;
+	}
+	idle_pool.erase(sockid);
+	if(len != 1 || activate != EZRELAY_POOL_ACTIVATE) {
+		addToCloseQueue(sockid);
+		return false;
+	}
+	EZLOG(Log::dbg, verbose) << "Pooled connection activated: " << sockid << '\n';
+	fillPool();
+	return true;
+}
+
+//Reads OPENs from the relay and starts a data connection for each token.
+//The relay packs every OPEN from one of its loop iterations into one message, their connects all run at once.
+void EZRelayClient::acceptOpens() {
+	bool open = control.fill(comms_socket);
+	EZControlChannel::message m;
+	while(control.nextMessage(m)) {
+		if(m.type != EZCTL_OPEN) {
+			EZLOG(Log::dbg, verbose) << "Ignoring control message: " << m.type << '\n';
+			continue;
+		}
+		for(size_t i = 0; i < EZControlChannel::openCount(m); i++) {
+			openDataConnection(EZRELAY_OPEN_HELLO, EZControlChannel::openToken(m, i));
+		}
+	}
+	if(!open) {
+		EZLOG(Log::err, verbose) << "ERROR ON MAIN RELAY SOCKET, EXIT!" << '\n';
+		exit(1);
+	}
+}
+
+void EZRelayClient::runStreamHandler(pollfd tmp_pfd) {
+	int from_fd = tmp_pfd.fd;
+	if(connecting.count(from_fd) > 0) {
+		std::vector<int> opened;
+		finishConnect(from_fd, opened);
+		for(size_t i = 0; i < opened.size(); i++) {
+			openDirectStream(opened[i]);
+		}
+	} else if(carriers.count(from_fd) > 0) {
+		if(tmp_pfd.revents & POLLOUT) {
+			flushCarrier(from_fd);
+		}
+		if(tmp_pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			readCarrier(from_fd);
+		}
+	} else if((tmp_pfd.revents & POLLIN) && idle_pool.count(from_fd) > 0) {
+		if(takeActivation(from_fd)) {
+			openDirectStream(from_fd);
+		}
+	} else if(from_fd == comms_socket && (tmp_pfd.revents & (POLLIN | POLLOUT))) {
+		if(tmp_pfd.revents & POLLOUT) {
+			flushControl();
+		}
+		if(tmp_pfd.revents & POLLIN) {
+			acceptOpens();
+		}
+	} else if(socket_streams.count(from_fd) > 0) {
+		EZStream &stream = socket_streams[from_fd];
+		if((tmp_pfd.revents & POLLOUT) && !stream.flush()) {
+			stream.remote_closed = true;
+		}
+		if(tmp_pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			stream.fill();
+		}
+		queueStream(-1, from_fd);
+	} else if(tmp_pfd.revents & POLLHUP || tmp_pfd.revents & POLLERR || tmp_pfd.revents & POLLNVAL) {
+		addToCloseQueue(tmp_pfd.fd);
+		idle_pool.erase(tmp_pfd.fd);
 		if(tmp_pfd.fd == comms_socket) {
-			Log(Log::err, verbose) << "ERROR ON MAIN RELAY SOCKET, EXIT!" << '\n';
+			EZLOG(Log::err, verbose) << "ERROR ON MAIN RELAY SOCKET, EXIT!" << '\n';
 			exit(1);
 		}
 	}
 }
 
-//Creates new socket based on address info from parameter socket to port provided
-//Returns socket
-int EZRelayClient::connectToAddress(const std::string &address, int port) { 
-	char ipstr[address.size()+1]; 
-	strcpy(ipstr, address.c_str());
+//Opens carrier connections until mux_count of them are up or connecting.
+//Each presents the client token after EZRELAY_MUX_HELLO, the relay then multiplexes new requests over them.
+void EZRelayClient::fillCarriers() {
+	while(rendezvous_port != 0 && carriers.size() + carriers_connecting < mux_count) {
+		if(openDataConnection(EZRELAY_MUX_HELLO, client_token) == -1) {
+			return;
+		}
+	}
+}
 
-	struct addrinfo hints, *res;
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET; // use IPv4 or IPv6, whichever
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE; // fill in my IP for me
-	getaddrinfo(ipstr, std::to_string(port).c_str(), &hints, &res);
-	int s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+void EZRelayClient::readCarrier(int carrier) {
+	client_carrier &cc = carriers[carrier];
+	bool open = cc.channel.fill(carrier);
+	EZMuxChannel::frame f;
+	while(cc.channel.nextFrame(f)) {
+		if(f.type == EZMUX_OPEN) {
+			EZStream &stream = cc.streams[f.stream];
+			stream.id = f.stream;
+			stream.carrier = carrier;
+			stream.channel = &cc.channel;
+			stream.send_window = EZMUX_WINDOW;
+			queueStream(carrier, f.stream);
+			continue;
+		}
+		std::unordered_map<uint32_t, EZStream>::iterator it = cc.streams.find(f.stream);
+		if(it == cc.streams.end()) {
+			//closed here already, the relay learns from our CLOSE
+			continue;
+		}
+		EZStream &stream = it->second;
+		switch(f.type) {
+			case EZMUX_DATA:
+				if(stream.readable() + f.length > EZMUX_WINDOW) {
+					EZLOG(Log::err, verbose) << "Stream " << f.stream << " overran its window" << '\n';
+					stream.close();
+					break;
+				}
+				stream.input.append(f.payload, f.length);
+				break;
+			case EZMUX_WINDOW_UPDATE:
+				stream.send_window += EZMuxChannel::windowCredit(f);
+				break;
+			case EZMUX_CLOSE:
+				stream.remote_closed = true;
+				break;
+			default:
+				break;
+		}
+		queueStream(carrier, f.stream);
+	}
+	if(!open) {
+		EZLOG(Log::dbg, verbose) << "Carrier closed: " << carrier << '\n';
+		dropCarrier(carrier);
+		return;
+	}
+	flushCarrier(carrier);
+}
+
+void EZRelayClient::flushCarrier(int carrier) {
+	client_carrier &cc = carriers[carrier];
+	if(!cc.channel.flush(carrier)) {
+		dropCarrier(carrier);
+		return;
+	}
+	poller.modify(carrier, (cc.channel.pending() > 0 ? POLLIN | POLLOUT : POLLIN), false);
+}
+
+//Closes a carrier, its streams go with it
+void EZRelayClient::dropCarrier(int carrier) {
+	client_carrier &cc = carriers[carrier];
+	for(std::unordered_map<uint32_t, EZStream>::iterator it = cc.streams.begin(); it != cc.streams.end(); ++it) {
+		endStream(it->second);
+	}
+	carriers.erase(carrier);
+	addToCloseQueue(carrier);
+}
+
+void EZRelayClient::endStream(EZStream &stream) {
+	if(stream_end) {
+		stream_end(stream);
+	}
+}
+
+//Wraps a data connection carrying one request in an EZStream
+void EZRelayClient::openDirectStream(int sockid) {
+	EZStream &stream = socket_streams[sockid];
+	stream.id = sockid;
+	stream.sockid = sockid;
+	poller.add(sockid, POLLIN, false);
+	stream.fill();
+	queueStream(-1, sockid);
+}
+
+EZStream *EZRelayClient::findStream(int carrier, uint32_t id) {
+	if(carrier == -1) {
+		std::unordered_map<int, EZStream>::iterator it = socket_streams.find((int)id);
+		return (it == socket_streams.end() ? NULL : &it->second);
+	}
+	std::unordered_map<int, client_carrier>::iterator cit = carriers.find(carrier);
+	if(cit == carriers.end()) {
+		return NULL;
+	}
+	std::unordered_map<uint32_t, EZStream>::iterator it = cit->second.streams.find(id);
+	return (it == cit->second.streams.end() ? NULL : &it->second);
+}
+
+void EZRelayClient::queueStream(int carrier, uint32_t id) {
+	EZStream *stream = findStream(carrier, id);
+	if(stream != NULL && !stream->ready) {
+		stream->ready = true;
+		ready_streams.push_back(std::make_pair(carrier, id));
+	}
+}
+
+//Settles a stream after its callback: grants the relay credit for what was read,
+//sends what was written and ends the stream once either side closed it.
+void EZRelayClient::finishStream(int carrier, uint32_t id) {
+	EZStream *stream = findStream(carrier, id);
+	if(stream == NULL) {
+		return;
+	}
+	bool done = stream->closed || (stream->remote_closed && stream->readable() == 0);
+	if(carrier != -1) {
+		EZMuxChannel &channel = carriers[carrier].channel;
+		if(stream->consumed > 0 && !done && (stream->consumed >= EZMUX_WINDOW / 4 || stream->readable() == 0)) {
+			channel.queueWindow(id, stream->consumed);
+			stream->consumed = 0;
+		}
+		if(done) {
+			if(!stream->remote_closed) {
+				channel.queueFrame(id, EZMUX_CLOSE, NULL, 0);
+			}
+			endStream(*stream);
+			carriers[carrier].streams.erase(id);
+		} else if(stream->readable() > 0 && !stream->input_held && stream->writable() > 0) {
+			queueStream(carrier, id);
+		}
+		flushCarrier(carrier);
+		return;
+	}
+	int sockid = stream->sockid;
+	//a callback that filled the buffer is called again once the socket took some of it,
+	//even if the socket took all of it and is never polled for POLLOUT
+	bool filled = (stream->writable() == 0);
+	if(!stream->flush()) {
+		done = true;
+	}
+	if(done && stream->output.empty()) {
+		endStream(*stream);
+		socket_streams.erase(sockid);
+		addToCloseQueue(sockid);
+		return;
+	}
+	short events = 0;
+	if(!stream->remote_closed && stream->readable() < EZMUX_WINDOW) {
+		events |= POLLIN;
+	}
+	if(!stream->output.empty()) {
+		events |= POLLOUT;
+	}
+	poller.modify(sockid, events, false);
+	if(((stream->readable() > 0 && !stream->input_held) || filled) && stream->writable() > 0) {
+		queueStream(-1, id);
+	}
+}
+
+void EZRelayClient::dispatchStreams(std::function<void(EZStream &)> callback) {
+	std::vector<std::pair<int, uint32_t> > dispatch;
+	dispatch.swap(ready_streams);
+	for(size_t i = 0; i < dispatch.size(); i++) {
+		EZStream *stream = findStream(dispatch[i].first, dispatch[i].second);
+		if(stream == NULL) {
+			continue;
+		}
+		stream->ready = false;
+		callback(*stream);
+		finishStream(dispatch[i].first, dispatch[i].second);
+	}
+}
+
+//Creates new socket connected to address at the port provided.
+//The address comes from the resolver's cache, so only the first connection to a host waits on a lookup.
+//Unless wait is set the socket is non-blocking and returned while its connect is still in progress.
+//Returns socket, -1 if a connect that does not wait failed at once
+int EZRelayClient::connectToAddress(const std::string &address, int port, bool wait) {
+	EZResolver::address resolved;
+	if(!resolver.resolve(address, port, resolved)) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelayClient::connectToAddress: Unable to resolve " + address + ".")
+		);
+	}
+	int s = socket(resolved.addr.ss_family, SOCK_STREAM, 0);
 	int enable = 1;
-	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-		throw "setsockopt(SO_REUSEADDR) failed in createListener";
+	if (s == -1 || setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelayClient::connectToAddress: Error produced in socket or setsockopt(SO_REUSEADDR), errno " + std::to_string(errno) + ".")
+		);
+	}
+	if(!wait) {
+		//data connections never block the loop, callbacks see EAGAIN instead
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+	}
+	if(connect(s, (struct sockaddr *)&resolved.addr, resolved.length) == -1 && !wait && errno != EINPROGRESS) {
+		int error = errno;
+		close(s);
+		errno = error;
+		return -1;
 	}
-	//fcntl(s, F_SETFL, O_NONBLOCK); //Stops blocking on connection
-	connect(s, res->ai_addr, res->ai_addrlen);
 	return s;
 }
 
@@ -135,27 +612,23 @@ int EZRelayClient::connectToAddress(const std::string &address, int port) {
 void EZRelayClient::closeConnection(int sockid) {
 	if(close_queue.count(sockid) > 0) {
 		if(!close_queue[sockid]){
-			Log(Log::dbg, verbose) << "Closing connection: " << std::to_string(sockid) << "\n";
+			EZLOG(Log::dbg, verbose) << "Closing connection: " << sockid << "\n";
+			poller.remove(sockid);
 			shutdown(sockid, SHUT_RDWR);
 			close(sockid);
 			close_queue[sockid] = true;
-			removePollSocket(sockid);
+			std::unordered_map<int, client_pipe>::iterator it = socket_pipes.find(sockid);
+			if(it != socket_pipes.end()) {
+				pipe_pool.release(it->second.fds);
+				socket_pipes.erase(it);
+			}
 		}
 	}
 }
 
-void EZRelayClient::doPoll(std::vector<pollfd> pollers, int timeout, std::function<void(pollfd)> callback){
-	int pollers_len = pollers.size();
-	pollfd *pollers_ptr;
-	pollers_ptr = &pollers[0];
-	if(pollers_len > 0) {
-
-		int poll_reads = poll(pollers_ptr, pollers_len, timeout);
-		if (poll_reads > 0){
-			for(int i = 0; i<pollers_len;i++){
-				callback(pollers[i]);
-			}
-		}
+void EZRelayClient::doPoll(int timeout, std::function<void(pollfd)> callback){
+	if(poller.size() > 0) {
+		poller.wait(timeout, callback);
 	}
 }
 
@@ -173,9 +646,9 @@ bool EZRelayClient::readLine(int sockid, std::string &line) {
 }
 
 void EZRelayClient::sendString(int sockid, std::string sendData) {
-	Log(Log::dbg, verbose) << "sending: " << sendData << '\n';
+	EZLOG(Log::dbg, verbose) << "sending: " << sendData << '\n';
 	send(sockid, sendData.data(), sendData.size(), 0);
-	Log(Log::dbg, verbose) << "sent: " << sendData << '\n';
+	EZLOG(Log::dbg, verbose) << "sent: " << sendData << '\n';
 }
 
 //Sets public hostname for connections.
@@ -184,6 +657,15 @@ void EZRelayClient::setRelayHostname(std::string hn) {
 	relay_hostname = hn;
 }
 
+//Seconds the relay hostname's address is used before it is looked up again in the background
+void EZRelayClient::setResolveTTL(int seconds) {
+	resolver.setTTL(seconds);
+}
+
+int EZRelayClient::getResolveTTL() {
+	return resolver.getTTL();
+}
+
 std::string EZRelayClient::getRelayHostname() {
 	return relay_hostname;
 }
@@ -198,8 +680,58 @@ int EZRelayClient::getRelayPort() {
 	return relay_port;
 }
 
+void EZRelayClient::setService(std::string name) {
+	service = name.substr(0, EZCTL_MAX_SERVICE);
+}
+
+std::string EZRelayClient::getService() {
+	return service;
+}
+
 void EZRelayClient::setVerboseOutput(bool verbose_enabled){
 	verbose = verbose_enabled;
+	poller.setVerboseOutput(verbose_enabled);
+	pipe_pool.setVerboseOutput(verbose_enabled);
+}
+
+void EZRelayClient::setPipeSize(int bytes) {
+	pipe_pool.setPipeSize(bytes);
+}
+
+int EZRelayClient::getPipeSize() {
+	return pipe_pool.getPipeSize();
+}
+
+void EZRelayClient::setPoolSize(int count) {
+	pool_size = (count > 0 ? std::min(count, EZRELAY_MAX_POOLED) : 0);
+}
+
+int EZRelayClient::getPoolSize() {
+	return (int)pool_size;
+}
+
+void EZRelayClient::setMultiplexed(int carrier_count) {
+	mux_count = (carrier_count > 0 ? std::min(carrier_count, EZRELAY_MAX_POOLED) : 0);
+}
+
+int EZRelayClient::getMultiplexed() {
+	return (int)mux_count;
+}
+
+void EZRelayClient::setWorkerThreads(int count) {
+	worker_count = (count > 0 ? std::min(count, MAX_WORKER_THREADS) : 0);
+}
+
+int EZRelayClient::getWorkerThreads() {
+	return (int)worker_count;
+}
+
+void EZRelayClient::setPollBackend(EZPoller::backend_type bt) {
+	poller.setBackend(bt);
+}
+
+EZPoller::backend_type EZRelayClient::getPollBackend() {
+	return poller.getBackend();
 }
 
 //Takes a function, runs it unless socket polled is the relay socket
@@ -211,16 +743,86 @@ bool EZRelayClient::run(int timeout, std::function<void(int, int *)> callback) {
 		runHandler(tmp_pfd, callback);
 	};
 	processCloseQueue();
-	doPoll(poll_sockets, timeout, cb);
+	//replaces pooled connections that were used or lost since the last call
+	fillPool();
+	doPoll(timeout, cb);
+	return true;
+}
+
+bool EZRelayClient::run(int timeout, std::function<void(EZStream &)> callback) {
+	if(!isConnected(comms_socket)){
+		return false;
+	}
+	auto cb = [&](pollfd tmp_pfd) {
+		runStreamHandler(tmp_pfd);
+	};
+	processCloseQueue();
+	fillPool();
+	fillCarriers();
+	//streams left with unread data are called again without waiting
+	doPoll((ready_streams.empty() ? timeout : 0), cb);
+	dispatchStreams(callback);
 	return true;
 }
 
+void EZRelayClient::setStreamEndCallback(std::function<void(EZStream &)> callback) {
+	stream_end = callback;
+}
+
+void EZRelayClient::wakeStream(EZStream &stream) {
+	queueStream(stream.carrier, stream.id);
+}
+
 //Opens a connection to a relay at a port num
 //Returns the socket connected to the relay for your client
 int EZRelayClient::requestRelay() {
-	comms_socket = connectToAddress(relay_hostname, relay_port);
-	addPollSocket(comms_socket);
+	comms_socket = connectToAddress(relay_hostname, relay_port, true);
+	fcntl(comms_socket, F_SETFL, fcntl(comms_socket, F_GETFL, 0) | O_NONBLOCK);
+	//the relay greets the client once it has said which control versions it speaks
+	control.queueHello(service);
+	EZControlChannel::message m;
+	while(true) {
+		bool open = control.flush(comms_socket) && control.fill(comms_socket);
+		if(control.nextMessage(m)) {
+			break;
+		}
+		if(!open) {
+			std::throw_with_nested(
+				std::runtime_error("EZRelayClient::requestRelay: Relay at " + relay_hostname + ":" + std::to_string(relay_port) + " closed the control connection before its greeting.")
+			);
+		}
+		struct pollfd pfd;
+		pfd.fd = comms_socket;
+		pfd.events = (control.pending() > 0 ? POLLIN | POLLOUT : POLLIN);
+		pfd.revents = 0;
+		poll(&pfd, 1, -1);
+	}
+	uint8_t lowest = 0, highest = 0;
+	if(m.type == EZCTL_REJECT && EZControlChannel::parseVersions(m, lowest, highest)) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelayClient::requestRelay: Relay speaks control versions " + std::to_string(lowest) + "-" + std::to_string(highest) + ", this client " + std::to_string(EZCTL_MIN_VERSION) + "-" + std::to_string(EZCTL_VERSION) + ".")
+		);
+	}
+	EZControlChannel::welcome w;
+	if(m.type != EZCTL_WELCOME || !EZControlChannel::parseWelcome(m, w)) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelayClient::requestRelay: Relay did not answer HELLO with a greeting.")
+		);
+	}
+	control_version = w.version;
+	relay_address = w.hostname + ":" + std::to_string(w.port);
+	rendezvous_port = w.rendezvous_port;
+	client_token = w.token;
+	EZLOG(Log::dbg, verbose) << "Relay greeted with control version " << control_version << '\n';
+	poller.add(comms_socket, POLLIN, false);
+	startWorkers();
+	fillPool();
+	fillCarriers();
 	return comms_socket;
 }
 
+std::string EZRelayClient::getRelayAddress() {
+	return relay_address;
+}
+
 //TODO: closeRelay()
\ No newline at end of file
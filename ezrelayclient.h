@@ -3,6 +3,10 @@
 #include <cstring>
 #include <unordered_map>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <algorithm>
 #include <errno.h>
 #include <exception>
@@ -10,6 +14,7 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -17,6 +22,16 @@
 #include <iostream>
 #include <functional>
 #include <sstream>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include "ezpoller.h"
+#include "ezpipepool.h"
+#include "ezprotocol.h"
+#include "ezmux.h"
+#include "ezcontrol.h"
+#include "ezstream.h"
+#include "ezresolver.h"
 #ifndef _EZRELAYCLIENT_H
 #define _EZRELAYCLIENT_H
 
@@ -26,51 +41,170 @@ class EZRelayClient {
 private:
 	std::string relay_hostname;
 	int relay_port, comms_socket;
+	EZResolver resolver; //caches relay_hostname, looked up once and refreshed in the background
+	EZControlChannel control; //buffers the control socket, messages may arrive split or several to a read
+	int control_version; //agreed with the relay in requestRelay()
+	std::string service; //named in the HELLO, "" for a public port of its own
 	bool verbose;
-	int ezpipe[2]; //used for splice() to pipe, created on instantiation.
-
-	std::vector<pollfd> poll_sockets;
+	EZPipePool pipe_pool; //pipes handed to callbacks, one leased per data connection
+	struct client_pipe {
+		int fds[2] = {-1, -1};
+	};
+	std::unordered_map<int, client_pipe> socket_pipes; //maps data connections to their leased pipe
+
+	std::string relay_address; //public address handed out by the relay
+	std::string client_token; //presented by each pooled data connection and carrier
+	int rendezvous_port; //relay port every data connection connects to
+	size_t pool_size; //idle data connections kept open to the relay
+	std::unordered_map<int, bool> idle_pool; //pooled data connections not yet carrying a request
+	struct pending_connect {
+		char kind; //hello sent once connected, see ezprotocol.h
+		std::string token;
+	};
+	std::unordered_map<int, pending_connect> connecting; //data connections polled for POLLOUT until their connect finishes
+	size_t pool_connecting, carriers_connecting; //pooled connections and carriers among them
+
+	size_t mux_count; //carriers kept open for multiplexed streams, 0 when multiplexing is off
+	struct client_carrier {
+		EZMuxChannel channel;
+		std::unordered_map<uint32_t, EZStream> streams; //keyed by stream id
+	};
+	std::unordered_map<int, client_carrier> carriers; //keyed by carrier socket
+	std::unordered_map<int, EZStream> socket_streams; //direct streams, keyed by data connection
+	std::vector<std::pair<int, uint32_t> > ready_streams; //carrier (-1 for direct) and stream id waiting for the callback
+	std::function<void(EZStream &)> stream_end; //told about each stream before it is erased
+
+	//with workers, the thread calling run() only does I/O and hands ready data connections to them
+	//a connection is out of the poll set while a worker has it, so no two workers ever share one
+	size_t worker_count; //threads running request callbacks, 0 runs them on the thread calling run()
+	std::vector<std::thread> workers;
+	struct worker_job {
+		int sockid;
+		int fds[2]; //the connection's leased pipe
+		std::function<void(int, int *)> callback;
+	};
+	std::mutex worker_lock; //guards worker_jobs, worker_done and workers_stopping
+	std::condition_variable worker_ready;
+	std::deque<worker_job> worker_jobs;
+	std::vector<int> worker_done; //connections whose callback returned, polled again by collectWorkers()
+	bool workers_stopping;
+	int worker_wake; //eventfd workers signal worker_done on, polled with the data connections
+
+	EZPoller poller; //level triggered, callbacks may leave data unread
 	std::unordered_map<int, bool> close_queue; //items to be closed along with bool indicating if it has been close already
 
 	int getPortFromSocket(int sockid);
 	std::string getAddressFromSocket(int sockid);
 	bool isConnected(int sockid);
 
-	void addPollSocket(int sockid);
-	void removePollSocket(int sockid);
-
 	void addToCloseQueue(int sockid);
 	void processCloseQueue();
 
 	void runHandler(pollfd tmp_pfd, std::function<void(int, int *)> callback);
-
-	int connectToAddress(const std::string &address, int sockid);
+	void updateInterest(int sockid);
+	void handleRequest(int sockid, std::function<void(int, int *)> &callback);
+	void startWorkers();
+	void stopWorkers();
+	void workerLoop();
+	void collectWorkers();
+	int openDataConnection(char kind, const std::string &token);
+	void finishConnect(int sockid, std::vector<int> &opened);
+	void countConnecting(char kind, int change);
+	void reportFailedOpen(const std::string &token);
+	void flushControl();
+	void fillPool();
+	bool takeActivation(int sockid);
+	void acceptOpens();
+
+	void runStreamHandler(pollfd tmp_pfd);
+	void fillCarriers();
+	void readCarrier(int carrier);
+	void flushCarrier(int carrier);
+	void dropCarrier(int carrier);
+	void endStream(EZStream &stream);
+	void openDirectStream(int sockid);
+	EZStream *findStream(int carrier, uint32_t id);
+	void queueStream(int carrier, uint32_t id);
+	void finishStream(int carrier, uint32_t id);
+	void dispatchStreams(std::function<void(EZStream &)> callback);
+
+	int connectToAddress(const std::string &address, int port, bool wait);
 	void closeConnection(int sockid);
 
-	void doPoll(std::vector<pollfd> pollers, int timeout, std::function<void(pollfd)> callback);
+	void doPoll(int timeout, std::function<void(pollfd)> callback);
 
 public:
 	//constructor
 	EZRelayClient();
+	~EZRelayClient();
 
 	//relay's hostname to connect through
 	void setRelayHostname(std::string hn);
 	std::string getRelayHostname();
 
+	//seconds a lookup of the relay hostname is used before it is refreshed in the background
+	void setResolveTTL(int seconds);
+	int getResolveTTL();
+
 	//port to connect to relay over
 	void setRelayPort(int portnum);
 	int getRelayPort();
 
+	//serves the named service with every other client naming it, they share one public port on the relay
+	//and each new request goes to one of them, must be called before requestRelay() -- default is "", a port of its own
+	//relays before control version 4 give the client a port of its own regardless
+	void setService(std::string name);
+	std::string getService();
+
 	//sets printing of debug info
 	void setVerboseOutput(bool verbose_enabled);
 
+	//capacity in bytes of the pipe given to each callback (F_SETPIPE_SZ), 0 for the kernel default
+	void setPipeSize(int bytes);
+	int getPipeSize();
+
+	//idle data connections kept open to the relay so new requests are paired without a round trip
+	//0 falls back to opening a connection per request when the relay asks for one
+	void setPoolSize(int count);
+	int getPoolSize();
+
+	//carrier connections many requests are multiplexed over, must be called before requestRelay()
+	//0 turns multiplexing off, requests then each get a data connection
+	//multiplexed requests are only delivered by the EZStream overload of run()
+	void setMultiplexed(int carrier_count);
+	int getMultiplexed();
+
+	//threads the callback of the pipe overload of run() is called on, must be called before requestRelay()
+	//0 calls it on the thread calling run(), which otherwise only does I/O for the control and data connections
+	//callbacks for different connections then run concurrently, one connection's callback never does
+	void setWorkerThreads(int count);
+	int getWorkerThreads();
+
+	//selects epoll or poll() for the event loop, must be called before requestRelay()
+	void setPollBackend(EZPoller::backend_type bt);
+	EZPoller::backend_type getPollBackend();
+
 	//each call to run() will go through the process of checking for messages
 	//should be executed in a loop to poll for messages
 	//each message found calls callback that takes the socket file descriptor and handles the request
+	//the pipe passed to callback belongs to that connection alone, data left in it is still there on the next call
+	//data sockets are non-blocking, while the pipe holds data callback is called when the socket is writable instead of readable
 	bool run(int timeout, std::function<void(int, int *)> callback);
+	//same, but every request is handed to callback as an EZStream, whether multiplexed or on its own connection
+	//callback runs when the stream opens, when data arrives, when it becomes writable and when the peer closes it
+	//it runs again on the next call while data it could have taken is left unread
+	bool run(int timeout, std::function<void(EZStream &)> callback);
+	//called once for every stream as it goes away, whether it ended or its connection was lost
+	//the stream and its context must not be used after it returns
+	void setStreamEndCallback(std::function<void(EZStream &)> callback);
+	//runs the stream callback for stream on the next call to run(), without waiting for I/O
+	void wakeStream(EZStream &stream);
 
 	//requests a relay at the set hostname and port
+	//waits for the relay's greeting and opens the data connection pool
 	int requestRelay();
+	//address external requests connect to, available once requestRelay() returns
+	std::string getRelayAddress();
 
 //HELPERS
 	//readLine() takes a socket and reads buffer until it finds a newline
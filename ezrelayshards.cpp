@@ -0,0 +1,245 @@
+#include "ezrelayshards.h"
+
+EZRelayShards::EZRelayShards() {
+	running = false;
+	handoff_open = false;
+	handoff_listener = -1;
+	shards.push_back(std::unique_ptr<EZRelay>(new EZRelay()));
+}
+
+EZRelayShards::~EZRelayShards() {
+	stop();
+	for(size_t i = 0; i < threads.size(); i++) {
+		if(threads[i].joinable()) {
+			threads[i].join();
+		}
+	}
+	if(handoff_thread.joinable()) {
+		handoff_thread.join();
+	}
+	if(handoff_listener != -1) {
+		close(handoff_listener);
+	}
+}
+
+void EZRelayShards::setThreads(int count) {
+	if(running) {
+		std::throw_with_nested(
+			std::runtime_error("EZRelayShards::setThreads: Unable to change to " + std::to_string(count) + " threads while running.")
+		);
+	}
+	if(count < 1) {
+		count = 1;
+	}
+	shards.clear();
+	std::shared_ptr<EZServicePorts> service_ports = std::make_shared<EZServicePorts>();
+	for(int i = 0; i < count; i++) {
+		shards.push_back(std::unique_ptr<EZRelay>(new EZRelay()));
+		//a single shard keeps the comms port exclusive
+		shards.back()->setReusePort(count > 1);
+		//each shard serves a service its clients name on the same port
+		shards.back()->setServicePorts(service_ports);
+	}
+}
+
+int EZRelayShards::getThreads() {
+	return (int)shards.size();
+}
+
+void EZRelayShards::configure(std::function<void(EZRelay &)> setup) {
+	for(size_t i = 0; i < shards.size(); i++) {
+		setup(*shards[i]);
+	}
+}
+
+EZRelay &EZRelayShards::shard(int index) {
+	return *shards.at(index);
+}
+
+void EZRelayShards::setRendezvousPort(int portnum) {
+	for(size_t i = 0; i < shards.size(); i++) {
+		shards[i]->setRendezvousPort(portnum > 0 ? portnum + (int)i : 0);
+	}
+}
+
+void EZRelayShards::setStatsPort(int portnum) {
+	for(size_t i = 0; i < shards.size(); i++) {
+		shards[i]->setStatsPort(portnum > 0 ? portnum + (int)i : 0);
+	}
+}
+
+void EZRelayShards::setStatsSocket(std::string path) {
+	for(size_t i = 0; i < shards.size(); i++) {
+		shards[i]->setStatsSocket(path == "" || i == 0 ? path : path + "." + std::to_string(i));
+	}
+}
+
+bool EZRelayShards::setTraceFile(std::string path) {
+	for(size_t i = 0; i < shards.size(); i++) {
+		if(!shards[i]->setTraceFile(path == "" || i == 0 ? path : path + "." + std::to_string(i))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void EZRelayShards::setHandOffSocket(std::string path) {
+	handoff_path = path;
+}
+
+std::string EZRelayShards::getHandOffSocket() {
+	return handoff_path;
+}
+
+void EZRelayShards::listen() {
+	if(handoff_path != "") {
+		takeOver();
+	}
+	for(size_t i = 0; i < shards.size(); i++) {
+		try {
+			shards[i]->listen();
+		} catch(...) {
+			std::throw_with_nested(
+				std::runtime_error("EZRelayShards::listen: Unable to listen on shard #" + std::to_string(i) + ".")
+			);
+		}
+	}
+	if(handoff_path != "" && handoff_listener == -1) {
+		handoff_listener = ezHandOffListen(handoff_path);
+		if(handoff_listener == -1) {
+			throw std::runtime_error("EZRelayShards::listen: Unable to listen for hand-offs on " + handoff_path + ", errno " + std::to_string(errno) + ".");
+		}
+		//a hand-off that comes before run() waits for the shards to start answering
+		handoff_open = true;
+		handoff_thread = std::thread(&EZRelayShards::handOffLoop, this);
+	}
+}
+
+//Takes every shard over from the relay listening at handoff_path, false if there is none.
+//The two relays first swap HELLOs, then each shard of the old one sends its records in turn.
+bool EZRelayShards::takeOver() {
+	int sockid = ezHandOffConnect(handoff_path);
+	if(sockid == -1) {
+		return false;
+	}
+	EZHandOffRecord hello(EZHANDOFF_HELLO);
+	hello.putInt(EZHANDOFF_VERSION, 1);
+	hello.putInt(shards.size(), 4);
+	uint64_t version = 0, count = 0;
+	if(!hello.send(sockid) || !hello.receive(sockid) || hello.type != EZHANDOFF_HELLO
+		|| !hello.getInt(version, 1) || !hello.getInt(count, 4) || version != EZHANDOFF_VERSION || count != shards.size()) {
+		close(sockid);
+		throw std::runtime_error("EZRelayShards::takeOver: The relay at " + handoff_path + " runs " + std::to_string(count) + " shards with hand-off version "
+			+ std::to_string(version) + ", this one " + std::to_string(shards.size()) + " with version " + std::to_string(EZHANDOFF_VERSION) + ".");
+	}
+	for(size_t i = 0; i < shards.size(); i++) {
+		try {
+			shards[i]->takeOver(sockid);
+		} catch(...) {
+			close(sockid);
+			std::throw_with_nested(
+				std::runtime_error("EZRelayShards::takeOver: Unable to take over shard #" + std::to_string(i) + ".")
+			);
+		}
+	}
+	close(sockid);
+	return true;
+}
+
+//Serves hand-off requests until one succeeds or stop() shuts the listener down.
+//Each shard hands off from its own loop, one after the other on the same socket.
+void EZRelayShards::handOffLoop() {
+	while(true) {
+		int sockid = accept4(handoff_listener, NULL, NULL, SOCK_CLOEXEC);
+		if(sockid == -1) {
+			if(errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			return;
+		}
+		EZHandOffRecord hello;
+		uint64_t version = 0, count = 0;
+		bool agreed = hello.receive(sockid) && hello.type == EZHANDOFF_HELLO && hello.getInt(version, 1) && hello.getInt(count, 4)
+			&& version == EZHANDOFF_VERSION && count == shards.size();
+		hello.closeFds();
+		EZHandOffRecord answer(EZHANDOFF_HELLO);
+		answer.putInt(EZHANDOFF_VERSION, 1);
+		answer.putInt(shards.size(), 4);
+		if(!answer.send(sockid) || !agreed) {
+			close(sockid);
+			continue;
+		}
+		bool handed = true;
+		for(size_t i = 0; i < shards.size() && handed; i++) {
+			std::future<std::string> done = shards[i]->postHandOff(sockid);
+			//a shard that stopped running never answers
+			while(handoff_open && done.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+				continue;
+			}
+			try {
+				handed = (done.wait_for(std::chrono::seconds(0)) == std::future_status::ready && done.get() != "");
+			} catch(...) {
+				handed = false;
+			}
+		}
+		close(sockid);
+		if(handed) {
+			return;
+		}
+	}
+}
+
+void EZRelayShards::runShard(size_t index, int timeout) {
+	try {
+		while(running && !shards[index]->isDrained()) {
+			shards[index]->run(timeout);
+		}
+	} catch(...) {
+		errors[index] = std::current_exception();
+		running = false;
+	}
+	handoff_open = false;
+}
+
+void EZRelayShards::run(int timeout) {
+	running = true;
+	errors.assign(shards.size(), std::exception_ptr());
+	for(size_t i = 1; i < shards.size(); i++) {
+		threads.push_back(std::thread(&EZRelayShards::runShard, this, i, timeout));
+	}
+	runShard(0, timeout);
+	for(size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+	threads.clear();
+	for(size_t i = 0; i < errors.size(); i++) {
+		if(errors[i]) {
+			try {
+				std::rethrow_exception(errors[i]);
+			} catch(...) {
+				std::throw_with_nested(
+					std::runtime_error("EZRelayShards::run: Shard #" + std::to_string(i) + " stopped.")
+				);
+			}
+		}
+	}
+}
+
+void EZRelayShards::drain() {
+	for(size_t i = 0; i < shards.size(); i++) {
+		shards[i]->postDrain();
+	}
+}
+
+//Safe from any thread, every shard is woken so run() returns without waiting out its timeout
+void EZRelayShards::stop() {
+	running = false;
+	handoff_open = false;
+	if(handoff_listener != -1) {
+		//wakes the hand-off thread out of accept()
+		shutdown(handoff_listener, SHUT_RDWR);
+	}
+	for(size_t i = 0; i < shards.size(); i++) {
+		shards[i]->postWake();
+	}
+}
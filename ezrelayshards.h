@@ -0,0 +1,77 @@
+// ezrelayshards.h
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include "ezrelay.h"
+#ifndef _EZRELAYSHARDS_H
+#define _EZRELAYSHARDS_H
+
+//Runs one EZRelay event loop per thread.
+//Every shard listens on the comms port with SO_REUSEPORT so the kernel spreads new clients across them.
+//A client's listener, requests and data sockets are all opened by the shard that accepted it,
+//so nothing is shared between threads and the data path takes no locks.
+//Clients of one service may register with different shards, each then serves it on the same port, see EZServicePorts.
+class EZRelayShards {
+
+private:
+	std::vector<std::unique_ptr<EZRelay> > shards;
+	std::vector<std::thread> threads;
+	std::vector<std::exception_ptr> errors; //first exception thrown by each shard's loop
+	std::atomic<bool> running;
+	std::string handoff_path;
+	int handoff_listener; //-1 until listen(), shut down by stop()
+	std::atomic<bool> handoff_open; //set by listen(), from then on every shard answers hand-offs until stop() or its loop ends
+	std::thread handoff_thread;
+
+	void runShard(size_t index, int timeout);
+	bool takeOver();
+	void handOffLoop();
+
+public:
+	//constructor, starts with a single shard
+	EZRelayShards();
+	~EZRelayShards();
+
+	//number of event loops, must be called before configure() and listen()
+	void setThreads(int count);
+	int getThreads();
+
+	//applies the same settings to every shard, e.g. setCommsPort() or setPollBackend()
+	void configure(std::function<void(EZRelay &)> setup);
+	EZRelay &shard(int index);
+
+	//rendezvous port of shard i is portnum + i, a client's data connections must reach the shard it registered with
+	//0 lets the kernel pick one per shard
+	void setRendezvousPort(int portnum);
+	//stats endpoint of shard i is on 127.0.0.1 at portnum + i, 0 turns it off
+	void setStatsPort(int portnum);
+	//stats endpoint of shard 0 is the Unix socket at path, shard i > 0 uses path.i, "" turns it off
+	void setStatsSocket(std::string path);
+	//trace file of shard 0 is path, shard i > 0 writes path.i, returns false if one could not be opened
+	bool setTraceFile(std::string path);
+	//Unix socket a relay started later with the same path takes every shard's sockets over through, "" turns it off
+	//listen() first takes over from a relay already serving there, which then drains, see EZRelay::postHandOff()
+	//both must run the same number of shards
+	void setHandOffSocket(std::string path);
+	std::string getHandOffSocket();
+
+	//listens for new clients on every shard, or takes over from the relay at the hand-off socket
+	void listen();
+
+	//runs every shard until stop() is called, every shard drained or one of them throws, which is rethrown here
+	//shard 0 runs on the calling thread
+	void run(int timeout);
+	//both are safe from any thread, including a signal handler
+	void stop();
+	//drains every shard, see EZRelay::postDrain(), run() returns once all of them are
+	void drain();
+};
+
+#endif // EZRELAYSHARDS.h
@@ -0,0 +1,81 @@
+#include "ezresolver.h"
+#include <netinet/in.h>
+
+EZResolver::EZResolver() {
+	state = std::make_shared<cache>();
+	state->ttl_micros = (uint64_t)EZRESOLVER_DEFAULT_TTL * 1000000;
+}
+
+void EZResolver::setTTL(int seconds) {
+	std::lock_guard<std::mutex> guard(state->lock);
+	state->ttl_micros = (uint64_t)(seconds > 0 ? seconds : 0) * 1000000;
+}
+
+int EZResolver::getTTL() {
+	std::lock_guard<std::mutex> guard(state->lock);
+	return (int)(state->ttl_micros / 1000000);
+}
+
+uint64_t EZResolver::nowMicros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//The port is filled in per connection, so one lookup serves every port of a host
+bool EZResolver::lookup(const std::string &host, address &out) {
+	struct addrinfo hints, *res = NULL;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host.c_str(), NULL, &hints, &res) != 0 || res == NULL) {
+		return false;
+	}
+	memset(&out.addr, 0, sizeof(out.addr));
+	memcpy(&out.addr, res->ai_addr, res->ai_addrlen);
+	out.length = res->ai_addrlen;
+	freeaddrinfo(res);
+	return true;
+}
+
+void EZResolver::refresh(std::shared_ptr<cache> c, std::string host) {
+	address fresh;
+	bool found = lookup(host, fresh);
+	std::lock_guard<std::mutex> guard(c->lock);
+	entry &e = c->entries[host];
+	e.refreshing = false;
+	//a failed refresh keeps the last good address, the next use tries again
+	if(found) {
+		e.resolved = fresh;
+		e.valid = true;
+		e.expires = nowMicros() + c->ttl_micros;
+	}
+}
+
+bool EZResolver::resolve(const std::string &host, int port, address &out) {
+	bool found = false;
+	{
+		std::lock_guard<std::mutex> guard(state->lock);
+		std::unordered_map<std::string, entry>::iterator it = state->entries.find(host);
+		if(it != state->entries.end() && it->second.valid) {
+			out = it->second.resolved;
+			found = true;
+			if(nowMicros() >= it->second.expires && !it->second.refreshing) {
+				it->second.refreshing = true;
+				std::thread(refresh, state, host).detach();
+			}
+		}
+	}
+	if(!found) {
+		//first use of host, nothing to fall back on
+		if(!lookup(host, out)) {
+			return false;
+		}
+		std::lock_guard<std::mutex> guard(state->lock);
+		entry &e = state->entries[host];
+		e.resolved = out;
+		e.valid = true;
+		e.refreshing = false;
+		e.expires = nowMicros() + state->ttl_micros;
+	}
+	((struct sockaddr_in *)&out.addr)->sin_port = htons(port);
+	return true;
+}
@@ -0,0 +1,61 @@
+// ezresolver.h
+#include <string>
+#include <cstring>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#ifndef _EZRESOLVER_H
+#define _EZRESOLVER_H
+
+#define EZRESOLVER_DEFAULT_TTL 60 //seconds an address is used before it is looked up again
+
+//Caches hostname lookups so connecting never waits on the resolver once a host has been seen.
+//getaddrinfo() does not report record TTLs, so entries live for a fixed time to live instead.
+//An expired entry is still handed out while a background thread looks the host up again.
+class EZResolver {
+
+public:
+	struct address {
+		struct sockaddr_storage addr;
+		socklen_t length;
+	};
+
+private:
+	struct entry {
+		address resolved;
+		bool valid;
+		bool refreshing; //a lookup thread is running for this host
+		uint64_t expires; //steady clock microseconds
+	};
+	//shared with lookup threads, which may outlive the resolver
+	struct cache {
+		std::mutex lock;
+		std::unordered_map<std::string, entry> entries;
+		uint64_t ttl_micros;
+	};
+	std::shared_ptr<cache> state;
+
+	static uint64_t nowMicros();
+	static bool lookup(const std::string &host, address &out);
+	static void refresh(std::shared_ptr<cache> c, std::string host);
+
+public:
+	//constructor
+	EZResolver();
+
+	//how long a lookup is used before it is refreshed, 0 looks the host up in the background on every use
+	void setTTL(int seconds);
+	int getTTL();
+
+	//fills out with host's address and port, blocking only the first time host is seen
+	//returns false if host has never resolved
+	bool resolve(const std::string &host, int port, address &out);
+};
+
+#endif // EZRESOLVER.h
@@ -0,0 +1,46 @@
+#include "ezservice.h"
+
+void EZServicePorts::setPort(const std::string &name, int portnum) {
+	std::lock_guard<std::mutex> guard(lock);
+	service_port &sp = ports[name];
+	sp.fixed = portnum;
+	if(sp.listeners == 0) {
+		sp.port = portnum;
+	}
+	if(sp.fixed == 0 && sp.listeners == 0) {
+		ports.erase(name);
+	}
+}
+
+int EZServicePorts::getPort(const std::string &name) {
+	std::lock_guard<std::mutex> guard(lock);
+	std::unordered_map<std::string, service_port>::iterator it = ports.find(name);
+	return (it == ports.end() ? 0 : it->second.port);
+}
+
+//Held across open, so two relays opening a service at once agree on its port
+int EZServicePorts::acquire(const std::string &name, const std::function<int(int)> &open) {
+	std::lock_guard<std::mutex> guard(lock);
+	service_port &sp = ports[name];
+	int bound = open(sp.port);
+	if(bound != 0) {
+		sp.port = bound;
+		sp.listeners++;
+	} else if(sp.listeners == 0 && sp.fixed == 0) {
+		ports.erase(name);
+	}
+	return bound;
+}
+
+void EZServicePorts::release(const std::string &name) {
+	std::lock_guard<std::mutex> guard(lock);
+	std::unordered_map<std::string, service_port>::iterator it = ports.find(name);
+	if(it == ports.end() || it->second.listeners == 0) {
+		return;
+	}
+	if(--it->second.listeners == 0 && it->second.fixed == 0) {
+		ports.erase(it);
+	} else if(it->second.listeners == 0) {
+		it->second.port = it->second.fixed;
+	}
+}
@@ -0,0 +1,36 @@
+// ezservice.h
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <functional>
+#ifndef _EZSERVICE_H
+#define _EZSERVICE_H
+
+//Ports of the named services every relay in a process serves, see EZRelay::setServicePorts().
+//Each relay opens its own listener for a service with SO_REUSEPORT on the port the first one bound,
+//so with EZRelayShards the kernel spreads a service's requests over the shards its members registered with.
+//Only opening and closing a service's listener takes the lock, the data path never does.
+class EZServicePorts {
+
+private:
+	struct service_port {
+		int port; //0 until a listener is bound
+		int fixed; //port set with setPort(), 0 for one picked by the kernel
+		int listeners; //open listeners on port, it is forgotten with the last unless fixed
+	};
+	std::mutex lock;
+	std::unordered_map<std::string, service_port> ports;
+
+public:
+	//binds the service to portnum from now on, 0 lets the kernel pick one each time it is first opened
+	void setPort(const std::string &name, int portnum);
+	int getPort(const std::string &name);
+
+	//opens a listener for the service: open is called with the port to bind, 0 for any,
+	//and returns the port it bound or 0 if it failed; returns the same
+	int acquire(const std::string &name, const std::function<int(int)> &open);
+	//a listener acquire() opened was closed
+	void release(const std::string &name);
+};
+
+#endif // EZSERVICE.h
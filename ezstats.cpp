@@ -0,0 +1,119 @@
+#include "ezstats.h"
+#include <cstring>
+#include <cstdio>
+
+void EZLatencyHistogram::record(uint64_t micros) {
+	int bucket = (micros <= 1 ? 0 : 64 - __builtin_clzll(micros - 1));
+	if(bucket < EZSTATS_LATENCY_BUCKETS) {
+		buckets[bucket]++;
+	}
+	count++;
+	sum_micros += micros;
+}
+
+void EZClientStats::reset() {
+	memset(this, 0, sizeof(*this));
+}
+
+uint64_t ezMonotonicMicros() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void appendStatsFamily(std::string &out, const char *name, const char *type, const char *help) {
+	out += "# HELP ";
+	out += name;
+	out += ' ';
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += ' ';
+	out += type;
+	out += '\n';
+}
+
+static void appendSample(std::string &out, const char *name, int port, const char *extra, uint64_t value) {
+	out += name;
+	out += "{port=\"" + std::to_string(port) + "\"";
+	if(extra != NULL) {
+		out += ',';
+		out += extra;
+	}
+	out += "} " + std::to_string(value) + '\n';
+}
+
+static void appendSeconds(std::string &out, uint64_t micros) {
+	char seconds[32];
+	snprintf(seconds, sizeof(seconds), "%.6f", micros / 1000000.0);
+	out += seconds;
+}
+
+void appendStatsHistogram(std::string &out, const char *name, const std::string &labels, const EZLatencyHistogram &h) {
+	std::string prefix = std::string(name) + "_bucket{" + labels + ",le=\"";
+	uint64_t cumulative = 0;
+	for(int bucket = 0; bucket < EZSTATS_LATENCY_BUCKETS; bucket++) {
+		cumulative += h.buckets[bucket];
+		out += prefix;
+		appendSeconds(out, (uint64_t)1 << bucket);
+		out += "\"} " + std::to_string(cumulative) + '\n';
+	}
+	out += prefix + "+Inf\"} " + std::to_string(h.count) + '\n';
+	out += std::string(name) + "_sum{" + labels + "} ";
+	appendSeconds(out, h.sum_micros);
+	out += '\n';
+	out += std::string(name) + "_count{" + labels + "} " + std::to_string(h.count) + '\n';
+}
+
+std::string formatStats(const std::vector<std::pair<int, const EZClientStats *> > &clients) {
+	std::string out;
+	appendStatsFamily(out, "ezrelay_clients", "gauge", "Clients registered with this relay.");
+	out += "ezrelay_clients " + std::to_string(clients.size()) + '\n';
+
+	appendStatsFamily(out, "ezrelay_bytes_total", "counter", "Bytes forwarded, in is from external requests to the client.");
+	for(size_t i = 0; i < clients.size(); i++) {
+		appendSample(out, "ezrelay_bytes_total", clients[i].first, "direction=\"in\"", clients[i].second->bytes_in);
+		appendSample(out, "ezrelay_bytes_total", clients[i].first, "direction=\"out\"", clients[i].second->bytes_out);
+	}
+
+	appendStatsFamily(out, "ezrelay_requests_total", "counter", "External requests by outcome of their setup.");
+	for(size_t i = 0; i < clients.size(); i++) {
+		appendSample(out, "ezrelay_requests_total", clients[i].first, "result=\"accepted\"", clients[i].second->accepted);
+		appendSample(out, "ezrelay_requests_total", clients[i].first, "result=\"rejected\"", clients[i].second->rejected);
+	}
+
+	appendStatsFamily(out, "ezrelay_requests_open", "gauge", "Requests accepted and not yet closed.");
+	for(size_t i = 0; i < clients.size(); i++) {
+		appendSample(out, "ezrelay_requests_open", clients[i].first, NULL, clients[i].second->open);
+	}
+
+	appendStatsFamily(out, "ezrelay_requests_pending", "gauge", "Requests waiting for the client to connect back for them.");
+	for(size_t i = 0; i < clients.size(); i++) {
+		appendSample(out, "ezrelay_requests_pending", clients[i].first, NULL, clients[i].second->pending);
+	}
+
+	appendStatsFamily(out, "ezrelay_closes_total", "counter", "Finished requests by the side that ended them.");
+	for(size_t i = 0; i < clients.size(); i++) {
+		appendSample(out, "ezrelay_closes_total", clients[i].first, "reason=\"external\"", clients[i].second->closed_external);
+		appendSample(out, "ezrelay_closes_total", clients[i].first, "reason=\"client\"", clients[i].second->closed_client);
+	}
+
+	appendStatsFamily(out, "ezrelay_timeouts_total", "counter", "Requests the relay closed because a deadline passed.");
+	for(size_t i = 0; i < clients.size(); i++) {
+		appendSample(out, "ezrelay_timeouts_total", clients[i].first, "deadline=\"setup\"", clients[i].second->timeouts_setup);
+		appendSample(out, "ezrelay_timeouts_total", clients[i].first, "deadline=\"idle\"", clients[i].second->timeouts_idle);
+		appendSample(out, "ezrelay_timeouts_total", clients[i].first, "deadline=\"drain\"", clients[i].second->timeouts_drain);
+	}
+
+	appendStatsFamily(out, "ezrelay_throttled_total", "counter", "Times the client's requests waited for one of its rate limits.");
+	for(size_t i = 0; i < clients.size(); i++) {
+		appendSample(out, "ezrelay_throttled_total", clients[i].first, "limit=\"bytes\"", clients[i].second->throttled_bytes);
+		appendSample(out, "ezrelay_throttled_total", clients[i].first, "limit=\"requests\"", clients[i].second->throttled_requests);
+	}
+
+	appendStatsFamily(out, "ezrelay_setup_seconds", "histogram", "Time from accepting a request to handing it to the client.");
+	for(size_t i = 0; i < clients.size(); i++) {
+		appendStatsHistogram(out, "ezrelay_setup_seconds", "port=\"" + std::to_string(clients[i].first) + "\"", clients[i].second->setup);
+	}
+	return out;
+}
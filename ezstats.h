@@ -0,0 +1,52 @@
+// ezstats.h
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include <time.h>
+#ifndef _EZSTATS_H
+#define _EZSTATS_H
+
+//Setup latency buckets, bucket i holds latencies up to 2^i microseconds, about 16 s for the last
+#define EZSTATS_LATENCY_BUCKETS 25
+
+//Log-bucketed histogram, recording is a count-leading-zeros and two increments
+struct EZLatencyHistogram {
+	uint64_t buckets[EZSTATS_LATENCY_BUCKETS]; //latencies over the last bucket are only in count and sum
+	uint64_t count;
+	uint64_t sum_micros;
+
+	void record(uint64_t micros);
+};
+
+//Counters one relay keeps for each client, plain integers since only the client's own event loop writes them
+struct EZClientStats {
+	uint64_t bytes_in; //from external requests to the client
+	uint64_t bytes_out; //from the client to external requests
+	uint64_t accepted; //external requests accepted on the client's public port
+	uint64_t rejected; //requests that failed to accept or closed before the client took them
+	uint64_t open; //requests accepted and not yet closed
+	uint64_t pending; //requests waiting for the client to answer their OPEN
+	uint64_t closed_external; //ended by the external side
+	uint64_t closed_client; //ended by the client
+	uint64_t timeouts_setup; //closed because the client did not answer their OPEN in time
+	uint64_t timeouts_idle; //closed after moving no data for the client's idle timeout
+	uint64_t timeouts_drain; //still open when a drain ran out of time
+	uint64_t throttled_bytes; //times its requests waited for its byte rate limit
+	uint64_t throttled_requests; //times new requests waited for its request rate limit
+	EZLatencyHistogram setup; //accept to pairing with a client connection or stream
+
+	void reset();
+};
+
+//Monotonic clock for latencies
+uint64_t ezMonotonicMicros();
+
+//Prometheus text format helpers, labels are given without braces, e.g. port="8001"
+void appendStatsFamily(std::string &out, const char *name, const char *type, const char *help);
+void appendStatsHistogram(std::string &out, const char *name, const std::string &labels, const EZLatencyHistogram &h);
+
+//Renders every client's counters in the Prometheus text format, labelled by public port
+std::string formatStats(const std::vector<std::pair<int, const EZClientStats *> > &clients);
+
+#endif // EZSTATS.h
@@ -0,0 +1,148 @@
+#include "ezstream.h"
+
+EZStream::EZStream() {
+	id = 0;
+	sockid = -1;
+	carrier = -1;
+	channel = NULL;
+	input_offset = 0;
+	send_window = 0;
+	consumed = 0;
+	remote_closed = false;
+	closed = false;
+	ready = false;
+	input_held = false;
+	context = NULL;
+}
+
+uint32_t EZStream::getId() {
+	return id;
+}
+
+int EZStream::getSocket() {
+	return sockid;
+}
+
+size_t EZStream::readable() {
+	return input.size() - input_offset;
+}
+
+size_t EZStream::writable() {
+	if(closed) {
+		return 0;
+	}
+	if(sockid == -1) {
+		return send_window;
+	}
+	return (output.size() < EZMUX_WINDOW ? EZMUX_WINDOW - output.size() : 0);
+}
+
+ssize_t EZStream::read(char *buffer, size_t length) {
+	size_t n = std::min(length, readable());
+	if(n == 0) {
+		if(remote_closed || closed) {
+			return 0;
+		}
+		errno = EAGAIN;
+		return -1;
+	}
+	memcpy(buffer, input.data() + input_offset, n);
+	consume(n);
+	return n;
+}
+
+ssize_t EZStream::write(const char *buffer, size_t length) {
+	size_t n = std::min(length, writable());
+	if(n == 0) {
+		errno = (closed ? EPIPE : EAGAIN);
+		return -1;
+	}
+	if(sockid != -1) {
+		output.append(buffer, n);
+		return n;
+	}
+	for(size_t offset = 0; offset < n; offset += EZMUX_MAX_PAYLOAD) {
+		channel->queueFrame(id, EZMUX_DATA, buffer + offset, std::min((size_t)EZMUX_MAX_PAYLOAD, n - offset));
+	}
+	send_window -= n;
+	return n;
+}
+
+ssize_t EZStream::readTo(int fd, size_t length) {
+	size_t n = std::min(length, readable());
+	if(n == 0) {
+		return read(NULL, 0);
+	}
+	ssize_t written = ::write(fd, input.data() + input_offset, n);
+	if(written <= 0) {
+		return -1;
+	}
+	consume(written);
+	return written;
+}
+
+void EZStream::holdInput(bool held) {
+	input_held = held;
+}
+
+void EZStream::setContext(void *ctx) {
+	context = ctx;
+}
+
+void *EZStream::getContext() {
+	return context;
+}
+
+void EZStream::close() {
+	closed = true;
+}
+
+bool EZStream::isClosed() {
+	return closed || (remote_closed && readable() == 0);
+}
+
+void EZStream::consume(size_t n) {
+	input_offset += n;
+	consumed += n;
+	if(input_offset == input.size()) {
+		input.clear();
+		input_offset = 0;
+	}
+}
+
+bool EZStream::fill() {
+	char buffer[EZMUX_MAX_PAYLOAD];
+	while(readable() < EZMUX_WINDOW && !remote_closed) {
+		ssize_t len = recv(sockid, buffer, std::min(sizeof(buffer), EZMUX_WINDOW - readable()), 0);
+		if(len > 0) {
+			input.append(buffer, len);
+		} else if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		} else if(len == -1 && errno == EINTR) {
+			continue;
+		} else {
+			remote_closed = true;
+			return (len == 0);
+		}
+	}
+	return true;
+}
+
+bool EZStream::flush() {
+	size_t offset = 0;
+	while(offset < output.size()) {
+		ssize_t sent = send(sockid, output.data() + offset, output.size() - offset, MSG_NOSIGNAL);
+		if(sent > 0) {
+			offset += sent;
+		} else if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else if(sent == -1 && errno == EINTR) {
+			continue;
+		} else {
+			output.clear();
+			return false;
+		}
+	}
+	output.erase(0, offset);
+	return true;
+}
@@ -0,0 +1,79 @@
+// ezstream.h
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "ezmux.h"
+#ifndef _EZSTREAM_H
+#define _EZSTREAM_H
+
+class EZRelayClient;
+
+//One request as seen by a stream callback.
+//Multiplexed streams share a carrier connection with other requests, direct streams own a data connection.
+//Both buffer up to EZMUX_WINDOW bytes each way, so read() and write() never block.
+class EZStream {
+	friend class EZRelayClient;
+
+private:
+	uint32_t id;
+	int sockid; //data connection of a direct stream, -1 when multiplexed
+	int carrier; //carrier of a multiplexed stream, -1 when direct
+	EZMuxChannel *channel; //carrier output, multiplexed only
+	std::string input, output; //output is only used by direct streams
+	size_t input_offset;
+	size_t send_window; //multiplexed: bytes the relay will still accept
+	size_t consumed; //multiplexed: bytes read since the relay was last granted credit
+	bool remote_closed, closed;
+	bool ready; //queued for the callback
+	bool input_held; //unread data does not queue the callback again, see holdInput()
+	void *context; //left to the callback, see setContext()
+
+	//direct streams only, return false once the socket failed or closed
+	bool fill();
+	bool flush();
+	//drops n bytes read off the input
+	void consume(size_t n);
+
+public:
+	//constructor
+	EZStream();
+
+	//stream id for multiplexed streams, the socket for direct ones
+	uint32_t getId();
+	//data connection of a direct stream, -1 when multiplexed
+	int getSocket();
+
+	//bytes buffered for read()
+	size_t readable();
+	//bytes write() will take now
+	size_t writable();
+
+	//returns bytes read, 0 once the peer closed and everything was read, -1 with EAGAIN when nothing is buffered
+	ssize_t read(char *buffer, size_t length);
+	//takes up to writable() bytes, returns -1 with EAGAIN when that is 0
+	ssize_t write(const char *buffer, size_t length);
+	//writes up to length buffered bytes straight to fd, only what fd took is consumed
+	//returns as read(), or -1 with fd's errno
+	ssize_t readTo(int fd, size_t length);
+
+	//while held, data left unread does not call the callback again on the next run()
+	//new data, room to write and the peer closing still do
+	void holdInput(bool held);
+
+	//pointer kept with the stream for the callback's own state, NULL until set
+	//EZRelayClient::setStreamEndCallback() says when the stream and its context go away
+	void setContext(void *ctx);
+	void *getContext();
+
+	//ends the stream once what was written has been sent
+	void close();
+	//true once close() was called or the peer closed with nothing left to read
+	bool isClosed();
+};
+
+#endif // EZSTREAM.h
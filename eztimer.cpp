@@ -0,0 +1,143 @@
+#include "eztimer.h"
+
+EZTimerWheel::EZTimerWheel(uint64_t now_ms) {
+	for(int i = 0; i < EZTIMER_LEVELS * EZTIMER_SLOTS; i++) {
+		heads[i] = -1;
+	}
+	current = now_ms / EZTIMER_TICK_MS;
+	armed_count = 0;
+}
+
+//Puts an armed timer in the slot its expiry falls in, seen from the current tick.
+//Spreading a slot relinks timers due on the current tick, which advance() fires next.
+void EZTimerWheel::link(int id) {
+	timer &t = timers[id];
+	uint64_t expires = (t.expires > current ? t.expires : current);
+	uint64_t delta = expires - current;
+	int level = 0;
+	while(level < EZTIMER_LEVELS - 1 && delta >= ((uint64_t)1 << ((level + 1) * EZTIMER_SLOT_BITS))) {
+		level++;
+	}
+	uint64_t max_delta = ((uint64_t)1 << (EZTIMER_LEVELS * EZTIMER_SLOT_BITS)) - 1;
+	if(delta > max_delta) {
+		//re-spread from the last level until it is close enough
+		expires = current + max_delta;
+	}
+	t.slot = level * EZTIMER_SLOTS + (int)((expires >> (level * EZTIMER_SLOT_BITS)) & (EZTIMER_SLOTS - 1));
+	t.prev = -1;
+	t.next = heads[t.slot];
+	if(t.next != -1) {
+		timers[t.next].prev = id;
+	}
+	heads[t.slot] = id;
+}
+
+void EZTimerWheel::unlink(int id) {
+	timer &t = timers[id];
+	if(t.prev != -1) {
+		timers[t.prev].next = t.next;
+	} else {
+		heads[t.slot] = t.next;
+	}
+	if(t.next != -1) {
+		timers[t.next].prev = t.prev;
+	}
+	t.prev = t.next = -1;
+}
+
+void EZTimerWheel::schedule(int id, uint32_t generation, uint64_t expires_ms) {
+	if(id < 0) {
+		return;
+	}
+	if((size_t)id >= timers.size()) {
+		timer unset;
+		unset.armed = false;
+		unset.generation = 0;
+		unset.expires = 0;
+		unset.slot = 0;
+		unset.prev = unset.next = -1;
+		timers.resize(id + 1, unset);
+	}
+	timer &t = timers[id];
+	if(t.armed) {
+		unlink(id);
+	} else {
+		armed_count++;
+	}
+	t.armed = true;
+	t.generation = generation;
+	//rounded up, a timer never fires early, and one already due fires on the next tick
+	t.expires = std::max((expires_ms + EZTIMER_TICK_MS - 1) / EZTIMER_TICK_MS, current + 1);
+	link(id);
+}
+
+void EZTimerWheel::cancel(int id) {
+	if(id < 0 || (size_t)id >= timers.size() || !timers[id].armed) {
+		return;
+	}
+	unlink(id);
+	timers[id].armed = false;
+	armed_count--;
+}
+
+size_t EZTimerWheel::size() {
+	return armed_count;
+}
+
+void EZTimerWheel::advance(uint64_t now_ms, std::vector<std::pair<int, uint32_t> > &expired) {
+	uint64_t target = now_ms / EZTIMER_TICK_MS;
+	while(current < target) {
+		if(armed_count == 0) {
+			//nothing to spread or fire, skip straight there
+			current = target;
+			break;
+		}
+		current++;
+		//spread the higher level slots reached on this tick, highest first
+		for(int level = EZTIMER_LEVELS - 1; level > 0; level--) {
+			if((current & (((uint64_t)1 << (level * EZTIMER_SLOT_BITS)) - 1)) != 0) {
+				continue;
+			}
+			int slot = level * EZTIMER_SLOTS + (int)((current >> (level * EZTIMER_SLOT_BITS)) & (EZTIMER_SLOTS - 1));
+			int id = heads[slot];
+			heads[slot] = -1;
+			while(id != -1) {
+				int next = timers[id].next;
+				link(id);
+				id = next;
+			}
+		}
+		int slot = (int)(current & (EZTIMER_SLOTS - 1));
+		int id = heads[slot];
+		while(id != -1) {
+			int next = timers[id].next;
+			if(timers[id].expires <= current) {
+				unlink(id);
+				timers[id].armed = false;
+				armed_count--;
+				expired.push_back(std::make_pair(id, timers[id].generation));
+			}
+			id = next;
+		}
+	}
+}
+
+int EZTimerWheel::nextTimeout(uint64_t now_ms) {
+	if(armed_count == 0) {
+		return -1;
+	}
+	uint64_t now = now_ms / EZTIMER_TICK_MS;
+	uint64_t ticks = 1;
+	while(ticks < EZTIMER_SLOTS) {
+		if(heads[(current + ticks) & (EZTIMER_SLOTS - 1)] != -1 || ((current + ticks) & (EZTIMER_SLOTS - 1)) == 0) {
+			//a timer, or the level 0 wrap where the next level is spread
+			break;
+		}
+		ticks++;
+	}
+	uint64_t at = current + ticks;
+	if(at <= now) {
+		return 0;
+	}
+	return (int)((at * EZTIMER_TICK_MS) - now_ms);
+}
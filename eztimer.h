@@ -0,0 +1,52 @@
+// eztimer.h
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdint.h>
+#ifndef _EZTIMER_H
+#define _EZTIMER_H
+
+#define EZTIMER_TICK_MS 10 //resolution of every deadline
+#define EZTIMER_SLOT_BITS 6
+#define EZTIMER_SLOTS (1 << EZTIMER_SLOT_BITS)
+#define EZTIMER_LEVELS 4 //64^4 ticks, about 46 hours, later deadlines wait in the last level
+
+//Hierarchical timer wheel with one timer per fd, indexed like EZRelay's connection table.
+//Level 0 has a slot per tick, each further level a slot per 64 ticks of the one below;
+//a slot of a higher level is spread over the level below once the wheel reaches it.
+//Scheduling, moving and cancelling a timer only relink it, so each is O(1).
+class EZTimerWheel {
+
+private:
+	struct timer {
+		bool armed;
+		uint32_t generation; //of the connection the timer was set for
+		uint64_t expires; //tick
+		int slot; //level * EZTIMER_SLOTS + slot index
+		int prev, next; //in its slot, -1 at either end
+	};
+	std::vector<timer> timers;
+	int heads[EZTIMER_LEVELS * EZTIMER_SLOTS];
+	uint64_t current; //last tick advance() went through
+	size_t armed_count;
+
+	void link(int id);
+	void unlink(int id);
+
+public:
+	//constructor, time starts at now_ms
+	EZTimerWheel(uint64_t now_ms);
+
+	//sets the only timer of id to expire at expires_ms, replacing one already set
+	void schedule(int id, uint32_t generation, uint64_t expires_ms);
+	void cancel(int id);
+	size_t size();
+
+	//moves the wheel to now_ms and adds every timer that expired to expired with its generation
+	void advance(uint64_t now_ms, std::vector<std::pair<int, uint32_t> > &expired);
+	//milliseconds advance() may wait before a timer could expire, -1 while none is set
+	//timers in the higher levels are not searched, the wheel wakes to spread them first
+	int nextTimeout(uint64_t now_ms);
+};
+
+#endif // EZTIMER.h
@@ -0,0 +1,121 @@
+#include "eztrace.h"
+#include <cstring>
+#include <unistd.h>
+
+//events are written once this much is buffered or this long after the last write,
+//so sampling every request costs one write per few hundred requests
+#define EZTRACE_FLUSH_BYTES 65536
+#define EZTRACE_FLUSH_MICROS 1000000
+
+EZRequestTracer::EZRequestTracer() {
+	sample_every = 0;
+	seen = 0;
+	memset(stages, 0, sizeof(stages));
+	file = NULL;
+	pid = 0;
+	first_event = true;
+	flushed_at = 0;
+}
+
+EZRequestTracer::~EZRequestTracer() {
+	setFile("");
+}
+
+void EZRequestTracer::setSampling(int every) {
+	sample_every = (every > 0 ? every : 0);
+}
+
+int EZRequestTracer::getSampling() {
+	return sample_every;
+}
+
+bool EZRequestTracer::setFile(std::string path) {
+	if(file != NULL) {
+		//a complete JSON array, a file cut short by a crash still loads in the trace viewers
+		buffer += "\n]\n";
+		flush();
+		fclose(file);
+		file = NULL;
+	}
+	if(path == "") {
+		return true;
+	}
+	file = fopen(path.c_str(), "w");
+	if(file == NULL) {
+		return false;
+	}
+	pid = (int)getpid();
+	first_event = true;
+	buffer = "[";
+	return true;
+}
+
+bool EZRequestTracer::sample() {
+	return sample_every > 0 && (seen++ % sample_every) == 0;
+}
+
+void EZRequestTracer::appendEvent(const char *name, uint64_t start, uint64_t end, int request, int port) {
+	char event[256];
+	snprintf(event, sizeof(event), "%s\n{\"name\":\"%s\",\"cat\":\"setup\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"port\":%d}}",
+		(first_event ? "" : ","), name, (unsigned long long)start, (unsigned long long)(end - start), pid, request, port);
+	buffer += event;
+	first_event = false;
+}
+
+void EZRequestTracer::finish(const uint64_t at[EZTRACE_STAGES], int request, int port) {
+	uint64_t previous = at[trace_accepted];
+	for(int stage = trace_accepted + 1; stage < EZTRACE_STAGES; stage++) {
+		if(at[stage] == 0) {
+			continue;
+		}
+		stages[stage].record(at[stage] - previous);
+		if(file != NULL) {
+			//each span ends at the stage it is named after
+			appendEvent(stageName(stage), previous, at[stage], request, port);
+		}
+		previous = at[stage];
+	}
+	if(file != NULL) {
+		appendEvent("request", at[trace_accepted], previous, request, port);
+		if(buffer.size() >= EZTRACE_FLUSH_BYTES || previous >= flushed_at + EZTRACE_FLUSH_MICROS) {
+			flush();
+			flushed_at = previous;
+		}
+	}
+}
+
+void EZRequestTracer::flush() {
+	if(file != NULL && !buffer.empty()) {
+		fwrite(buffer.data(), 1, buffer.size(), file);
+		fflush(file);
+	}
+	buffer.clear();
+}
+
+std::string EZRequestTracer::format() {
+	std::string out;
+	if(sample_every == 0) {
+		return out;
+	}
+	appendStatsFamily(out, "ezrelay_setup_stage_seconds", "histogram", "Sampled requests, time from the previous setup stage to this one.");
+	for(int stage = trace_accepted + 1; stage < EZTRACE_STAGES; stage++) {
+		appendStatsHistogram(out, "ezrelay_setup_stage_seconds", std::string("stage=\"") + stageName(stage) + "\"", stages[stage]);
+	}
+	return out;
+}
+
+const char *EZRequestTracer::stageName(int stage) {
+	switch(stage) {
+		case trace_accepted:
+			return "accepted";
+		case trace_dispatched:
+			return "dispatched";
+		case trace_open_sent:
+			return "open_sent";
+		case trace_paired:
+			return "paired";
+		case trace_first_byte:
+			return "first_byte";
+	}
+	return "unknown";
+}
@@ -0,0 +1,60 @@
+// eztrace.h
+#include <string>
+#include <cstdio>
+#include <stdint.h>
+#include "ezstats.h"
+#ifndef _EZTRACE_H
+#define _EZTRACE_H
+
+//Stages of a request's setup, in the order a request reaches them.
+//Pooled and multiplexed requests are paired when they are dispatched and skip open_sent.
+enum ez_trace_stage {
+	trace_accepted = 0, //external request accepted on the client's public port
+	trace_dispatched, //paired with a pooled connection, opened as a stream, or its OPEN queued
+	trace_open_sent, //OPEN written to the client's control socket
+	trace_paired, //paired with a client data connection or stream
+	trace_first_byte, //first byte forwarded in either direction
+	EZTRACE_STAGES
+};
+
+//Aggregates the stage timestamps of sampled requests into per-stage histograms
+//and optionally writes them as Chrome trace events (chrome://tracing, Perfetto).
+//Each relay owns one, only its event loop touches it.
+class EZRequestTracer {
+
+private:
+	int sample_every; //0 traces nothing
+	uint64_t seen;
+	EZLatencyHistogram stages[EZTRACE_STAGES]; //time from the previous stage reached, trace_accepted is unused
+	FILE *file;
+	std::string buffer; //events not yet written to file
+	int pid; //process id in the events, each relay writes its own file
+	bool first_event;
+	uint64_t flushed_at;
+
+	void appendEvent(const char *name, uint64_t start, uint64_t end, int request, int port);
+
+public:
+	//constructor
+	EZRequestTracer();
+	~EZRequestTracer();
+
+	//traces one in every requests, 0 turns tracing off
+	void setSampling(int every);
+	int getSampling();
+	//writes events to path, "" stops writing, returns false if the file could not be opened
+	bool setFile(std::string path);
+
+	//decides whether the request being accepted is traced
+	bool sample();
+	//records a traced request once it forwarded its first byte or closed, at[stage] is 0 for stages it skipped
+	void finish(const uint64_t at[EZTRACE_STAGES], int request, int port);
+	//writes buffered events out
+	void flush();
+
+	//per-stage histograms in the Prometheus text format, empty while tracing is off
+	std::string format();
+	static const char *stageName(int stage);
+};
+
+#endif // EZTRACE.h
@@ -0,0 +1,268 @@
+#include "ezuring.h"
+
+#ifdef EZRELAY_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+
+#define EZURING_REMOVE_USER_DATA (EZURING_RESERVED_USER_DATA - 1)
+
+EZUring::EZUring() {
+	ring_fd = -1;
+	features = 0;
+	sq_entries = 0;
+	queued = 0;
+	timeout_user_data = 0;
+	timeout_pending = false;
+	sq_ptr = cq_ptr = NULL;
+	sqes = NULL;
+	cqes = NULL;
+	sq_size = cq_size = sqes_size = 0;
+	memset(supported_ops, 0, sizeof(supported_ops));
+}
+
+EZUring::~EZUring() {
+	close();
+}
+
+int EZUring::enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+bool EZUring::open(unsigned entries) {
+	if(ring_fd != -1) {
+		return true;
+	}
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	//completions for multishot accepts and linked splices outnumber submissions
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+	ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if(ring_fd == -1) {
+		return false;
+	}
+	features = params.features;
+	//completions past a full cq are held by the kernel until flushed instead of being lost, see reap()
+	if(!(features & IORING_FEAT_NODROP)) {
+		close();
+		errno = ENOSYS;
+		return false;
+	}
+	sq_entries = params.sq_entries;
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(features & IORING_FEAT_SINGLE_MMAP) {
+		sq_size = cq_size = std::max(sq_size, cq_size);
+	}
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if(sq_ptr == MAP_FAILED) {
+		sq_ptr = NULL;
+		close();
+		return false;
+	}
+	if(features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if(cq_ptr == MAP_FAILED) {
+			cq_ptr = NULL;
+			close();
+			return false;
+		}
+	}
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes_ptr = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if(sqes_ptr == MAP_FAILED) {
+		close();
+		return false;
+	}
+	sqes = (struct io_uring_sqe *)sqes_ptr;
+	char *sq = (char *)sq_ptr;
+	sq_head = (unsigned *)(sq + params.sq_off.head);
+	sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + params.sq_off.array);
+	sq_flags = (unsigned *)(sq + params.sq_off.flags);
+	char *cq = (char *)cq_ptr;
+	cq_head = (unsigned *)(cq + params.cq_off.head);
+	cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	probe();
+	return true;
+}
+
+//Records which opcodes the running kernel implements.
+void EZUring::probe() {
+	size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *p = (struct io_uring_probe *)calloc(1, len);
+	if(p == NULL) {
+		return;
+	}
+	if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, p, 256) == 0) {
+		for(int i = 0; i < p->ops_len && i < 256; i++) {
+			if(p->ops[i].flags & IO_URING_OP_SUPPORTED) {
+				supported_ops[p->ops[i].op] = 1;
+			}
+		}
+	}
+	free(p);
+}
+
+void EZUring::close() {
+	if(sqes != NULL) {
+		munmap(sqes, sqes_size);
+		sqes = NULL;
+	}
+	if(cq_ptr != NULL && cq_ptr != sq_ptr) {
+		munmap(cq_ptr, cq_size);
+	}
+	cq_ptr = NULL;
+	if(sq_ptr != NULL) {
+		munmap(sq_ptr, sq_size);
+		sq_ptr = NULL;
+	}
+	if(ring_fd != -1) {
+		::close(ring_fd);
+		ring_fd = -1;
+	}
+	queued = 0;
+	timeout_pending = false;
+}
+
+bool EZUring::isOpen() {
+	return (ring_fd != -1);
+}
+
+bool EZUring::supports(int opcode) {
+	return (opcode >= 0 && opcode < 256 && supported_ops[opcode]);
+}
+
+struct io_uring_sqe *EZUring::getSqe() {
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *sq_tail;
+	if(tail - head >= sq_entries) {
+		//ring is full, hand the batch so far to the kernel
+		enter(queued, 0, 0, NULL, 0);
+		queued = 0;
+		head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if(tail - head >= sq_entries) {
+			return NULL;
+		}
+	}
+	unsigned index = tail & *sq_mask;
+	struct io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	queued++;
+	return sqe;
+}
+
+int EZUring::submitAndWait(int timeout) {
+	unsigned to_submit = queued;
+	if(timeout == 0) {
+		queued = 0;
+		//GETEVENTS also flushes completions held back while the cq was full
+		return enter(to_submit, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+	}
+	struct __kernel_timespec ts;
+	if(timeout > 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+	}
+	if(timeout < 0) {
+		queued = 0;
+		return enter(to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	}
+	if(features & IORING_FEAT_EXT_ARG) {
+		queued = 0;
+		struct io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		return enter(to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	}
+	//older kernels, a timeout sqe wakes the wait instead.
+	//It outlives a wait ended by another completion, so the last one is removed first and each gets its own
+	//user_data: one that completes late is told apart from this wait's and does not end it early
+	struct io_uring_sqe *sqe;
+	if(timeout_pending && (sqe = getSqe()) != NULL) {
+		sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = timeout_user_data;
+		sqe->user_data = EZURING_REMOVE_USER_DATA;
+	}
+	if((sqe = getSqe()) != NULL) {
+		timeout_user_data = timeout_user_data % (EZURING_REMOVE_USER_DATA - 1) + 1;
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)&ts;
+		sqe->len = 1;
+		sqe->user_data = timeout_user_data;
+		timeout_pending = true;
+	}
+	to_submit = queued;
+	queued = 0;
+	int submitted = enter(to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	while(submitted >= 0 && timeout_pending && !skipOwnCompletions()) {
+		if(enter(0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+			break;
+		}
+	}
+	return submitted;
+}
+
+//true for completions of the ring's own sqes, notes when the pending timeout has completed
+bool EZUring::ownCompletion(uint64_t user_data) {
+	if(user_data >= EZURING_RESERVED_USER_DATA) {
+		return false;
+	}
+	if(timeout_pending && user_data == timeout_user_data) {
+		timeout_pending = false;
+	}
+	return true;
+}
+
+//Drops the ring's own completions from the head of the cq.
+//Returns true when the wait is over, a completion for the caller is next or the pending timeout has fired.
+bool EZUring::skipOwnCompletions() {
+	unsigned head = *cq_head;
+	while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		if(!ownCompletion(cqes[head & *cq_mask].user_data)) {
+			break;
+		}
+		head++;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	return (!timeout_pending || head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE));
+}
+
+int EZUring::reap(std::function<void(uint64_t, int, unsigned)> callback) {
+	int seen = 0;
+	unsigned head = *cq_head;
+	while(true) {
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		if(head == tail) {
+			//completions that did not fit are held by the kernel, flush them into the cq and carry on
+			if(__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) {
+				enter(0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+				if(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+					continue;
+				}
+			}
+			break;
+		}
+		struct io_uring_cqe cqe = cqes[head & *cq_mask];
+		head++;
+		//release the slot before the callback, which may queue more work
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		if(ownCompletion(cqe.user_data)) {
+			continue;
+		}
+		callback(cqe.user_data, cqe.res, cqe.flags);
+		seen++;
+	}
+	return seen;
+}
+#endif // EZRELAY_HAVE_IO_URING
@@ -0,0 +1,91 @@
+// ezuring.h
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#ifndef _EZURING_H
+#define _EZURING_H
+
+//io_uring support is detected from the kernel headers at build time.
+//Build with -DEZRELAY_NO_IO_URING to leave it out entirely.
+#if defined(__linux__) && !defined(EZRELAY_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_FEAT_FAST_POLL)
+#define EZRELAY_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef EZRELAY_HAVE_IO_URING
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+#ifndef IORING_SQ_CQ_OVERFLOW
+#define IORING_SQ_CQ_OVERFLOW (1U << 1)
+#endif
+
+//user_data below this is kept for the ring's own timeouts and never reaches reap()'s callback
+#define EZURING_RESERVED_USER_DATA (1ULL << 24)
+
+//Minimal io_uring submission/completion ring built directly on the syscalls.
+//SQEs are queued with getSqe() and handed to the kernel in one batch by submitAndWait().
+class EZUring {
+
+private:
+	int ring_fd;
+	unsigned features;
+	unsigned sq_entries;
+	unsigned queued; //sqes written since the last io_uring_enter
+	uint64_t timeout_user_data; //user_data of the last timeout sqe, see submitAndWait()
+	bool timeout_pending; //it has not completed yet
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *sq_flags;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	unsigned char supported_ops[256];
+
+	int enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz);
+	void probe();
+	bool ownCompletion(uint64_t user_data);
+	bool skipOwnCompletions();
+
+public:
+	//constructor
+	EZUring();
+	~EZUring();
+
+	//sets up a ring with at least the entries given
+	//returns false when the kernel has no usable io_uring, errno is left as reported by the kernel
+	//or ENOSYS when it would drop completions on a full cq
+	bool open(unsigned entries);
+	void close();
+	bool isOpen();
+
+	//true if the running kernel implements the opcode
+	bool supports(int opcode);
+
+	//returns a zeroed sqe, flushing queued sqes to the kernel when the ring is full
+	struct io_uring_sqe *getSqe();
+
+	//submits every queued sqe and waits up to timeout ms (-1 forever) for at least one completion
+	//returns number of sqes submitted
+	int submitAndWait(int timeout);
+
+	//calls callback(user_data, res, flags) for each completion ready, returns how many were seen
+	int reap(std::function<void(uint64_t, int, unsigned)> callback);
+};
+#endif // EZRELAY_HAVE_IO_URING
+
+#endif // EZURING.h
@@ -0,0 +1,478 @@
+#include "ezpoller.h"
+#include "logger.h"
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//Load generator for the relay, drives the modes of the reference backend in echoserver.cpp
+//through the public address a client was given and prints one JSON object with the results.
+
+void usage() {
+	std::cout << "Opens concurrent external connections through the relay and measures them." << std::endl;
+	std::cout << "Usage: ./loadgen -a <public address:host:port>" << std::endl;
+	std::cout << "Optional arguments:" << std::endl;
+	std::cout << "    -o <mode:string> -- 'echo', 'rr', 'sink' or 'source', must match the backend's -o -- default value is 'echo'" << std::endl;
+	std::cout << "    -c <connections:integer> -- concurrent connections -- default value is 64" << std::endl;
+	std::cout << "    -d <seconds:integer> -- length of the run -- default value is 5" << std::endl;
+	std::cout << "    -i <bytes:integer> -- request size for echo and rr, write size for sink -- default value is 64" << std::endl;
+	std::cout << "    -s <bytes:integer> -- response size for rr, must match the backend's -s -- default value is 64" << std::endl;
+	std::cout << "    -q <requests:integer> -- requests per connection before reconnecting, 0 keeps connections open -- default value is 0" << std::endl;
+	std::cout << "    -t <threads:integer> -- event loops the connections are spread over -- default value is 1" << std::endl;
+	std::cout << "    -l <label:string> -- name for this run in the output -- default value is the mode" << std::endl;
+	std::cout << "    -h -- prints this usage information" << std::endl;
+}
+
+enum bench_mode {
+	mode_echo = 1, //send a request, wait for the same bytes back
+	mode_rr, //send a request, wait for a fixed size response
+	mode_sink, //only send
+	mode_source //only receive
+};
+
+struct bench_config {
+	bench_mode mode;
+	std::string label;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int connections;
+	int seconds;
+	size_t request_size, response_size;
+	int requests_per_connection;
+};
+
+//What one event loop measured, merged into the report once every loop is done
+struct bench_result {
+	uint64_t requests = 0;
+	uint64_t errors = 0;
+	uint64_t connects = 0;
+	uint64_t bytes_sent = 0;
+	uint64_t bytes_received = 0;
+	std::vector<uint32_t> latency; //micros per request
+	std::vector<uint32_t> setup; //micros from connect() to the first response byte
+};
+
+struct bench_conn {
+	int sockid = -1;
+	uint64_t connect_at = 0;
+	uint64_t request_at = 0;
+	size_t send_offset = 0; //bytes of the current request sent
+	size_t received = 0; //bytes of the current response received
+	int requests = 0;
+	bool connected = false;
+	bool setup_recorded = false;
+};
+
+static uint64_t nowMicros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t clampMicros(uint64_t micros) {
+	return (uint32_t)std::min(micros, (uint64_t)0xffffffff);
+}
+
+class BenchWorker {
+
+private:
+	const bench_config &config;
+	bench_result &result;
+	EZPoller poller; //level triggered
+	std::vector<bench_conn> conns; //indexed by socket
+	std::vector<char> payload, scratch;
+	int target;
+	int open_count;
+
+	bench_conn &connFor(int sockid) {
+		if(sockid >= (int)conns.size()) {
+			conns.resize(sockid + 1);
+		}
+		return conns[sockid];
+	}
+
+	//bytes a response to the current request is made of, 0 when nothing comes back
+	size_t expected() {
+		if(config.mode == mode_echo) {
+			return config.request_size;
+		}
+		if(config.mode == mode_rr) {
+			return config.response_size;
+		}
+		return 0;
+	}
+
+	void openOne() {
+		int s = socket(config.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if(s == -1) {
+			std::throw_with_nested(
+				std::runtime_error("BenchWorker::openOne: Error produced in socket(), errno " + std::to_string(errno) + ".")
+			);
+		}
+		int enable = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+		bench_conn &conn = connFor(s);
+		conn = bench_conn();
+		conn.sockid = s;
+		conn.connect_at = nowMicros();
+		if(connect(s, (struct sockaddr *)&config.addr, config.addr_len) == -1 && errno != EINPROGRESS) {
+			result.errors++;
+			close(s);
+			return;
+		}
+		poller.add(s, POLLOUT, false);
+		open_count++;
+	}
+
+	void closeOne(int sockid, bool failed) {
+		if(failed) {
+			result.errors++;
+		}
+		poller.remove(sockid);
+		close(sockid);
+		conns[sockid].sockid = -1;
+		open_count--;
+	}
+
+	void startRequest(bench_conn &conn) {
+		conn.request_at = nowMicros();
+		conn.send_offset = 0;
+		conn.received = 0;
+		poller.modify(conn.sockid, POLLOUT, false);
+	}
+
+	void writeRequest(bench_conn &conn) {
+		size_t size = (config.mode == mode_sink ? payload.size() : config.request_size);
+		while(conn.send_offset < size) {
+			ssize_t sent = send(conn.sockid, &payload[0], std::min(payload.size(), size - conn.send_offset), MSG_NOSIGNAL);
+			if(sent > 0) {
+				conn.send_offset += sent;
+				result.bytes_sent += sent;
+			} else if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return;
+			} else {
+				closeOne(conn.sockid, true);
+				return;
+			}
+		}
+		if(config.mode == mode_sink) {
+			//keep the socket full, the next write starts a new chunk
+			conn.send_offset = 0;
+			return;
+		}
+		poller.modify(conn.sockid, POLLIN, false);
+	}
+
+	void readResponse(bench_conn &conn) {
+		while(true) {
+			ssize_t len = recv(conn.sockid, &scratch[0], scratch.size(), 0);
+			if(len > 0) {
+				result.bytes_received += len;
+				if(!conn.setup_recorded) {
+					conn.setup_recorded = true;
+					result.setup.push_back(clampMicros(nowMicros() - conn.connect_at));
+				}
+				if(config.mode == mode_source) {
+					continue;
+				}
+				conn.received += len;
+				if(conn.received >= expected()) {
+					result.latency.push_back(clampMicros(nowMicros() - conn.request_at));
+					result.requests++;
+					conn.requests++;
+					if(config.requests_per_connection > 0 && conn.requests >= config.requests_per_connection) {
+						closeOne(conn.sockid, false);
+						return;
+					}
+					startRequest(conn);
+					return;
+				}
+			} else if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return;
+			} else {
+				//the relay or backend hung up on a request still in flight
+				closeOne(conn.sockid, true);
+				return;
+			}
+		}
+	}
+
+	void handle(pollfd pfd) {
+		if(pfd.fd >= (int)conns.size() || conns[pfd.fd].sockid != pfd.fd) {
+			return;
+		}
+		bench_conn &conn = conns[pfd.fd];
+		if(!conn.connected) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(conn.sockid, SOL_SOCKET, SO_ERROR, &err, &len);
+			if(err != 0 || (pfd.revents & (POLLERR | POLLHUP))) {
+				closeOne(conn.sockid, true);
+				return;
+			}
+			conn.connected = true;
+			result.connects++;
+			if(config.mode == mode_source) {
+				poller.modify(conn.sockid, POLLIN, false);
+			} else {
+				startRequest(conn);
+			}
+			return;
+		}
+		if(pfd.revents & POLLIN) {
+			readResponse(conn);
+		} else if(pfd.revents & POLLOUT) {
+			writeRequest(conn);
+		} else if(pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			closeOne(conn.sockid, true);
+		}
+	}
+
+public:
+	BenchWorker(const bench_config &c, bench_result &r, int connections) : config(c), result(r) {
+		target = connections;
+		open_count = 0;
+		payload.assign(std::max(config.request_size, (size_t)65536), 'x');
+		scratch.resize(65536);
+	}
+
+	~BenchWorker() {
+		for(size_t i = 0; i < conns.size(); i++) {
+			if(conns[i].sockid != -1) {
+				close(conns[i].sockid);
+			}
+		}
+	}
+
+	void run() {
+		uint64_t deadline = nowMicros() + (uint64_t)config.seconds * 1000000;
+		auto cb = [&](pollfd pfd) {
+			handle(pfd);
+		};
+		while(nowMicros() < deadline) {
+			//replaces connections that finished or failed
+			while(open_count < target) {
+				openOne();
+			}
+			poller.wait(10, cb);
+		}
+	}
+};
+
+static bool resolve(const std::string &address, bench_config &config) {
+	size_t colon = address.rfind(':');
+	if(colon == std::string::npos) {
+		return false;
+	}
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &res) != 0) {
+		return false;
+	}
+	memcpy(&config.addr, res->ai_addr, res->ai_addrlen);
+	config.addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return true;
+}
+
+static uint32_t percentile(const std::vector<uint32_t> &sorted, double p) {
+	if(sorted.empty()) {
+		return 0;
+	}
+	size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+	return sorted[index];
+}
+
+static std::string percentiles(std::vector<uint32_t> &samples) {
+	std::sort(samples.begin(), samples.end());
+	std::ostringstream out;
+	out << "{\"count\":" << samples.size()
+		<< ",\"p50\":" << percentile(samples, 0.50)
+		<< ",\"p99\":" << percentile(samples, 0.99)
+		<< ",\"p999\":" << percentile(samples, 0.999)
+		<< ",\"max\":" << (samples.empty() ? 0 : samples.back()) << "}";
+	return out.str();
+}
+
+static std::string report(const bench_config &config, bench_result &total, double elapsed) {
+	const char *names[] = {"", "echo", "rr", "sink", "source"};
+	char rates[256];
+	snprintf(rates, sizeof(rates), "\"requests_per_sec\":%.1f,\"connects_per_sec\":%.1f,\"sent_bytes_per_sec\":%.1f,\"received_bytes_per_sec\":%.1f",
+		total.requests / elapsed, total.connects / elapsed, total.bytes_sent / elapsed, total.bytes_received / elapsed);
+	std::ostringstream out;
+	out << "{\"label\":\"" << config.label << "\""
+		<< ",\"mode\":\"" << names[config.mode] << "\""
+		<< ",\"connections\":" << config.connections
+		<< ",\"seconds\":" << elapsed
+		<< ",\"request_bytes\":" << config.request_size
+		<< ",\"response_bytes\":" << config.response_size
+		<< ",\"requests_per_connection\":" << config.requests_per_connection
+		<< ",\"requests\":" << total.requests
+		<< ",\"connects\":" << total.connects
+		<< ",\"errors\":" << total.errors
+		<< ",\"bytes_sent\":" << total.bytes_sent
+		<< ",\"bytes_received\":" << total.bytes_received
+		<< "," << rates
+		<< ",\"latency_us\":" << percentiles(total.latency)
+		<< ",\"setup_us\":" << percentiles(total.setup) << "}";
+	return out.str();
+}
+
+void print_exception(const std::exception& e, int level =  0) {
+    std::cerr << std::string(level, ' ') << "exception: " << e.what() << '\n';
+    try {
+        std::rethrow_if_nested(e);
+    } catch(const std::exception& e) {
+        print_exception(e, level+1);
+    } catch(...) {}
+}
+
+int main(int argc, char *argv[]) {
+	std::string address = "";
+	std::string mode = "echo";
+	std::string label = "";
+	bench_config config;
+	config.connections = 64;
+	config.seconds = 5;
+	config.request_size = 64;
+	config.response_size = 64;
+	config.requests_per_connection = 0;
+	int threads = 1;
+	int c;
+	while ((c = getopt (argc, argv, "a:o:c:d:i:s:q:t:l:h")) != -1) {
+    	switch (c) {
+			case 'a':
+				address = optarg;
+				break;
+			case 'o':
+				mode = optarg;
+				break;
+			case 'c':
+				config.connections = std::stoi(optarg);
+				break;
+			case 'd':
+				config.seconds = std::stoi(optarg);
+				break;
+			case 'i':
+				config.request_size = std::stoul(optarg);
+				break;
+			case 's':
+				config.response_size = std::stoul(optarg);
+				break;
+			case 'q':
+				config.requests_per_connection = std::stoi(optarg);
+				break;
+			case 't':
+				threads = std::stoi(optarg);
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			case 'h':
+				usage();
+				return 1;
+			case '?':
+				if (optopt == 'a' || optopt == 'o' || optopt == 'c' || optopt == 'd' || optopt == 'i' || optopt == 's' || optopt == 'q' || optopt == 't' || optopt == 'l') {
+					fprintf (stderr, "Option -%c requires an argument.\n", optopt);
+				}
+				else if (isprint (optopt)) {
+					fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+				}
+				else {
+					fprintf (stderr, "Unknown option character `\\x%x'.\n", optopt);
+				}
+				usage();
+				return 1;
+			default:
+				abort ();
+		}
+	}
+	if(mode == "echo") {
+		config.mode = mode_echo;
+	} else if(mode == "rr") {
+		config.mode = mode_rr;
+	} else if(mode == "sink") {
+		config.mode = mode_sink;
+	} else if(mode == "source") {
+		config.mode = mode_source;
+	} else {
+		std::cout << "Invalid mode (echo, rr, sink, source): " << mode << std::endl;
+		usage();
+		return 1;
+	}
+	config.label = (label == "" ? mode : label);
+	if(address == "" || !resolve(address, config)) {
+		std::cout << "Missing or unresolvable address: " << address << std::endl;
+		usage();
+		return 1;
+	}
+	if(config.connections < 1 || config.seconds < 1 || config.request_size < 1 || config.response_size < 1 || config.requests_per_connection < 0) {
+		std::cout << "Connections, seconds and sizes must be positive" << std::endl;
+		usage();
+		return 1;
+	}
+	if(threads < 1 || threads > config.connections) {
+		std::cout << "Invalid thread count (1-" << config.connections << "): " << threads << std::endl;
+		usage();
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	std::vector<bench_result> results(threads);
+	std::vector<std::thread> workers;
+	std::vector<std::exception_ptr> failures(threads);
+	uint64_t started = nowMicros();
+	for(int i = 0; i < threads; i++) {
+		//the first connections % threads loops take one extra connection
+		int share = config.connections / threads + (i < config.connections % threads ? 1 : 0);
+		workers.push_back(std::thread([&, i, share]() {
+			try {
+				BenchWorker worker(config, results[i], share);
+				worker.run();
+			} catch(...) {
+				failures[i] = std::current_exception();
+			}
+		}));
+	}
+	for(size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	double elapsed = (nowMicros() - started) / 1000000.0;
+	bench_result total;
+	for(int i = 0; i < threads; i++) {
+		if(failures[i]) {
+			try {
+				std::rethrow_exception(failures[i]);
+			} catch (const std::exception& e) {
+				print_exception(e);
+				return 1;
+			}
+		}
+		total.requests += results[i].requests;
+		total.errors += results[i].errors;
+		total.connects += results[i].connects;
+		total.bytes_sent += results[i].bytes_sent;
+		total.bytes_received += results[i].bytes_received;
+		total.latency.insert(total.latency.end(), results[i].latency.begin(), results[i].latency.end());
+		total.setup.insert(total.setup.end(), results[i].setup.begin(), results[i].setup.end());
+	}
+	std::cout << report(config, total, elapsed) << std::endl;
+	return 0;
+}
@@ -1,26 +1,194 @@
 #include "logger.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
 //source found from: http://coliru.stacked-crooked.com/a/1a03f2095f0ac308
-    Log::Log(enum msg_type mt, bool is_enabled)
-    {
-        enabled = is_enabled;
-        if(enabled) {
-            switch (mt) {
-            case dbg:
-                std::cout << "[D] ";
-                break;
-            case inf:
-                std::cout << "[I] ";
-                break;
-            case wrn:
-                std::cout << "[W] ";
-                break;
-            case err:
-                std::cout << "[E] ";
-                break;
-            default:
-                break;
-            }
-        }
-    }
-
-        
\ No newline at end of file
+
+#define LOG_SLOTS 4096 //power of two
+#define LOG_SLOT_SIZE 512 //longer lines are cut short
+
+//Bounded multi-producer ring drained by one writer thread.
+//Producers claim a slot with a compare-and-swap on enqueue_pos and publish it through the
+//slot's sequence number, so event loops on any thread queue a line without taking a lock.
+//An idle writer sleeps until a producer finds it idle and wakes it, which is the only time a producer locks.
+class LogWriter {
+
+private:
+	struct slot {
+		std::atomic<size_t> sequence;
+		size_t length;
+		char text[LOG_SLOT_SIZE];
+	};
+	slot *slots;
+	std::atomic<size_t> enqueue_pos;
+	size_t dequeue_pos; //writer thread only
+	std::atomic<uint64_t> dropped_lines;
+	std::atomic<bool> running;
+	std::thread writer;
+	std::mutex output_lock; //between setOutput() and the writer, producers never take it
+	FILE *output;
+	std::mutex wake_lock;
+	std::condition_variable wake;
+	std::atomic<bool> idle; //the writer found the ring empty and waits, or is about to, for push() to wake it
+
+	//true if the next line to write has been published
+	bool ready() {
+		return slots[dequeue_pos & (LOG_SLOTS - 1)].sequence.load(std::memory_order_acquire) == dequeue_pos + 1;
+	}
+
+	bool drain() {
+		std::string batch;
+		while(true) {
+			slot &s = slots[dequeue_pos & (LOG_SLOTS - 1)];
+			if(s.sequence.load(std::memory_order_acquire) != dequeue_pos + 1) {
+				break;
+			}
+			batch.append(s.text, s.length);
+			s.sequence.store(dequeue_pos + LOG_SLOTS, std::memory_order_release);
+			dequeue_pos++;
+		}
+		if(batch.empty()) {
+			return false;
+		}
+		std::lock_guard<std::mutex> guard(output_lock);
+		fwrite(batch.data(), 1, batch.size(), output);
+		fflush(output);
+		return true;
+	}
+
+	void run() {
+		while(running.load(std::memory_order_acquire)) {
+			if(drain()) {
+				continue;
+			}
+			std::unique_lock<std::mutex> guard(wake_lock);
+			idle.store(true, std::memory_order_relaxed);
+			//pairs with the fence in push(): either it sees idle or ready() sees its line
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while(idle.load(std::memory_order_relaxed) && running.load(std::memory_order_acquire) && !ready()) {
+				wake.wait(guard);
+			}
+			idle.store(false, std::memory_order_relaxed);
+		}
+		drain();
+	}
+
+public:
+	LogWriter() {
+		slots = new slot[LOG_SLOTS];
+		for(size_t i = 0; i < LOG_SLOTS; i++) {
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		enqueue_pos.store(0);
+		dequeue_pos = 0;
+		dropped_lines.store(0);
+		output = stdout;
+		idle.store(false);
+		running.store(true);
+		writer = std::thread(&LogWriter::run, this);
+	}
+
+	~LogWriter() {
+		{
+			std::lock_guard<std::mutex> guard(wake_lock);
+			running.store(false, std::memory_order_release);
+		}
+		wake.notify_one();
+		writer.join();
+		if(output != stdout) {
+			fclose(output);
+		}
+		delete[] slots;
+	}
+
+	void push(const std::string &line) {
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		slot *s;
+		while(true) {
+			s = &slots[pos & (LOG_SLOTS - 1)];
+			size_t sequence = s->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+			if(diff == 0) {
+				if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if(diff < 0) {
+				dropped_lines.fetch_add(1, std::memory_order_relaxed);
+				return;
+			} else {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		s->length = std::min(line.size(), (size_t)LOG_SLOT_SIZE);
+		memcpy(s->text, line.data(), s->length);
+		if(line.size() > LOG_SLOT_SIZE) {
+			s->text[LOG_SLOT_SIZE - 1] = '\n';
+		}
+		s->sequence.store(pos + 1, std::memory_order_release);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(idle.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> guard(wake_lock);
+			idle.store(false, std::memory_order_relaxed);
+			wake.notify_one();
+		}
+	}
+
+	bool setOutput(const std::string &path) {
+		FILE *file = fopen(path.c_str(), "a");
+		if(file == NULL) {
+			return false;
+		}
+		std::lock_guard<std::mutex> guard(output_lock);
+		if(output != stdout) {
+			fclose(output);
+		}
+		output = file;
+		return true;
+	}
+
+	uint64_t dropped() {
+		return dropped_lines.load(std::memory_order_relaxed);
+	}
+};
+
+//started by the first line logged, drained and joined at exit
+static LogWriter &logWriter() {
+	static LogWriter writer;
+	return writer;
+}
+
+Log::Log(enum msg_type mt)
+{
+	switch (mt) {
+	case dbg:
+		line = "[D] ";
+		break;
+	case inf:
+		line = "[I] ";
+		break;
+	case wrn:
+		line = "[W] ";
+		break;
+	case err:
+		line = "[E] ";
+		break;
+	default:
+		break;
+	}
+}
+
+Log::~Log()
+{
+	logWriter().push(line);
+}
+
+bool Log::setOutput(const std::string &path) {
+	return logWriter().setOutput(path);
+}
+
+uint64_t Log::dropped() {
+	return logWriter().dropped();
+}
@@ -1,27 +1,64 @@
 #include <iostream>
+#include <string>
+#include <type_traits>
+#include <stdint.h>
 #ifndef _LOGGER_H
 #define _LOGGER_H
 //source found from: http://coliru.stacked-crooked.com/a/1a03f2095f0ac308
+
+//Lowest level compiled in, build with -DEZRELAY_LOG_LEVEL=5 to compile every log call out
+#ifndef EZRELAY_LOG_LEVEL
+#define EZRELAY_LOG_LEVEL 1
+#endif
+
+//Logs one line if enabled is true: EZLOG(Log::dbg, verbose) << "accepted " << sockid << '\n';
+//The level and flag are checked before anything streamed into it is evaluated,
+//and levels below EZRELAY_LOG_LEVEL are removed by the compiler.
+#define EZLOG(level, enabled) if((level) < EZRELAY_LOG_LEVEL || !(enabled)) ; else Log(level)
+
+//Formats one line and hands it to a background writer through a lock-free ring,
+//so logging never blocks the event loop on stdout. Lines are dropped if the ring is full.
 class Log {
 
-    public:
-        enum msg_type {
-            dbg =1,
-            inf,
-            wrn,
-            err
-        };
-        bool enabled = false;
-
-        Log(enum msg_type mt, bool is_enabled);
-
-        template<typename T>
-        Log& operator<<(const T& t)
-        {
-            if(enabled) {
-                std::cout << t;
-            }
-            return *this;
-        }
+	public:
+		enum msg_type {
+			dbg = 1,
+			inf,
+			wrn,
+			err
+		};
+
+		explicit Log(enum msg_type mt);
+		//queues the line for the writer thread
+		~Log();
+
+		template<typename T>
+		Log& operator<<(const T& t)
+		{
+			append(t);
+			return *this;
+		}
+
+		//sends lines to the file at path instead of stdout, returns false if it cannot be opened
+		static bool setOutput(const std::string &path);
+		//lines dropped because the writer fell behind
+		static uint64_t dropped();
+
+	private:
+		std::string line;
+
+		void append(const std::string &s) {
+			line += s;
+		}
+		void append(const char *s) {
+			line += s;
+		}
+		void append(char c) {
+			line += c;
+		}
+		template<typename T>
+		typename std::enable_if<std::is_arithmetic<T>::value>::type append(const T &t) {
+			line += std::to_string(t);
+		}
 };
-#endif // LOGGER.h
\ No newline at end of file
+#endif // LOGGER.h
@@ -1,12 +1,26 @@
 #include "ezrelay.h"
+#include "ezrelayshards.h"
+#include "logger.h"
 #include <exception>
 #include <stdexcept>
 #include <string>
+#include <vector>
+#include <utility>
 #include <iostream>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
+
+static EZRelayShards *draining_shards = NULL;
+
+//SIGTERM lets open requests finish, new ones are refused meanwhile
+static void drainOnSignal(int) {
+	if(draining_shards != NULL) {
+		draining_shards->drain();
+	}
+}
 
 void usage() {
 	std::cout << "Behaves as a TCP relay for applications." << std::endl;
@@ -14,8 +28,24 @@ void usage() {
 	std::cout << "Optional arguments:" << std::endl;
 	std::cout << "    -p <port:integer> -- port for the relay -- default value is 8000" << std::endl;
 	std::cout << "    -n <hostname:string> -- hostname for the relay -- default value is 'localhost'" << std::endl;
+	std::cout << "    -r <port:integer> -- port client data connections rendezvous on, thread i uses port+i -- default value is one picked by the kernel" << std::endl;
+	std::cout << "    -s <port:integer> -- serves metrics on 127.0.0.1:port, thread i uses port+i -- default is off" << std::endl;
+	std::cout << "    -u <path:string> -- serves metrics on a Unix socket at path, thread i > 0 uses path.i -- default is off" << std::endl;
+	std::cout << "    -x <every:integer> -- traces the setup stages of one in every requests into the metrics -- default is off" << std::endl;
+	std::cout << "    -j <tracefile:string> -- writes traced requests as Chrome trace JSON, thread i > 0 uses tracefile.i, implies -x 1 unless given" << std::endl;
 	std::cout << "    -b <tcpbacklog:integer> -- backlog for tcp connections -- default value is 10" << std::endl;
+	std::cout << "    -e <backend:string> -- event loop backend, 'epoll', 'poll' or 'uring' -- default value is 'epoll'" << std::endl;
+	std::cout << "    -z <pipesize:integer> -- bytes of pipe capacity per forwarding direction -- default value is the kernel's" << std::endl;
+	std::cout << "    -t <threads:integer> -- event loops, each serving its own share of clients -- default value is 1" << std::endl;
+	std::cout << "    -o <milliseconds:integer> -- time a client has to connect back for a request, and a new connection to say hello -- default value is 30000, 0 is no limit" << std::endl;
+	std::cout << "    -i <milliseconds:integer> -- closes requests that move no data for this long -- default is off" << std::endl;
+	std::cout << "    -d <milliseconds:integer> -- on SIGTERM, closes requests still open after this long -- default is to wait for them" << std::endl;
+	std::cout << "    -w <bytes:integer> -- bytes a second each client's requests may forward, requests over it wait their turn -- default is no limit" << std::endl;
+	std::cout << "    -q <requests:integer> -- requests a second each client may accept, requests over it wait in the backlog -- default is no limit" << std::endl;
+	std::cout << "    -g <service:string>:<port:integer> -- serves the named service, whose clients share one public port, on port; may be repeated -- default is a port picked by the kernel" << std::endl;
+	std::cout << "    -k <path:string> -- takes over the sockets of the relay started with the same path, which drains, and hands them on to the next one -- default is off" << std::endl;
 	std::cout << "    -v -- prints debug and error information." << std::endl;
+	std::cout << "    -l <logfile:string> -- appends debug and error information to logfile instead of printing it, implies -v" << std::endl;
 	std::cout << "    -h -- prints this usage information" << std::endl;
 }
 
@@ -32,28 +62,101 @@ int main(int argc, char *argv[]) {
 	std::size_t posp, posb;
 	std::string hostname = "";
 	int port = -1;
+	int rendezvous = -1;
+	int stats = -1;
+	std::string statspath = "";
+	int sampling = -1;
+	std::string tracefile = "";
 	int backlog = -1;
+	std::string backend = "";
+	int pipesize = -1;
+	int threads = -1;
+	int setup = -1;
+	int idle = -1;
+	int drain = -1;
+	long long byterate = -1;
+	int requestrate = -1;
+	std::vector<std::pair<std::string, int> > serviceports;
+	std::string handoff = "";
 	int verbose = false;
+	std::string logfile = "";
 	int c;
-	while ((c = getopt (argc, argv, "p:n:b:hv")) != -1) {
+	while ((c = getopt (argc, argv, "p:r:s:u:x:j:n:b:e:z:t:o:i:d:w:q:g:k:l:hv")) != -1) {
     	switch (c) {
 			case 'p':
 				port = std::stoi(optarg, &posp);
 				break;
+			case 'r':
+				rendezvous = std::stoi(optarg);
+				break;
+			case 's':
+				stats = std::stoi(optarg);
+				break;
+			case 'u':
+				statspath = optarg;
+				break;
+			case 'x':
+				sampling = std::stoi(optarg);
+				break;
+			case 'j':
+				tracefile = optarg;
+				break;
 			case 'n':
 				hostname = optarg;
 				break;
 			case 'b':
 				backlog = std::stoi(optarg, &posb);
 				break;
+			case 'e':
+				backend = optarg;
+				break;
+			case 'z':
+				pipesize = std::stoi(optarg);
+				break;
+			case 't':
+				threads = std::stoi(optarg);
+				break;
+			case 'o':
+				setup = std::stoi(optarg);
+				break;
+			case 'i':
+				idle = std::stoi(optarg);
+				break;
+			case 'd':
+				drain = std::stoi(optarg);
+				break;
+			case 'w':
+				byterate = std::stoll(optarg);
+				break;
+			case 'q':
+				requestrate = std::stoi(optarg);
+				break;
+			case 'g': {
+				std::string service = optarg;
+				size_t colon = service.rfind(':');
+				if(colon == std::string::npos || colon == 0 || colon > EZCTL_MAX_SERVICE) {
+					std::cout << "Invalid service port (<service>:<port>): " << service << std::endl;
+					usage();
+					return 1;
+				}
+				serviceports.push_back(std::make_pair(service.substr(0, colon), std::stoi(service.substr(colon + 1))));
+				break;
+			}
+			case 'k':
+				handoff = optarg;
+				break;
 			case 'v':
 				verbose = true;
 				break;
+			case 'l':
+				logfile = optarg;
+				verbose = true;
+				break;
 			case 'h':
 				usage();
 				return 1;
 			case '?':
-				if (optopt == 'b' || optopt == 'p' || optopt == 'n') {
+				if (optopt == 'b' || optopt == 'p' || optopt == 'r' || optopt == 's' || optopt == 'u' || optopt == 'x' || optopt == 'j' || optopt == 'n' || optopt == 'e' || optopt == 'z' || optopt == 't' || optopt == 'o' || optopt == 'i' || optopt == 'd' || optopt == 'w' || optopt == 'q' || optopt == 'g' || optopt == 'k' || optopt == 'l') {
 					fprintf (stderr, "Option -%c requires an argument\n", optopt);
 				}
 				else if (isprint (optopt)) {
@@ -68,44 +171,154 @@ int main(int argc, char *argv[]) {
 				abort ();
 		}
 	}
-	EZRelay relay;
-
-	if(port != -1) {
-		if(port < 1001 || port > 65535) {
-			std::cout << "Invalid port (1001-65535): " << port << std::endl;
+	if(threads != -1 && (threads < 1 || threads > 256)) {
+		std::cout << "Invalid thread count (1-256): " << threads << std::endl;
+		usage();
+		return 1;
+	}
+	if(port != -1 && (port < 1001 || port > 65535)) {
+		std::cout << "Invalid port (1001-65535): " << port << std::endl;
+		usage();
+		return 1;
+	}
+	if(rendezvous != -1 && (rendezvous < 1001 || rendezvous + std::max(threads, 1) - 1 > 65535)) {
+		std::cout << "Invalid rendezvous port (1001-65535 for every thread): " << rendezvous << std::endl;
+		usage();
+		return 1;
+	}
+	if(stats != -1 && (stats < 1001 || stats + std::max(threads, 1) - 1 > 65535)) {
+		std::cout << "Invalid stats port (1001-65535 for every thread): " << stats << std::endl;
+		usage();
+		return 1;
+	}
+	if(sampling != -1 && sampling < 1) {
+		std::cout << "Invalid trace sampling (1 or more): " << sampling << std::endl;
+		usage();
+		return 1;
+	}
+	if(tracefile != "" && sampling == -1) {
+		sampling = 1;
+	}
+	if(backlog != -1 && (backlog < 1 || backlog > 1023)) {
+		std::cout << "Invalid backlog (1-1023): " << backlog << std::endl;
+		usage();
+		return 1;
+	}
+	if(pipesize != -1 && (pipesize < 4096 || pipesize > 1048576)) {
+		std::cout << "Invalid pipe size (4096-1048576): " << pipesize << std::endl;
+		usage();
+		return 1;
+	}
+	if(setup < -1 || idle < -1 || drain < -1) {
+		std::cout << "Invalid timeout (0 or more milliseconds)" << std::endl;
+		usage();
+		return 1;
+	}
+	if(byterate < -1 || requestrate < -1) {
+		std::cout << "Invalid rate limit (0 or more a second)" << std::endl;
+		usage();
+		return 1;
+	}
+	for(size_t i = 0; i < serviceports.size(); i++) {
+		if(serviceports[i].second < 1001 || serviceports[i].second > 65535) {
+			std::cout << "Invalid port for service " << serviceports[i].first << " (1001-65535): " << serviceports[i].second << std::endl;
 			usage();
 			return 1;
-		} else {
-			relay.setCommsPort(port);
 		}
 	}
-	if(hostname != "") {
-		relay.setRelayHostname(std::string(hostname));
+	if(backend != "" && backend != "poll" && backend != "epoll" && backend != "uring") {
+		std::cout << "Invalid backend (epoll, poll, uring): " << backend << std::endl;
+		usage();
+		return 1;
 	}
-	if(backlog != -1) {
-		if(backlog < 1 || backlog > 1023) {
-			std::cout << "Invalid backlog (1-1023): " << backlog << std::endl;
-			usage();
-			return 1;
-		} else {
+	if(logfile != "" && !Log::setOutput(logfile)) {
+		std::cout << "Unable to open log file: " << logfile << std::endl;
+		usage();
+		return 1;
+	}
+	EZRelayShards shards;
+	if(threads != -1) {
+		shards.setThreads(threads);
+	}
+	shards.configure([&](EZRelay &relay) {
+		if(port != -1) {
+			relay.setCommsPort(port);
+		}
+		if(hostname != "") {
+			relay.setRelayHostname(std::string(hostname));
+		}
+		if(backlog != -1) {
 			relay.setBacklogSize(backlog);
 		}
+		if(pipesize != -1) {
+			relay.setPipeSize(pipesize);
+		}
+		if(backend == "poll") {
+			relay.setPollBackend(EZPoller::poll_backend);
+		} else if(backend == "epoll") {
+			relay.setPollBackend(EZPoller::epoll_backend);
+		} else if(backend == "uring") {
+			relay.setIOUringEnabled(true);
+		}
+		if(verbose) {
+			relay.setVerboseOutput(true);
+		}
+		if(sampling != -1) {
+			relay.setTraceSampling(sampling);
+		}
+		if(setup != -1) {
+			relay.setSetupTimeout(setup);
+		}
+		if(idle != -1) {
+			relay.setIdleTimeout(idle);
+		}
+		if(drain != -1) {
+			relay.setDrainTimeout(drain);
+		}
+		if(byterate != -1) {
+			relay.setByteRate((uint64_t)byterate);
+		}
+		if(requestrate != -1) {
+			relay.setRequestRate(requestrate);
+		}
+		for(size_t i = 0; i < serviceports.size(); i++) {
+			relay.setServicePort(serviceports[i].first, serviceports[i].second);
+		}
+	});
+	if(rendezvous != -1) {
+		shards.setRendezvousPort(rendezvous);
+	}
+	if(stats != -1) {
+		shards.setStatsPort(stats);
+	}
+	if(statspath != "") {
+		shards.setStatsSocket(statspath);
 	}
-	if(verbose) {
-		relay.setVerboseOutput(true);
+	if(handoff != "") {
+		shards.setHandOffSocket(handoff);
 	}
+	if(tracefile != "" && !shards.setTraceFile(tracefile)) {
+		std::cout << "Unable to open trace file: " << tracefile << std::endl;
+		usage();
+		return 1;
+	}
+	//a peer closing mid-splice must not kill the relay
+	signal(SIGPIPE, SIG_IGN);
+	draining_shards = &shards;
+	signal(SIGTERM, drainOnSignal);
 	try {
-		relay.listen();
+		shards.listen();
 	} catch (const std::exception& e) {
 		print_exception(e);
         return 1;
 	}
+	EZRelay &relay = shards.shard(0);
+	if(backend == "uring" && !relay.isIOUringActive()) {
+		std::cout << "io_uring unavailable, using " << EZPoller::backendName(relay.getPollBackend()) << std::endl;
+	}
 	try {
-		relay.run(5000);
 		std::cout << "Relay operational, begin connecting to " << relay.getRelayHostname() << ":" << std::to_string(relay.getCommsPort()) << std::endl;
-		while(1) {
-			relay.run(10000);
-		}
+		shards.run(10000);
 	} catch (const std::exception& e) {
 		print_exception(e);
         return 1;